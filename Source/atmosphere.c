@@ -0,0 +1,175 @@
+/*!
+ * \file atmosphere.c
+ * \brief Tabulated standard atmosphere
+ *
+ * The atmosphere is worked out once on an even altitude grid by
+ * InitAtmosphere() and after that every lookup is an index and a linear
+ * interpolation, no pow() and no walking the layers.
+ *
+ * The troposphere is the same model the drag has always used. Above it the
+ * pressure is integrated up through the temperature layers, so the air thins
+ * out smoothly instead of stopping dead at 44 km. Past the last layer at 86 km
+ * the air is held at a constant temperature and keeps falling off
+ * exponentially until the top of the table, where it is treated as vacuum.
+ */
+#include <math.h>
+#include <stdio.h>
+#include "structs.h"
+#include "atmosphere.h"
+
+#define ATMOSPHERE_BOTTOM -1000.0
+#define ATMOSPHERE_TOP 200.0e3
+#define ATMOSPHERE_STEP 25.0
+#define ATMOSPHERE_POINTS 8041      // (TOP - BOTTOM)/STEP + 1
+#define TROPOPAUSE 11.019e3
+
+#define R_AIR 287.05
+#define GAMMA_AIR 1.4
+#define G_0 9.80665
+
+static double density[ATMOSPHERE_POINTS];
+static double pressure[ATMOSPHERE_POINTS];
+static double temperature[ATMOSPHERE_POINTS];
+static double speedOfSound[ATMOSPHERE_POINTS];
+static int initilized = 0;
+
+static int cell(double h, double *f);
+static double zTemperature(double h);
+static double troposphere(double h);
+
+/*!
+ * Fills in the tables. Has to be called before anything is flown, and before
+ * any threads are started.
+ */
+void InitAtmosphere(void)
+{
+    int i;
+    double h, T, p;
+
+    if (initilized)
+        return;
+
+    for (i = 0; i < ATMOSPHERE_POINTS; i++)
+    {
+        h = ATMOSPHERE_BOTTOM + i*ATMOSPHERE_STEP;
+        T = zTemperature(h) + 273;  //K
+
+        if (h < TROPOPAUSE)
+            p = troposphere(h);
+        else
+        {
+            // Hydrostatic: dp/dh = -p g / (R T), trapezoid in ln(p)
+            p = pressure[i - 1] * exp(-G_0/R_AIR * ATMOSPHERE_STEP
+                                      * 0.5*(1.0/temperature[i - 1] + 1.0/T));
+        }
+
+        temperature[i] = T;
+        pressure[i] = p;
+        density[i] = p/(R_AIR*T);
+        speedOfSound[i] = sqrt(GAMMA_AIR*R_AIR*T);
+    }
+
+    // Space
+    density[ATMOSPHERE_POINTS - 1] = 0.0;
+    pressure[ATMOSPHERE_POINTS - 1] = 0.0;
+
+    initilized = 1;
+}
+
+/*!
+ * Everything about the air at an altitude.
+ * \param h Altitude above the ellipsoid (m)
+ * \return density (kg/m^3), pressure (Pa), temperature (K) and speed of
+ * sound (m/s)
+ */
+atmosphere Atmosphere(double h)
+{
+    atmosphere air;
+    double f;
+    int k = cell(h, &f);
+
+    air.density = density[k] + f*(density[k + 1] - density[k]);
+    air.pressure = pressure[k] + f*(pressure[k + 1] - pressure[k]);
+    air.temperature = temperature[k] + f*(temperature[k + 1] - temperature[k]);
+    air.speedOfSound = speedOfSound[k] + f*(speedOfSound[k + 1] - speedOfSound[k]);
+
+    return air;
+}
+
+/*!
+ * Just the density, which is all that drag needs.
+ * \param h Altitude above the ellipsoid (m)
+ * \return density (kg/m^3)
+ */
+double AtmosphereDensity(double h)
+{
+    double f;
+    int k = cell(h, &f);
+
+    return density[k] + f*(density[k + 1] - density[k]);
+}
+
+/*!
+ * The raw tables, for code that wants to do its own lookups (eg. the batch
+ * propagator).
+ */
+atmosphereTable AtmosphereTable(void)
+{
+    atmosphereTable tab;
+
+    tab.bottom = ATMOSPHERE_BOTTOM;
+    tab.top = ATMOSPHERE_TOP;
+    tab.invStep = 1.0/ATMOSPHERE_STEP;
+    tab.length = ATMOSPHERE_POINTS;
+    tab.density = density;
+    tab.pressure = pressure;
+    tab.temperature = temperature;
+    tab.speedOfSound = speedOfSound;
+
+    return tab;
+}
+
+/**
+ * Which grid cell h is in, and how far along it. Anything off the ends of
+ * the table is clamped to them.
+ */
+static int cell(double h, double *f)
+{
+    double u = (h - ATMOSPHERE_BOTTOM) * (1.0/ATMOSPHERE_STEP);
+    int k;
+
+    if (u < 0)
+        u = 0;
+    if (u > ATMOSPHERE_POINTS - 1)
+        u = ATMOSPHERE_POINTS - 1;
+    k = (int) u;
+    if (k > ATMOSPHERE_POINTS - 2)
+        k = ATMOSPHERE_POINTS - 2;
+    *f = u - k;
+
+    return k;
+}
+
+static double troposphere(double h)
+{
+    return 100*pow((44331.5 - h)/11880.516, 1.0/0.190263);
+}
+
+static double zTemperature(double h)
+{
+    if (h < 11.019e3)
+        return -0.0065*h + 15.0;
+    if (h >= 11.019e3 && h < 20.063e3)
+        return -56.5;
+    if (h >= 20.063e3 && h < 32.162e3)
+        return 0.001*h - 76.563;
+    if (h >= 32.162e3 && h < 47.350e3)
+        return 0.0028*h - 134.554;
+    if (h >= 47.350e3 && h < 51.413e3)
+        return -1.974;
+    if (h >= 51.413e3 && h < 71.802e3)
+        return -0.0028*h + 141.982;
+    if (h >= 71.802e3 && h < 86.0e3)
+        return -0.002*h + 84.540;
+    return -87.460;
+}
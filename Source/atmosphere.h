@@ -0,0 +1,9 @@
+/*!
+ * \file atmosphere.h
+ * \brief Tabulated standard atmosphere
+ */
+
+void InitAtmosphere(void);
+atmosphere Atmosphere(double h);
+double AtmosphereDensity(double h);
+atmosphereTable AtmosphereTable(void);
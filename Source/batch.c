@@ -0,0 +1,539 @@
+/*!
+ * \file batch.c
+ * \brief Flies many rockets at once in lockstep
+ *
+ * The state of every lane is kept as one array per component (x, y, z, U_x,
+ * ...) so that the force models can be run over all of the lanes with SIMD.
+ * The acceleration kernel is built for AVX-512, AVX2 and plain x86-64 and the
+ * best one is picked when the program starts. Lanes that have landed are
+ * masked out of the update and stop costing anything once the whole batch is
+ * down.
+ *
+ * The events (ignition, burnout, apogee, separation and hitting the ground)
+ * are the same as in run() and are checked one lane at a time between steps,
+ * writing into each lane's own simContext. So are the coasts through vacuum,
+ * which jump a lane along its orbit and leave it a zero length step.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "structs.h"
+#include "vecmath.h"
+#include "coord.h"
+#include "physics.h"
+#include "orbit.h"
+#include "atmosphere.h"
+#include "events.h"
+#include "kepler.h"
+#include "batch.h"
+
+#define LANE_ALIGN 64
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define SIMD_CLONES
+#endif
+
+typedef struct {int lanes;
+                    int stride;
+                    double *block;
+                    atmosphereTable air;
+                    /* State */
+                    double *x, *y, *z;
+                    double *vx, *vy, *vz;
+                    double *ax, *ay, *az;
+                    double *fuel;
+                    double *met;
+                    double *h;
+                    /* What each lane looks like right now */
+                    double *active;
+                    double *dryMass;
+                    double *cdA;
+                    double *thrustOn;
+                    double *sinPhi;
+                    double *cosPhi;
+                    double *ignition;
+                    double *fuelRate;
+                    /* Runge-Kutta scratch */
+                    double *tx, *ty, *tz;
+                    double *tvx, *tvy, *tvz;
+                    double *gx, *gy, *gz;
+                    double *kx, *ky, *kz;
+                    double *kvx, *kvy, *kvz;
+                    double *tfuel, *dfuel, *kfuel;
+                    /* Bookkeeping for the events, not used by the kernels */
+                    state *lastState;
+                    double *eventTime;
+                    double *metStart;} batch;
+
+static void batchInit(batch *b, int lanes);
+static void batchFree(batch *b);
+static void flyStage(batch *b, motorTable *tab, simContext *sims, int stage);
+static void setLaneMode(batch *b, simContext *sim, int lane);
+static int laneEvents(batch *b, simContext *sim, int lane, double h, int notLastStage);
+static state laneState(batch *b, int lane);
+static void rk4Step(batch *b, motorTable *tab);
+static void acceleration(batch *b, motorTable *tab, const double *x, const double *y, const double *z, const double *vx, const double *vy, const double *vz, const double *fuel, double point, double *ax, double *ay, double *az, double *dfuel);
+
+void BatchFly(simContext *sims, int n)
+{
+    batch b;
+    int stage;
+
+    if (n <= 0)
+        return;
+
+    batchInit(&b, n);
+
+    // From the launch pad, or from wherever a snapshot left every lane
+    for (stage = sims[0].currentStage->description.stage; stage < sims[0].numberOfStages; stage++)
+    {
+        flyStage(&b, &sims[0].stages[stage].description.motors[0].table, sims, stage);
+    }
+
+    batchFree(&b);
+}
+
+/**
+ * The same as run(), but for every lane at once
+ */
+static void flyStage(batch *b, motorTable *tab, simContext *sims, int stage)
+{
+    int i, flying;
+    double h = sims[0].h;
+    int notLastStage = (stage < sims[0].numberOfStages - 1);
+
+    // Init
+    for (i = 0; i < b->lanes; i++)
+    {
+        simContext *sim = &sims[i];
+        Rocket_Stage *st;
+        state r;
+
+        PrimeStage(sim, stage);
+        st = sim->currentStage;
+        st->steps = 0;
+        r = st->initialState;
+
+        b->x[i] = r.s.i;
+        b->y[i] = r.s.j;
+        b->z[i] = r.s.k;
+        b->vx[i] = r.U.i;
+        b->vy[i] = r.U.j;
+        b->vz[i] = r.U.k;
+        b->fuel[i] = r.fuelMass;
+        b->met[i] = sim->met;
+        b->metStart[i] = sim->met;
+        b->sinPhi[i] = sin(sim->launchAngle);
+        b->cosPhi[i] = cos(sim->launchAngle);
+        b->active[i] = 1.0;
+        b->lastState[i] = r;
+        b->eventTime[i] = HUGE_VAL;
+        if (st->mode == INIT)
+            b->eventTime[i] = sim->met + st->description.ignitionDelay;
+        else if (st->mode == BURNING)
+            b->eventTime[i] = BurnoutTime(sim);
+        b->ignition[i] = sim->ignitionTime;
+        setLaneMode(b, sim, i);
+    }
+
+    /* Run until every lane has hit the ground or it's taking too long */
+    for (;;)
+    {
+        flying = 0;
+        for (i = 0; i < b->lanes; i++)
+        {
+            if (b->active[i] == 0)
+                continue;
+            flying += laneEvents(b, &sims[i], i, h, notLastStage);
+        }
+        if (flying == 0)
+            break;
+
+        rk4Step(b, tab);
+
+        for (i = 0; i < b->lanes; i++)
+        {
+            if (b->active[i] == 0)
+                continue;
+            // The step worked out the acceleration we started from
+            b->lastState[i].a.i = b->ax[i];
+            b->lastState[i].a.j = b->ay[i];
+            b->lastState[i].a.k = b->az[i];
+            b->met[i] += b->h[i];
+            sims[i].currentStage->steps++;
+        }
+    }
+
+    for (i = 0; i < b->lanes; i++)
+    {
+        simContext *sim = &sims[i];
+        Rocket_Stage *st = sim->currentStage;
+
+        if (st->separationState.met == 0.0)
+        {
+            st->separationState = laneState(b, i);
+            st->separationState.a = LinearAcceleration(sim, st->separationState, b->met[i]);
+        }
+        // Leave the lane's clocks where the stage above starts from
+        sim->met = st->separationState.met;
+        sim->jd += SecondsToDecDay(sim->met - b->metStart[i]);
+    }
+}
+
+/**
+ * One lane's worth of the state logic from run(), and the size of the lane's
+ * next step. Returns 0 once the lane has hit the ground.
+ */
+static int laneEvents(batch *b, simContext *sim, int lane, double h, int notLastStage)
+{
+    Rocket_Stage *stage = sim->currentStage;
+    state lastState = b->lastState[lane];
+    state currentState = laneState(b, lane);
+    double currentAltitude = Altitude(currentState);
+    double met = b->met[lane];
+    double q;
+    state event;
+
+    // Taking too long
+    if (met - b->metStart[lane] >= 10000)
+    {
+        b->active[lane] = 0;
+        return 0;
+    }
+
+    /* Apogee and the ground, on the step that just finished. The dense
+     * output needs the acceleration at the end of the step, which the kernel
+     * hasn't worked out yet, so only do it when there is something to find */
+    if (currentAltitude < 0
+        || (RadialVelocity(sim, lastState) > 0 && RadialVelocity(sim, currentState) <= 0))
+    {
+        currentState.a = LinearAcceleration(sim, currentState, met);
+        if (LocateEvent(sim, RadialVelocity, lastState, currentState, &event))
+            stage->apogeeState = event;
+        if (currentAltitude < 0)
+        {
+            if (!LocateEvent(sim, GroundEvent, lastState, currentState, &event))
+                event = lastState;
+            stage->splashdownState = event;
+            b->active[lane] = 0;
+            return 0;
+        }
+    }
+
+    if (stage->mode == INIT
+        && met >= b->eventTime[lane] - EVENT_SLOP)
+    {
+        stage->mode = BURNING;
+        sim->ignitionTime = met;
+        sim->ignitionFuelMass = b->fuel[lane];
+        b->ignition[lane] = met;
+        b->eventTime[lane] = BurnoutTime(sim);
+        setLaneMode(b, sim, lane);
+    }
+    if (stage->mode == BURNING
+        && met >= b->eventTime[lane] - EVENT_SLOP)
+    {
+        stage->mode = COASING;
+        stage->burnoutState = currentState;
+        b->eventTime[lane] = HUGE_VAL;
+        if (notLastStage > 0)
+            b->eventTime[lane] = met + stage->description.stageDelay;
+        setLaneMode(b, sim, lane);
+    }
+    if (stage->mode == COASING
+        && met >= b->eventTime[lane] - EVENT_SLOP)
+    {
+        stage->separationState = currentState;
+        stage->mode = SEPARATED;
+        b->eventTime[lane] = HUGE_VAL;
+        setLaneMode(b, sim, lane);
+    }
+
+    // Worst of the ride so far
+    q = Kinematics(currentState).dynamicPressure;
+    if (q > stage->maxQ)
+    {
+        stage->maxQ = q;
+        stage->maxQState = currentState;
+    }
+
+    // Nothing but gravity, so jump along the orbit and have the kernel stand
+    // still this time round
+    if (InVacuum(sim, currentState))
+    {
+        double step;
+        int atApogee;
+        double maxStep = fmin(b->eventTime[lane] - met,
+                              10000 - (met - b->metStart[lane]));
+
+        currentState = KeplerCoast(currentState, maxStep, &step, &atApogee);
+        b->x[lane] = currentState.s.i;
+        b->y[lane] = currentState.s.j;
+        b->z[lane] = currentState.s.k;
+        b->vx[lane] = currentState.U.i;
+        b->vy[lane] = currentState.U.j;
+        b->vz[lane] = currentState.U.k;
+        b->met[lane] = currentState.met;
+        if (atApogee)
+            stage->apogeeState = currentState;
+        b->lastState[lane] = currentState;
+        b->h[lane] = 0;
+        return 1;
+    }
+
+    b->lastState[lane] = currentState;
+
+    // Land on the next event rather than stepping over it
+    b->h[lane] = h;
+    if (b->eventTime[lane] - met < h)
+        b->h[lane] = b->eventTime[lane] - met;
+
+    return 1;
+}
+
+/**
+ * The parts of RocketMass(), Force_Drag(), Force_Thrust() and MDot() that only
+ * change when the stage changes mode
+ */
+static void setLaneMode(batch *b, simContext *sim, int lane)
+{
+    Rocket_Stage *stage = sim->currentStage;
+
+    UpdateMassCache(sim);
+    b->dryMass[lane] = sim->cachedMass;
+    if (stage->mode < SEPARATED)
+        b->cdA[lane] = 0.8 * 0.09 * sim->cdScale;
+    else
+        b->cdA[lane] = 1.4 * 10.0 * sim->cdScale;
+    b->thrustOn[lane] = (stage->mode == BURNING) ? sim->thrustScale : 0.0;
+    b->fuelRate[lane] = 0.0;
+    if (stage->mode == BURNING)
+        b->fuelRate[lane] = sim->thrustScale
+                          / (g_0 * sim->ispScale * stage->description.motors[0].isp);
+}
+
+static state laneState(batch *b, int lane)
+{
+    state r;
+
+    r.s.i = b->x[lane];
+    r.s.j = b->y[lane];
+    r.s.k = b->z[lane];
+    r.U.i = b->vx[lane];
+    r.U.j = b->vy[lane];
+    r.U.k = b->vz[lane];
+    r.a = ZeroVec();
+    r.fuelMass = b->fuel[lane];
+    r.met = b->met[lane];
+
+    return r;
+}
+
+/**
+ * The same fourth-order Runge-Kutta as rk4(), over every lane. Lanes that
+ * are not active keep their old state.
+ */
+static void rk4Step(batch *b, motorTable *tab)
+{
+    int i, n = b->lanes;
+    double *x = b->x, *y = b->y, *z = b->z;
+    double *vx = b->vx, *vy = b->vy, *vz = b->vz;
+    double *tx = b->tx, *ty = b->ty, *tz = b->tz;
+    double *tvx = b->tvx, *tvy = b->tvy, *tvz = b->tvz;
+    double *gx = b->gx, *gy = b->gy, *gz = b->gz;
+    double *kx = b->kx, *ky = b->ky, *kz = b->kz;
+    double *kvx = b->kvx, *kvy = b->kvy, *kvz = b->kvz;
+    double *fuel = b->fuel, *tfuel = b->tfuel, *kfuel = b->kfuel;
+    const double *dfuel = b->dfuel;
+    const double *ax = b->ax, *ay = b->ay, *az = b->az;
+    const double *active = b->active;
+    const double *h = b->h;
+
+    /* First Steps */
+    acceleration(b, tab, x, y, z, vx, vy, vz, fuel, 0, b->ax, b->ay, b->az, b->dfuel);
+    #pragma omp simd
+    for (i = 0; i < n; i++)
+    {
+        kx[i] = vx[i];
+        ky[i] = vy[i];
+        kz[i] = vz[i];
+        kvx[i] = ax[i];
+        kvy[i] = ay[i];
+        kvz[i] = az[i];
+        tx[i] = x[i] + 0.5*h[i]*vx[i];
+        ty[i] = y[i] + 0.5*h[i]*vy[i];
+        tz[i] = z[i] + 0.5*h[i]*vz[i];
+        tvx[i] = vx[i] + 0.5*h[i]*ax[i];
+        tvy[i] = vy[i] + 0.5*h[i]*ay[i];
+        tvz[i] = vz[i] + 0.5*h[i]*az[i];
+        kfuel[i] = dfuel[i];
+        tfuel[i] = fuel[i] + 0.5*h[i]*dfuel[i];
+    }
+
+    /* Second Steps */
+    acceleration(b, tab, tx, ty, tz, tvx, tvy, tvz, tfuel, 0.5, gx, gy, gz, b->dfuel);
+    #pragma omp simd
+    for (i = 0; i < n; i++)
+    {
+        kx[i] += 2*tvx[i];
+        ky[i] += 2*tvy[i];
+        kz[i] += 2*tvz[i];
+        kvx[i] += 2*gx[i];
+        kvy[i] += 2*gy[i];
+        kvz[i] += 2*gz[i];
+        tx[i] = x[i] + 0.5*h[i]*tvx[i];
+        ty[i] = y[i] + 0.5*h[i]*tvy[i];
+        tz[i] = z[i] + 0.5*h[i]*tvz[i];
+        tvx[i] = vx[i] + 0.5*h[i]*gx[i];
+        tvy[i] = vy[i] + 0.5*h[i]*gy[i];
+        tvz[i] = vz[i] + 0.5*h[i]*gz[i];
+        kfuel[i] += 2*dfuel[i];
+        tfuel[i] = fuel[i] + 0.5*h[i]*dfuel[i];
+    }
+
+    /* Third Steps */
+    acceleration(b, tab, tx, ty, tz, tvx, tvy, tvz, tfuel, 0.5, gx, gy, gz, b->dfuel);
+    #pragma omp simd
+    for (i = 0; i < n; i++)
+    {
+        kx[i] += 2*tvx[i];
+        ky[i] += 2*tvy[i];
+        kz[i] += 2*tvz[i];
+        kvx[i] += 2*gx[i];
+        kvy[i] += 2*gy[i];
+        kvz[i] += 2*gz[i];
+        tx[i] = x[i] + h[i]*tvx[i];
+        ty[i] = y[i] + h[i]*tvy[i];
+        tz[i] = z[i] + h[i]*tvz[i];
+        tvx[i] = vx[i] + h[i]*gx[i];
+        tvy[i] = vy[i] + h[i]*gy[i];
+        tvz[i] = vz[i] + h[i]*gz[i];
+        kfuel[i] += 2*dfuel[i];
+        tfuel[i] = fuel[i] + h[i]*dfuel[i];
+    }
+
+    /* Fourth Steps */
+    acceleration(b, tab, tx, ty, tz, tvx, tvy, tvz, tfuel, 1.0, gx, gy, gz, b->dfuel);
+
+    /* Add it up, leaving the landed lanes where they are */
+    #pragma omp simd
+    for (i = 0; i < n; i++)
+    {
+        double on = active[i];
+        x[i] += on * (h[i]/6.0) * (kx[i] + tvx[i]);
+        y[i] += on * (h[i]/6.0) * (ky[i] + tvy[i]);
+        z[i] += on * (h[i]/6.0) * (kz[i] + tvz[i]);
+        vx[i] += on * (h[i]/6.0) * (kvx[i] + gx[i]);
+        vy[i] += on * (h[i]/6.0) * (kvy[i] + gy[i]);
+        vz[i] += on * (h[i]/6.0) * (kvz[i] + gz[i]);
+        fuel[i] += on * (h[i]/6.0) * (kfuel[i] + dfuel[i]);
+    }
+}
+
+/**
+ * LinearAcceleration() for every lane: point mass gravity, drag and thrust
+ * along the launch angle in the local ENU frame. point is how far into its
+ * step each lane is, as a fraction of the step. The rate the fuel is burning
+ * at goes in dfuel.
+ */
+SIMD_CLONES
+static void acceleration(batch *b, motorTable *tab, const double *x, const double *y, const double *z, const double *vx, const double *vy, const double *vz, const double *fuel, double point, double *ax, double *ay, double *az, double *dfuel)
+{
+    int i, n = b->lanes;
+    const double *met = b->met;
+    const double *ignition = b->ignition;
+    const double *h = b->h;
+    const double *dryMass = b->dryMass;
+    const double *cdA = b->cdA;
+    const double *thrustOn = b->thrustOn;
+    const double *fuelRate = b->fuelRate;
+    const double *sinPhi = b->sinPhi;
+    const double *cosPhi = b->cosPhi;
+    const double *table = tab->thrust;
+    double t0 = tab->t0, t1 = tab->t1, invDt = tab->invDt;
+    double last = tab->length - 1;
+    const double *airDensity = b->air.density;
+    double airBottom = b->air.bottom, airInvStep = b->air.invStep;
+    double airLast = b->air.length - 1;
+
+    #pragma omp simd
+    for (i = 0; i < n; i++)
+    {
+        double r2 = x[i]*x[i] + y[i]*y[i] + z[i]*z[i];
+        double r = sqrt(r2);
+        double invR = 1.0 / r;
+        double invMass = 1.0 / (dryMass[i] + fuel[i]);
+        double gravity = G * Me * invR * invR * invR;
+        double alt = r - Re;
+
+        /* Atmosphere, out of the same table as Force_Drag() */
+        double ua = fmin(fmax((alt - airBottom) * airInvStep, 0.0), airLast);
+        int ka = (int) fmin(ua, airLast - 1);
+        double rho = airDensity[ka] + (ua - ka) * (airDensity[ka + 1] - airDensity[ka]);
+
+        double v = sqrt(vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i]);
+        double drag = -0.5 * rho * v * cdA[i] * invMass;
+
+        /* Thrust, straight out of the resampled table */
+        double t = met[i] - ignition[i] + point*h[i];
+        double u = fmin(fmax((t - t0) * invDt, 0.0), last);
+        int k = (int) fmin(u, last - 1);
+        double thrust = table[k] + (u - k) * (table[k + 1] - table[k]);
+        double burning = (double) ((t >= t0) & (t <= t1));
+        thrust *= burning;
+        dfuel[i] = -thrust * fuelRate[i];
+        thrust *= thrustOn[i];
+
+        /* Local east and up without any trig */
+        double invRhoXY = 1.0 / sqrt(x[i]*x[i] + y[i]*y[i]);
+        double east = thrust * sinPhi[i] * invMass * invRhoXY;
+        double up = thrust * cosPhi[i] * invMass * invR;
+
+        ax[i] = gravity*x[i] + drag*vx[i] - east*y[i] + up*x[i];
+        ay[i] = gravity*y[i] + drag*vy[i] + east*x[i] + up*y[i];
+        az[i] = gravity*z[i] + drag*vz[i] + up*z[i];
+    }
+}
+
+static void batchInit(batch *b, int lanes)
+{
+    double **arrays[] = {&b->x, &b->y, &b->z, &b->vx, &b->vy, &b->vz,
+                         &b->ax, &b->ay, &b->az, &b->fuel, &b->met,
+                         &b->active, &b->dryMass, &b->cdA, &b->thrustOn,
+                         &b->sinPhi, &b->cosPhi,
+                         &b->ignition, &b->fuelRate,
+                         &b->tx, &b->ty, &b->tz, &b->tvx, &b->tvy, &b->tvz,
+                         &b->gx, &b->gy, &b->gz, &b->kx, &b->ky, &b->kz,
+                         &b->kvx, &b->kvy, &b->kvz,
+                         &b->tfuel, &b->dfuel, &b->kfuel,
+                         &b->h, &b->eventTime, &b->metStart};
+    int numArrays = sizeof(arrays) / sizeof(arrays[0]);
+    int i;
+
+    b->air = AtmosphereTable();
+
+    // Each array starts on its own cache line
+    b->lanes = lanes;
+    b->stride = (lanes + LANE_ALIGN/sizeof(double) - 1) & ~(LANE_ALIGN/sizeof(double) - 1);
+    if (posix_memalign((void **) &b->block, LANE_ALIGN, numArrays * b->stride * sizeof(double)) != 0)
+        b->block = NULL;
+    b->lastState = malloc(lanes * sizeof(state));
+    if (b->block == NULL || b->lastState == NULL)
+    {
+        printf("Out of memory for %d lanes\n", lanes);
+        exit(1);
+    }
+    memset(b->block, 0, numArrays * b->stride * sizeof(double));
+
+    for (i = 0; i < numArrays; i++)
+        *arrays[i] = b->block + i * b->stride;
+}
+
+static void batchFree(batch *b)
+{
+    free(b->block);
+    free(b->lastState);
+}
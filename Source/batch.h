@@ -0,0 +1,18 @@
+/*!
+ * \file batch.h
+ * \brief Flies many rockets at once in lockstep
+ *
+ * A structure-of-arrays version of Fly() with fixed step RK4. Every
+ * simulation in a batch is a lane, and gravity, drag and thrust are worked
+ * out for all of the lanes in one pass with SIMD.
+ */
+
+/*!
+ * Flies every stage of every simulation in sims, the same as calling Fly() on
+ * each of them, but side by side. The simulations must all be copies of the
+ * same rocket (they may be dispersed), all on the same stage, and must not
+ * have output files.
+ * \param sims The simulations to fly, one per lane
+ * \param n How many simulations there are
+ */
+void BatchFly(simContext *sims, int n);
@@ -0,0 +1,302 @@
+/*!
+ * \file bench.c
+ * \brief Microbenchmarks of the physics and integration hot paths
+ *
+ * Every benchmark is a loop of n calls. n is doubled until the loop takes at
+ * least BENCH_TIME, then the loop is timed BENCH_REPEATS times and the fastest
+ * one kept, since anything else the machine was doing can only have slowed
+ * it down. The inputs are the same every time, the rocket from the config
+ * file a second off the pad and thrust curves made up here, so two runs on
+ * the same machine can be held up against each other.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "structs.h"
+#include "vecmath.h"
+#include "coord.h"
+#include "physics.h"
+#include "atmosphere.h"
+#include "rk4.h"
+#include "rout.h"
+#include "orbit.h"
+#include "bench.h"
+
+#define BENCH_TIME 0.2          // Shortest loop worth timing, in seconds
+#define BENCH_REPEATS 5
+#define BENCH_INPUTS 1024       // How many different inputs to go round
+#define BENCH_SHORT_CURVE 16
+#define BENCH_LONG_CURVE 4096
+
+typedef struct {simContext sim;
+                    state r;                        // A second into the flight
+                    double h;
+                    double altitudes[BENCH_INPUTS];
+                    double times[BENCH_INPUTS];     // 0 to 1, along the curves
+                    vec2 shortCurve[BENCH_SHORT_CURVE];
+                    vec2 longCurve[BENCH_LONG_CURVE];
+                    FILE *null;} benchFixture;
+
+/* Runs n calls and returns how many integration steps they took, which is
+ * just n for everything but whole flights */
+typedef struct {const char *name;
+                    long (*loop)(benchFixture *f, long n);} benchmark;
+
+static long benchRk4(benchFixture *f, long n);
+static long benchAcceleration(benchFixture *f, long n);
+static long benchDensity(benchFixture *f, long n);
+static long benchShortCurve(benchFixture *f, long n);
+static long benchLongCurve(benchFixture *f, long n);
+static long benchEnu(benchFixture *f, long n);
+static long benchEnuToEcef(benchFixture *f, long n);
+static long benchStateLine(benchFixture *f, long n);
+static long benchFlight(benchFixture *f, long n);
+static void fixtureInit(benchFixture *f);
+static void makeCurve(vec2 *curve, int length);
+static double timeLoop(const benchmark *b, benchFixture *f, long n, long *steps);
+
+static const benchmark benchmarks[] = {
+    {"rk4", benchRk4},
+    {"LinearAcceleration", benchAcceleration},
+    {"AtmosphereDensity", benchDensity},
+    {"Interpolat1D/16", benchShortCurve},
+    {"Interpolat1D/4096", benchLongCurve},
+    {"enu", benchEnu},
+    {"EnuToEcef", benchEnuToEcef},
+    {"PrintStateLine", benchStateLine},
+    {"run", benchFlight},
+};
+
+/* Everything the loops work out ends up here, so none of it can be left out */
+static volatile double sink;
+
+void Benchmark(const char *name, int format)
+{
+    benchFixture *f;
+    int count = sizeof(benchmarks) / sizeof(benchmark);
+    int i, k;
+
+    // Far too big for the stack with the long curve in it
+    f = malloc(sizeof(benchFixture));
+    if (f == NULL)
+    {
+        printf("Out of memory for the benchmarks\n");
+        exit(1);
+    }
+    fixtureInit(f);
+
+    if (format == SUMMARY_JSON)
+    {
+        printf("{\"config\":");
+        JsonString(stdout, name);
+        printf(",\"benchmarks\":[");
+    }
+    for (i = 0; i < count; i++)
+    {
+        const benchmark *b = &benchmarks[i];
+        double best, seconds;
+        long n = 1;
+        long steps, bestSteps;
+
+        // Long enough to time
+        while (timeLoop(b, f, n, &steps) < BENCH_TIME)
+            n *= 2;
+
+        best = HUGE_VAL;
+        bestSteps = steps;
+        for (k = 0; k < BENCH_REPEATS; k++)
+        {
+            seconds = timeLoop(b, f, n, &steps);
+            if (seconds < best)
+            {
+                best = seconds;
+                bestSteps = steps;
+            }
+        }
+
+        if (format == SUMMARY_CSV)
+            printf("%s,%s,%ld,%.6g,%.6g\n"
+                ,   name
+                ,   b->name
+                ,   n
+                ,   best / n * 1e9
+                ,   bestSteps / best);
+        else
+            printf("%s{\"name\":\"%s\",\"iterations\":%ld,\"nsPerOp\":%.6g,\"stepsPerSecond\":%.6g}"
+                ,   i ? "," : ""
+                ,   b->name
+                ,   n
+                ,   best / n * 1e9
+                ,   bestSteps / best);
+        fflush(stdout);
+    }
+    if (format == SUMMARY_JSON)
+        printf("]}\n");
+
+    fclose(f->null);
+    FreeSimContext(&f->sim);
+    free(f);
+}
+
+static long benchRk4(benchFixture *f, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        sink = rk4(&f->sim, f->r, f->h).s.i;
+    return n;
+}
+
+static long benchAcceleration(benchFixture *f, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        sink = LinearAcceleration(&f->sim, f->r, f->r.met).i;
+    return n;
+}
+
+static long benchDensity(benchFixture *f, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        sink = AtmosphereDensity(f->altitudes[i % BENCH_INPUTS]);
+    return n;
+}
+
+static long benchShortCurve(benchFixture *f, long n)
+{
+    double end = f->shortCurve[BENCH_SHORT_CURVE - 1].i;
+    long i;
+
+    for (i = 0; i < n; i++)
+        sink = Interpolat1D(f->shortCurve, f->times[i % BENCH_INPUTS] * end, BENCH_SHORT_CURVE);
+    return n;
+}
+
+static long benchLongCurve(benchFixture *f, long n)
+{
+    double end = f->longCurve[BENCH_LONG_CURVE - 1].i;
+    long i;
+
+    for (i = 0; i < n; i++)
+        sink = Interpolat1D(f->longCurve, f->times[i % BENCH_INPUTS] * end, BENCH_LONG_CURVE);
+    return n;
+}
+
+static long benchEnu(benchFixture *f, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        sink = enu(f->r).m[0][0];
+    return n;
+}
+
+static long benchEnuToEcef(benchFixture *f, long n)
+{
+    vec up = {0, 0, 1};
+    long i;
+
+    for (i = 0; i < n; i++)
+        sink = EnuToEcef(up, f->r).i;
+    return n;
+}
+
+static long benchStateLine(benchFixture *f, long n)
+{
+    long i;
+
+    for (i = 0; i < n; i++)
+        PrintStateLine(f->null, &f->sim, f->sim.jd, f->r);
+    return n;
+}
+
+/**
+ * The whole of the config's flight, as orbit -s flies it but on this thread
+ */
+static long benchFlight(benchFixture *f, long n)
+{
+    simContext sim;
+    long steps = 0;
+    long i;
+    int j;
+
+    for (i = 0; i < n; i++)
+    {
+        InitSimContext(&sim);
+        sim.verbose = 0;
+        sim.concurrent = 0;
+        Fly(&sim);
+        for (j = 0; j < sim.numberOfStages; j++)
+            steps += sim.stages[j].steps;
+        sink = sim.stages[sim.numberOfStages - 1].splashdownState.met;
+        FreeSimContext(&sim);
+    }
+    return steps;
+}
+
+static void fixtureInit(benchFixture *f)
+{
+    double t;
+    int i;
+
+    InitSimContext(&f->sim);
+    f->sim.verbose = 0;
+    f->sim.concurrent = 0;
+    f->h = f->sim.h;
+
+    // Off the pad and into the air, with the motor burning
+    PrimeStage(&f->sim, 0);
+    f->r = f->sim.currentStage->initialState;
+    for (t = 0; t < 1.0; t += f->h)
+    {
+        f->r = rk4(&f->sim, f->r, f->h);
+        f->sim.met += f->h;
+        f->sim.jd += SecondsToDecDay(f->h);
+        f->r.met = f->sim.met;
+    }
+
+    // Spread evenly but out of order, the way a flight would never ask
+    for (i = 0; i < BENCH_INPUTS; i++)
+    {
+        f->times[i] = fmod(i * 0.6180339887498949, 1.0);
+        f->altitudes[i] = f->times[i] * 120000.0;
+    }
+    makeCurve(f->shortCurve, BENCH_SHORT_CURVE);
+    makeCurve(f->longCurve, BENCH_LONG_CURVE);
+
+    f->null = fopen("/dev/null", "w");
+    if (f->null == NULL)
+    {
+        printf("File Handle error. Couldn't open /dev/null\n");
+        exit(1);
+    }
+}
+
+/**
+ * A thrust curve of length points over 10 s, shaped like a real one
+ */
+static void makeCurve(vec2 *curve, int length)
+{
+    int i;
+
+    for (i = 0; i < length; i++)
+    {
+        curve[i].i = 10.0 * i / (length - 1);
+        curve[i].j = 1000.0 * (1.0 + 0.5 * exp(-curve[i].i)) * (1.0 - pow(curve[i].i / 10.0, 8));
+    }
+}
+
+static double timeLoop(const benchmark *b, benchFixture *f, long n, long *steps)
+{
+    struct timespec begin, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    *steps = b->loop(f, n);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) * 1e-9;
+}
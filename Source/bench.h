@@ -0,0 +1,15 @@
+/*!
+ * \file bench.h
+ * \brief Microbenchmarks of the physics and integration hot paths
+ */
+
+/*!
+ * Times rk4(), LinearAcceleration(), AtmosphereDensity(), Interpolat1D() on
+ * a short and a long curve, enu(), EnuToEcef(), PrintStateLine() and a whole
+ * flight of the rocket from the config file. Each one is printed with how
+ * many calls were timed, ns per call and integration steps per second (calls
+ * per second for everything but the flight).
+ * \param name The config file, to say what was flown
+ * \param format SUMMARY_JSON or SUMMARY_CSV, like orbit -s
+ */
+void Benchmark(const char *name, int format);
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include "structs.h"
 #include "vecmath.h"
 #include "physics.h"
@@ -6,6 +7,8 @@
 
 static double burnTime(motor m);
 
+#define MOTOR_TABLE_POINTS 4096
+
 double Position(state r)
 {
     return Norm(r.s);
@@ -46,43 +49,98 @@ double longitude(state r)
     return lon;
 }
 
+/**
+ * The local east, north and up unit vectors at r, straight from the ECEF
+ * position with no trig: the sines and cosines of latitude and longitude are
+ * just ratios of the position components. Latitude and longitude themselves
+ * (radians, the same as latitude() and longitude()) are only worked out if
+ * angles is set.
+ */
+localFrame LocalFrame(state r, int angles)
+{
+    return LocalFrameAt(r, Position(r), angles);
+}
+
+/**
+ * LocalFrame() for when |r.s| is already known
+ */
+localFrame LocalFrameAt(state r, double radius, int angles)
+{
+    localFrame f;
+    double rho = sqrt(Square(r.s.i) + Square(r.s.j));
+    double sLat = r.s.k / radius;
+    double cLat = rho / radius;
+    double sLon = 0.0;      // Any longitude will do at the poles
+    double cLon = 1.0;
+    
+    if (rho > 0)
+    {
+        sLon = r.s.j / rho;
+        cLon = r.s.i / rho;
+    }
+    
+    f.east.i = -sLon;
+    f.east.j = cLon;
+    f.east.k = 0;
+    f.north.i = -sLat * cLon;
+    f.north.j = -sLat * sLon;
+    f.north.k = cLat;
+    f.up.i = cLat * cLon;
+    f.up.j = cLat * sLon;
+    f.up.k = sLat;
+    
+    f.lat = 0;
+    f.lon = 0;
+    if (angles)
+    {
+        f.lat = PI/2.0 - acos(sLat);
+        if (r.s.i >= 0.0)
+            f.lon = asin(sLon);
+        else
+            f.lon = PI - asin(sLon);
+    }
+    
+    return f;
+}
+
+/**
+ * A vector in a local east, north, up frame in ECEF
+ */
+vec LocalToEcef(vec v, localFrame f)
+{
+    vec ecef;
+    
+    ecef.i = v.i*f.east.i + v.j*f.north.i + v.k*f.up.i;
+    ecef.j = v.i*f.east.j + v.j*f.north.j + v.k*f.up.j;
+    ecef.k = v.i*f.east.k + v.j*f.north.k + v.k*f.up.k;
+    
+    return ecef;
+}
+
 /**
  * Get a matix out that represents the local transformation from enu to ecef
  */
 matrix3 enu(state r)
 {
     matrix3 m3;
+    localFrame f = LocalFrame(r, 0);
     
-    // Make the call to lat. and lon. once
-    double lat = latitude(r);
-    double lon = longitude(r);
-    
-    // Make the calls to sin and cos a little as possible
-    double sLat = sin(lat);
-    double sLon = sin(lon);
-    double cLat = cos(lat);
-    double cLon = cos(lon);
-    
-    m3.m[0][0] = -sLon;
-    m3.m[0][1] = cLon;
-    m3.m[0][2] = 0;
-    m3.m[1][0] = -sLat * cLon;
-    m3.m[1][1] = -sLat * sLon;
-    m3.m[1][2] = cLat;
-    m3.m[2][0] = cLat * cLon;
-    m3.m[2][1] = cLat * sLon;
-    m3.m[2][2] = sLat;
+    m3.m[0][0] = f.east.i;
+    m3.m[0][1] = f.east.j;
+    m3.m[0][2] = f.east.k;
+    m3.m[1][0] = f.north.i;
+    m3.m[1][1] = f.north.j;
+    m3.m[1][2] = f.north.k;
+    m3.m[2][0] = f.up.i;
+    m3.m[2][1] = f.up.j;
+    m3.m[2][2] = f.up.k;
     
     return m3;
 }
 
 vec EnuToEcef(vec _enu, state r)
 {
-    matrix3 m;
-    
-    m = enu(r);
-     
-    return matrixMath(_enu, m);
+    return LocalToEcef(_enu, LocalFrame(r, 0));
 }
 
 vec BodyToEcef(vec body, vec rot)
@@ -125,28 +183,28 @@ vec cartesian(double rho, double theta, double phi)
 
 
 /**
- * Law of spherical cosines:
- * http://www.movable-type.co.uk/scripts/latlong.html
+ * Great circle distance from the launch site. The angle between the two
+ * local up vectors, from atan2 of their cross and dot products so it holds up
+ * for short distances too.
  */
 double Downrange(state r)
 {
-    double lat2, lon2, a;
-    double lat1, lon1;
-    double d;
-    state init;
-    
-    init = LaunchState();
-    
-    lat1 = latitude(init);
-    lon1 = longitude(init);
-    
-    lat2 = latitude(r);
-    lon2 = longitude(r);
+    return DownrangeAt(LocalFrame(r, 0).up);
+}
+
+/**
+ * Downrange() of the point on the ground straight below the unit vector up
+ */
+double DownrangeAt(vec b)
+{
+    vec a = LaunchFrame().up;
+    vec cross;
     
-    a = sin(lat1)*sin(lat2) + cos(lat1)*cos(lat2)*cos(lon2-lon1);
-    d = acos(a)*Re;
+    cross.i = a.j*b.k - a.k*b.j;
+    cross.j = a.k*b.i - a.i*b.k;
+    cross.k = a.i*b.j - a.j*b.i;
     
-    return d;
+    return atan2(Norm(cross), DotProd(a, b)) * Re;
 }
 
 double radians(double degrees)
@@ -154,6 +212,25 @@ double radians(double degrees)
     return (PI / 180.0) * degrees;
 }
 
+/**
+ * The east and north parts of a unit vector pointing azimuth (radians,
+ * clockwise from north) along the ground. PI is only good to 15 digits, so
+ * the rounding is cleaned off to keep due east exactly (1, 0).
+ */
+vec2 Heading(double azimuth)
+{
+    vec2 h;
+    
+    h.i = sin(azimuth);
+    h.j = cos(azimuth);
+    if (fabs(h.i) < 1e-12)
+        h.i = 0;
+    if (fabs(h.j) < 1e-12)
+        h.j = 0;
+    
+    return h;
+}
+
 double degrees(double radians)
 {
     double degree;
@@ -240,6 +317,86 @@ double Interpolat1D(vec2 *sample, double value, int dataLength)
     return answer;
 }
 
+/**
+ * Resamples the thrust curve of m onto an even time grid and adds up the
+ * impulse along it, so that MotorThrust() and MotorImpulse() never have to
+ * search the curve.
+ */
+void MotorTableInit(motor *m)
+{
+    motorTable *tab = &m->table;
+    double dt;
+    int i;
+    
+    tab->length = MOTOR_TABLE_POINTS;
+    tab->t0 = m->thrustCurve[0].i;
+    tab->t1 = m->thrustCurve[m->curveLength - 1].i;
+    dt = (tab->t1 - tab->t0) / (tab->length - 1);
+    tab->invDt = (dt > 0) ? 1.0 / dt : 0.0;
+    tab->thrust = malloc(tab->length * sizeof(double));
+    tab->impulse = malloc(tab->length * sizeof(double));
+    if (tab->thrust == NULL || tab->impulse == NULL)
+    {
+        printf("Out of memory for the thrust curve of %s\n", m->name);
+        exit(1);
+    }
+    
+    for (i = 0; i < tab->length; i++)
+        tab->thrust[i] = Interpolat1D(m->thrustCurve, tab->t0 + i*dt, m->curveLength);
+    // Make sure the end lands exactly on the curve
+    tab->thrust[tab->length - 1] = m->thrustCurve[m->curveLength - 1].j;
+    
+    // Trapezoids, which is exact for the straight lines between points
+    tab->impulse[0] = 0;
+    for (i = 1; i < tab->length; i++)
+        tab->impulse[i] = tab->impulse[i - 1] + 0.5*dt*(tab->thrust[i - 1] + tab->thrust[i]);
+}
+
+/**
+ * Thrust of m at time t into its burn, in constant time.
+ */
+double MotorThrust(motor *m, double t)
+{
+    motorTable *tab = &m->table;
+    double u;
+    int k;
+    
+    if (t < tab->t0 || t > tab->t1)
+        return 0;
+    
+    u = (t - tab->t0) * tab->invDt;
+    k = (int) u;
+    if (k > tab->length - 2)
+        k = tab->length - 2;
+    
+    return tab->thrust[k] + (u - k) * (tab->thrust[k + 1] - tab->thrust[k]);
+}
+
+/**
+ * Total impulse m has put out by time t into its burn, in constant time.
+ */
+double MotorImpulse(motor *m, double t)
+{
+    motorTable *tab = &m->table;
+    double u, f;
+    int k;
+    
+    if (t <= tab->t0)
+        return 0;
+    if (t >= tab->t1)
+        return tab->impulse[tab->length - 1];
+    
+    u = (t - tab->t0) * tab->invDt;
+    k = (int) u;
+    if (k > tab->length - 2)
+        k = tab->length - 2;
+    f = u - k;
+    
+    // Thrust is a straight line across the cell, so its integral is a quadratic
+    return tab->impulse[k] 
+         + f/tab->invDt * (tab->thrust[k] + 0.5*f*(tab->thrust[k + 1] - tab->thrust[k]));
+}
+
 double IntegrateVec2Array(vec2 *curve, int len)
 {
     int i;
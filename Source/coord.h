@@ -8,19 +8,27 @@ double Acceleration(state r);
 double Altitude(state r);
 double latitude(state r);
 double longitude(state r);
+localFrame LocalFrame(state r, int angles);
+localFrame LocalFrameAt(state r, double radius, int angles);
+vec LocalToEcef(vec v, localFrame f);
 matrix3 enu(state r);
 vec matrixMath(vec v, matrix3 m);
 vec EnuToEcef(vec _enu, state r);
 vec EulerToEcef(vec v, vec rot);
 vec cartesian(double rho, double theta, double phi);
 double Downrange(state r);
+double DownrangeAt(vec up);
 double radians(double degrees);
+vec2 Heading(double azimuth);
 double degrees(double radians);
 time_t JdToUnixTime(double JD);
 double SecondsToDecDay(double seconds);
 double DecDayToSeconds(double decDay);
 void SecondsToHmsString(double seconds, char *buffer);
 double Interpolat1D(vec2 *sample, double value, int dataLength);
+void MotorTableInit(motor *m);
+double MotorThrust(motor *m, double t);
+double MotorImpulse(motor *m, double t);
 double IntegrateVec2Array(vec2 *curve, int len);
 double AverageThrust(motor m);
 double AverageMdot(motor m);
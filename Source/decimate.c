@@ -0,0 +1,283 @@
+/*!
+ * \file decimate.c
+ * \brief Decides which states make it into the output files
+ *
+ * Three ways, set in the output section of the config file:
+ *
+ *  - interval: a line every output.interval seconds of flight.
+ *  - events: only the states either side of ignition, burnout and
+ *    separation, apogee and landing.
+ *  - thin: states are held back until it is known which ones can be left
+ *    out. A state is left out when the cubic Hermite curve between the kept
+ *    states either side of it (DenseOutput(), from their s, U and a) puts it
+ *    within output.position and output.velocity of where it really was, and
+ *    the straight line gnuplot draws between them passes within output.chord
+ *    of it.
+ *
+ * Thinning is greedy. From the last kept state it finds the furthest state
+ * it can reach in one piece, first by doubling and then by bisecting, keeps
+ * that one and starts again from there. Only the states the integrator
+ * stepped through are checked, so that is where the tolerances hold.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "structs.h"
+#include "vecmath.h"
+#include "coord.h"
+#include "rk4.h"
+#include "rout.h"
+#include "trajfile.h"
+#include "decimate.h"
+
+#define DECIMATE_WINDOW 4096    // Most states held back at once
+
+static void add(simContext *sim, decimator *d, unsigned int mode, double jd, state r);
+static void settle(simContext *sim, decimator *d);
+static void keepFurthest(simContext *sim, decimator *d, int hi);
+static void keep(simContext *sim, decimator *d, int j);
+static int fits(decimator *d, int j);
+static void lineBreak(simContext *sim);
+static int crossed(state a, state b);
+static double distance(vec a, vec b);
+
+void DecimateStart(simContext *sim, decimator *d)
+{
+    d->policy = sim->output;
+    d->samples = NULL;
+    d->jd = NULL;
+    d->count = 0;
+    d->capacity = 0;
+    d->good = 1;
+    d->next = 2;
+    d->mode = INIT;
+    d->anyPrinted = 0;
+    d->lastTime = 0;
+
+    if (d->policy.mode == OUTPUT_INTERVAL || !Printing(sim))
+        return;
+
+    // Events only ever need the last state kept and the one after it
+    d->capacity = d->policy.mode == OUTPUT_THIN ? DECIMATE_WINDOW : 2;
+    d->samples = malloc(d->capacity * sizeof(state));
+    d->jd = malloc(d->capacity * sizeof(double));
+    if (d->samples == NULL || d->jd == NULL)
+    {
+        printf("Out of memory for output thinning\n");
+        exit(1);
+    }
+}
+
+void DecimateSample(simContext *sim, decimator *d, unsigned int mode, double jd, state r)
+{
+    int crossing;
+
+    if (!Printing(sim))
+        return;
+
+    if (d->policy.mode == OUTPUT_INTERVAL)
+    {
+        if ((r.met - d->lastTime) <= d->policy.interval)
+            return;
+        if (d->anyPrinted && crossed(d->printed, r))
+            lineBreak(sim);
+        PrintState(sim, mode, jd, r);
+        d->printed = r;
+        d->anyPrinted = 1;
+        d->lastTime = r.met;
+        return;
+    }
+
+    if (d->count > 0)
+    {
+        crossing = crossed(d->samples[d->count - 1], r);
+        if (crossing || mode != d->mode)
+            DecimateFlush(sim, d);
+        if (crossing)
+            lineBreak(sim);
+    }
+    add(sim, d, mode, jd, r);
+}
+
+void DecimateEvent(simContext *sim, decimator *d, unsigned int mode, double jd, state r)
+{
+    if (!Printing(sim) || d->policy.mode == OUTPUT_INTERVAL)
+        return;
+
+    DecimateSample(sim, d, mode, jd, r);
+    settle(sim, d);
+}
+
+void DecimateFlush(simContext *sim, decimator *d)
+{
+    if (d->count == 0)
+        return;
+
+    settle(sim, d);
+    d->count = 0;
+}
+
+void DecimateEnd(simContext *sim, decimator *d)
+{
+    DecimateFlush(sim, d);
+    free(d->samples);
+    free(d->jd);
+    d->samples = NULL;
+    d->jd = NULL;
+}
+
+/**
+ * Holds r back, writing it straight away if there is nothing to draw from yet
+ */
+static void add(simContext *sim, decimator *d, unsigned int mode, double jd, state r)
+{
+    if (d->count == d->capacity)
+    {
+        if (d->policy.mode == OUTPUT_EVENTS)
+            d->count = 1;
+        else
+            settle(sim, d);
+    }
+
+    d->samples[d->count] = r;
+    d->jd[d->count] = jd;
+    d->count++;
+
+    if (d->count == 1)
+    {
+        d->mode = mode;
+        keep(sim, d, 0);
+        return;
+    }
+
+    // Find out how far the first state reaches, as far as there are states
+    while (d->next < d->count)
+    {
+        if (fits(d, d->next))
+        {
+            d->good = d->next;
+            d->next *= 2;
+        }
+        else
+            keepFurthest(sim, d, d->next);
+    }
+}
+
+/**
+ * Writes out states until the last one held back has been written, leaving it
+ * as the one to carry on from.
+ */
+static void settle(simContext *sim, decimator *d)
+{
+    int last;
+
+    while (d->count > 1)
+    {
+        last = d->count - 1;
+        if (d->good >= last || fits(d, last))
+            keep(sim, d, last);
+        else
+            keepFurthest(sim, d, last);
+    }
+}
+
+/**
+ * The first state reaches d->good but not hi. Keeps the furthest one between
+ * them it does reach.
+ */
+static void keepFurthest(simContext *sim, decimator *d, int hi)
+{
+    int lo = d->good;
+    int mid;
+
+    while (hi - lo > 1)
+    {
+        mid = (lo + hi) / 2;
+        if (fits(d, mid))
+            lo = mid;
+        else
+            hi = mid;
+    }
+    keep(sim, d, lo);
+}
+
+/**
+ * Writes state j and drops everything held back before it, so that it is the
+ * first state from now on.
+ */
+static void keep(simContext *sim, decimator *d, int j)
+{
+    PrintState(sim, d->mode, d->jd[j], d->samples[j]);
+    d->printed = d->samples[j];
+    d->anyPrinted = 1;
+
+    if (j > 0)
+    {
+        d->count -= j;
+        memmove(d->samples, d->samples + j, d->count * sizeof(state));
+        memmove(d->jd, d->jd + j, d->count * sizeof(double));
+    }
+    // The next state along is always reachable, nothing is in between
+    d->good = 1;
+    d->next = 2;
+}
+
+/**
+ * Whether every state between the first one and state j can be left out
+ */
+static int fits(decimator *d, int j)
+{
+    state a = d->samples[0];
+    state b = d->samples[j];
+    state r, actual;
+    vec line;
+    double span = b.met - a.met;
+    double tau;
+    int i;
+
+    if (d->policy.mode == OUTPUT_EVENTS)
+        return 1;
+
+    for (i = 1; i < j; i++)
+    {
+        actual = d->samples[i];
+        r = DenseOutput(a, b, actual.met);
+        if (distance(r.s, actual.s) > d->policy.position
+            || distance(r.U, actual.U) > d->policy.velocity)
+            return 0;
+
+        if (d->policy.chord > 0)
+        {
+            tau = span > 0 ? (actual.met - a.met) / span : 0;
+            line.i = a.s.i + tau*(b.s.i - a.s.i);
+            line.j = a.s.j + tau*(b.s.j - a.s.j);
+            line.k = a.s.k + tau*(b.s.k - a.s.k);
+            if (distance(line, actual.s) > d->policy.chord)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Lifts gnuplot's pen where the longitude changes sign, so the date line
+ * doesn't get a line drawn right across the map
+ */
+static void lineBreak(simContext *sim)
+{
+    PrintNote(sim, "Cross the line!");
+    PrintBreak(sim, TRAJ_ALL);
+}
+
+static int crossed(state a, state b)
+{
+    return (longitude(b) < 0 && longitude(a) > 0)
+        || (longitude(b) > 0 && longitude(a) < 0);
+}
+
+static double distance(vec a, vec b)
+{
+    return sqrt(Square(a.i - b.i) + Square(a.j - b.j) + Square(a.k - b.k));
+}
@@ -0,0 +1,33 @@
+/*!
+ * \file decimate.h
+ * \brief Decides which states make it into the output files
+ */
+
+/*!
+ * Gets d ready for a stage of sim, following sim's output policy
+ */
+void DecimateStart(simContext *sim, decimator *d);
+
+/*!
+ * Offers the state the stage has just reached in mode. It is written now,
+ * later or not at all, depending on the policy.
+ */
+void DecimateSample(simContext *sim, decimator *d, unsigned int mode, double jd, state r);
+
+/*!
+ * Like DecimateSample(), but r is always written (apogee, landing). Ignored
+ * when writing at fixed intervals.
+ */
+void DecimateEvent(simContext *sim, decimator *d, unsigned int mode, double jd, state r);
+
+/*!
+ * Writes whatever is being held back. Has to be called before anything that
+ * changes the stage's mass or thrust, since the states held back are written
+ * with the stage as it is when they go out.
+ */
+void DecimateFlush(simContext *sim, decimator *d);
+
+/*!
+ * Flushes d and frees it, at the end of the stage
+ */
+void DecimateEnd(simContext *sim, decimator *d);
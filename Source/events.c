@@ -0,0 +1,129 @@
+/*!
+ * \file events.c
+ * \brief Finding exactly when things happen inside a step
+ *
+ * Events that depend on the state (apogee, hitting the ground) are found
+ * after a step by looking for a sign change in an event function, and then
+ * pinned down with root finding on the dense output of the step. Events that
+ * only depend on time (ignition, burnout, separation) are known ahead of time
+ * and the step is cut short to land on them instead, since the forces change
+ * there.
+ */
+#include <math.h>
+#include "structs.h"
+#include "vecmath.h"
+#include "coord.h"
+#include "physics.h"
+#include "rk4.h"
+#include "events.h"
+
+#define EVENT_TOLERANCE 1.0e-10
+#define EVENT_ITERATIONS 100
+
+typedef struct {simContext *sim;
+                    eventFunction g;
+                    state last;
+                    state current;} denseEvent;
+
+static double denseEventValue(void *data, double t);
+static double fuelLeft(void *data, double t);
+
+int LocateEvent(simContext *sim, eventFunction g, state last, state current, state *event)
+{
+    denseEvent e;
+    double gLast, gCurrent, t;
+    
+    gLast = g(sim, last);
+    gCurrent = g(sim, current);
+    if (!(gLast > 0 && gCurrent <= 0))
+        return 0;
+    
+    e.sim = sim;
+    e.g = g;
+    e.last = last;
+    e.current = current;
+    
+    t = EventRoot(denseEventValue, &e, last.met, current.met, gLast, gCurrent);
+    *event = DenseOutput(last, current, t);
+    
+    return 1;
+}
+
+double EventRoot(double (*f)(void *data, double t), void *data, double a, double b, double fa, double fb)
+{
+    double c = b, fc;
+    int side = 0;
+    int i;
+    
+    if (fa == 0)
+        return a;
+    if (fb == 0)
+        return b;
+    
+    for (i = 0; i < EVENT_ITERATIONS; i++)
+    {
+        // Regula falsi
+        c = (a*fb - b*fa) / (fb - fa);
+        if (fabs(b - a) < EVENT_TOLERANCE * fmax(1.0, fabs(c)))
+            break;
+        
+        fc = f(data, c);
+        if (fc == 0)
+            break;
+        
+        // Illinois: if the same end sticks twice in a row, halve it so it
+        // doesn't hold up the convergence
+        if (fc*fb > 0)
+        {
+            b = c;
+            fb = fc;
+            if (side == -1)
+                fa *= 0.5;
+            side = -1;
+        }
+        else
+        {
+            a = c;
+            fa = fc;
+            if (side == +1)
+                fb *= 0.5;
+            side = +1;
+        }
+    }
+    
+    return c;
+}
+
+double BurnoutTime(simContext *sim)
+{
+    motor *m = &sim->currentStage->description.motors[0];
+    double start = sim->ignitionTime;
+    double end = sim->ignitionTime + m->table.t1;
+    double fuelEnd = FuelMass(sim, end);
+    
+    if (fuelEnd >= 0)
+        return end;
+    
+    return EventRoot(fuelLeft, sim, start, end, FuelMass(sim, start), fuelEnd);
+}
+
+double RadialVelocity(simContext *sim, state r)
+{
+    return DotProd(r.s, r.U) / Position(r);
+}
+
+double GroundEvent(simContext *sim, state r)
+{
+    return Altitude(r);
+}
+
+static double denseEventValue(void *data, double t)
+{
+    denseEvent *e = data;
+    return e->g(e->sim, DenseOutput(e->last, e->current, t));
+}
+
+static double fuelLeft(void *data, double t)
+{
+    return FuelMass(data, t);
+}
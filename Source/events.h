@@ -0,0 +1,41 @@
+/*!
+ * \file events.h
+ * \brief Finding exactly when things happen inside a step
+ */
+
+/*!
+ * Looks for g going from positive to zero or below between two states one
+ * step apart, and if it does, finds the exact time on the dense output.
+ * \param sim The simulation the states belong to
+ * \param g The event function
+ * \param last The state at the start of the step, with its acceleration
+ * \param current The state at the end of the step, with its acceleration
+ * \param event Filled in with the state at the event, if there was one
+ * \return 1 if the event happened in the step, otherwise 0
+ */
+int LocateEvent(simContext *sim, eventFunction g, state last, state current, state *event);
+
+/*!
+ * Finds a root of f between a and b, where f(a) and f(b) have different
+ * signs, with the Illinois method.
+ * \param f The function, given data and a time
+ * \param data Passed to f
+ * \return The time of the root
+ */
+double EventRoot(double (*f)(void *data, double t), void *data, double a, double b, double fa, double fb);
+
+/*!
+ * When the burning stage of sim will burn out: either the end of its thrust
+ * curve, or when it runs out of fuel if that comes first.
+ * \return The MET of burnout
+ */
+double BurnoutTime(simContext *sim);
+
+/*! Apogee event: how fast the stage is climbing (m/s) */
+double RadialVelocity(simContext *sim, state r);
+
+/*! Impact event: height above the ground (m) */
+double GroundEvent(simContext *sim, state r);
+
+// How close (s) counts as on time for an event the step was cut short for
+#define EVENT_SLOP 1.0e-9
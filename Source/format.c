@@ -0,0 +1,242 @@
+/*!
+ * \file format.c
+ * \brief Fast number formatting for the text output files
+ *
+ * printf works out every %e and %f digit by digit with arbitrary precision
+ * arithmetic, which is most of the time it takes to write a trajectory line.
+ * These write exactly the same characters for the few formats the output
+ * files use, but do it with one 128 bit multiply and shift (or divide).
+ *
+ * A double is m*2^e exactly, with m at most 53 bits. The digits wanted are
+ * m*2^e*10^k rounded to an integer, for k = precision (%f) or
+ * precision - exponent (%e). As long as m*10^k and 2^-e fit in 128 bits that
+ * can be worked out exactly and rounded half to even, like printf does.
+ * Anything that doesn't fit (huge, tiny, inf, nan, or no 128 bit integers
+ * on this compiler) is left to snprintf.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "format.h"
+
+#define FORMAT_DIGITS 17        // Most digits after the point done without snprintf
+
+static const uint64_t powers[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL};
+
+#ifdef __SIZEOF_INT128__
+static int decompose(double v, uint64_t *m, int *e);
+static int scaled(uint64_t m, int e, int scale, uint64_t *q);
+#endif
+static char *whole(char *out, uint64_t n);
+static char *padded(char *out, uint64_t n, int digits);
+
+char *FormatFixed(char *out, double v, int precision)
+{
+#ifdef __SIZEOF_INT128__
+    uint64_t m, q;
+    int e;
+
+    if (precision >= 0 && precision <= FORMAT_DIGITS
+        && decompose(v, &m, &e) && scaled(m, e, precision, &q))
+    {
+        if (signbit(v))
+            *out++ = '-';
+        out = whole(out, q / powers[precision]);
+        if (precision > 0)
+        {
+            *out++ = '.';
+            out = padded(out, q % powers[precision], precision);
+        }
+        *out = '\0';
+        return out;
+    }
+#endif
+    return out + snprintf(out, FORMAT_MAX, "%.*f", precision, v);
+}
+
+char *FormatExp(char *out, double v, int precision)
+{
+#ifdef __SIZEOF_INT128__
+    uint64_t m, q;
+    int e, exponent, bits;
+
+    if (precision >= 0 && precision <= FORMAT_DIGITS && decompose(v, &m, &e))
+    {
+        if (m == 0)
+        {
+            q = 0;
+            exponent = 0;
+        }
+        else
+        {
+            // |v| is at least 2^(bits - 1), so this is the exponent or one short
+            for (bits = 0; (m >> bits) > 1; bits++)
+                ;
+            exponent = (int) floor((e + bits) * 0.30102999566398119521);
+            if (!scaled(m, e, precision - exponent, &q))
+                goto fallback;
+            if (q > powers[precision + 1])
+            {
+                exponent++;
+                if (!scaled(m, e, precision - exponent, &q))
+                    goto fallback;
+            }
+            // Rounded up to the next power of ten
+            if (q == powers[precision + 1])
+            {
+                q = powers[precision];
+                exponent++;
+            }
+        }
+
+        if (signbit(v))
+            *out++ = '-';
+        *out++ = '0' + q / powers[precision];
+        if (precision > 0)
+        {
+            *out++ = '.';
+            out = padded(out, q % powers[precision], precision);
+        }
+        *out++ = 'e';
+        *out++ = exponent < 0 ? '-' : '+';
+        out = padded(out, exponent < 0 ? -exponent : exponent,
+                     abs(exponent) >= 100 ? 3 : 2);
+        *out = '\0';
+        return out;
+    }
+fallback:
+#endif
+    return out + snprintf(out, FORMAT_MAX, "%.*e", precision, v);
+}
+
+char *FormatText(char *out, const char *text)
+{
+    while (*text)
+        *out++ = *text++;
+
+    return out;
+}
+
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 wide;
+
+/**
+ * Splits |v| into m*2^e. Fails for inf and nan.
+ */
+static int decompose(double v, uint64_t *m, int *e)
+{
+    uint64_t bits;
+    int exponent;
+
+    memcpy(&bits, &v, sizeof(bits));
+    exponent = (bits >> 52) & 0x7ff;
+    *m = bits & ((1ULL << 52) - 1);
+
+    if (exponent == 0x7ff)
+        return 0;
+    if (exponent == 0)
+    {
+        *e = -1074;
+        return 1;
+    }
+    *m |= 1ULL << 52;
+    *e = exponent - 1075;
+
+    return 1;
+}
+
+/**
+ * m*2^e*10^scale rounded half to even into q. Fails if any of it doesn't fit.
+ */
+static int scaled(uint64_t m, int e, int scale, uint64_t *q)
+{
+    wide num = m;
+    wide den = 1;
+    wide rest, half;
+    int shift = 0;
+    int i;
+
+    // Bits each side would need, 10^k taking at most 3.33k
+    if (53 + (e > 0 ? e : 0) + (scale > 0 ? (scale*3322 + 999)/1000 : 0) > 127)
+        return 0;
+    if ((e < 0 ? -e : 0) + (scale < 0 ? (-scale*3322 + 999)/1000 : 0) > 126)
+        return 0;
+
+    if (e > 0)
+        num <<= e;
+    else
+        shift = -e;
+    for (i = 0; i < scale; i++)
+        num *= 10;
+    for (i = 0; i > scale; i--)
+        den *= 10;
+
+    if (den == 1)
+    {
+        if (shift > 0)
+        {
+            rest = num & (((wide) 1 << shift) - 1);
+            half = (wide) 1 << (shift - 1);
+            num >>= shift;
+            if (rest > half || (rest == half && (num & 1)))
+                num++;
+        }
+    }
+    else
+    {
+        den <<= shift;
+        rest = num % den;
+        num /= den;
+        if (rest > den - rest || (rest == den - rest && (num & 1)))
+            num++;
+    }
+
+    if (num > UINT64_MAX)
+        return 0;
+    *q = (uint64_t) num;
+
+    return 1;
+}
+#endif
+
+/**
+ * n in decimal, no leading zeros
+ */
+static char *whole(char *out, uint64_t n)
+{
+    char digits[20];
+    int i = 0;
+
+    do
+    {
+        digits[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    while (i > 0)
+        *out++ = digits[--i];
+
+    return out;
+}
+
+/**
+ * n in decimal, with leading zeros to make it digits long
+ */
+static char *padded(char *out, uint64_t n, int digits)
+{
+    int i;
+
+    for (i = digits - 1; i >= 0; i--)
+    {
+        out[i] = '0' + n % 10;
+        n /= 10;
+    }
+
+    return out + digits;
+}
@@ -0,0 +1,24 @@
+/*!
+ * \file format.h
+ * \brief Fast number formatting for the text output files
+ */
+
+#define FORMAT_MAX 336          // Most characters one number can take, with up to 17 digits after the point
+#define FORMAT_BUFFER (1 << 20) // Size of the stdio buffer for the big output files
+
+/*!
+ * Writes v the way printf("%.*f", precision, v) would, and returns where it
+ * finished. Writes at most FORMAT_MAX characters, and a terminating null.
+ */
+char *FormatFixed(char *out, double v, int precision);
+
+/*!
+ * Writes v the way printf("%.*e", precision, v) would, and returns where it
+ * finished. Writes at most FORMAT_MAX characters, and a terminating null.
+ */
+char *FormatExp(char *out, double v, int precision);
+
+/*!
+ * Copies text, without its null, and returns where it finished
+ */
+char *FormatText(char *out, const char *text);
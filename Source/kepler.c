@@ -0,0 +1,224 @@
+/*!
+ * \file kepler.c
+ * \brief Coasting through vacuum along a Kepler orbit
+ *
+ * Above the atmosphere and with the motor off, point mass gravity is the only
+ * force on the stage and its path is a conic. Instead of integrating that
+ * a hundredth of a second at a time, the state is moved along the orbit in
+ * one go with the universal variable formulation, which works the same for
+ * ellipses and hyperbolas.
+ */
+#include <math.h>
+#include "structs.h"
+#include "vecmath.h"
+#include "coord.h"
+#include "physics.h"
+#include "atmosphere.h"
+#include "events.h"
+#include "kepler.h"
+
+#define MU (-G*Me)
+#define KEPLER_TOLERANCE 1.0e-12
+#define KEPLER_ITERATIONS 50
+// How far above the top of the atmosphere (m) still counts as in it when
+// falling, so a coast that ends right on the edge isn't started again
+#define KEPLER_SLOP 1.0e-3
+
+static void stumpff(double z, double *c, double *s);
+
+/*!
+ * Whether sim's current stage has nothing but gravity acting on it: the motor
+ * isn't burning and it is above the atmosphere, or right at the top of it and
+ * still climbing.
+ */
+int InVacuum(simContext *sim, state r)
+{
+    double top = AtmosphereTable().top;
+    double alt = Altitude(r);
+
+    if (sim->currentStage->mode == BURNING)
+        return 0;
+    if (alt > top + KEPLER_SLOP)
+        return 1;
+    return (alt >= top && DotProd(r.s, r.U) > 0);
+}
+
+/*!
+ * Moves r dt seconds along its Kepler orbit.
+ */
+state KeplerPropagate(state r, double dt)
+{
+    state next;
+    double sqrtMu = sqrt(MU);
+    double r0 = Norm(r.s);
+    double v0 = Norm(r.U);
+    double vr0 = DotProd(r.s, r.U) / r0;
+    double alpha = 2.0/r0 - Square(v0)/MU;     // 1/a
+    double chi, z, c, s, F, dF, delta;
+    double f, g, fdot, gdot, rNew, gravity;
+    int i;
+
+    if (dt == 0)
+        return r;
+
+    /* Solve Kepler's equation for the universal anomaly with Newton */
+    chi = sqrtMu * fabs(alpha) * dt;
+    for (i = 0; i < KEPLER_ITERATIONS; i++)
+    {
+        z = alpha * Square(chi);
+        stumpff(z, &c, &s);
+        F = r0*vr0/sqrtMu * Square(chi)*c
+          + (1 - alpha*r0) * chi*chi*chi*s
+          + r0*chi - sqrtMu*dt;
+        dF = r0*vr0/sqrtMu * chi*(1 - z*s)
+           + (1 - alpha*r0) * Square(chi)*c
+           + r0;
+        delta = F/dF;
+        chi -= delta;
+        if (fabs(delta) < KEPLER_TOLERANCE * fmax(1.0, fabs(chi)))
+            break;
+    }
+
+    /* Lagrange coefficients */
+    z = alpha * Square(chi);
+    stumpff(z, &c, &s);
+    f = 1 - Square(chi)/r0 * c;
+    g = dt - chi*chi*chi/sqrtMu * s;
+
+    next.s.i = f*r.s.i + g*r.U.i;
+    next.s.j = f*r.s.j + g*r.U.j;
+    next.s.k = f*r.s.k + g*r.U.k;
+    rNew = Norm(next.s);
+
+    fdot = sqrtMu/(rNew*r0) * (z*chi*s - chi);
+    gdot = 1 - Square(chi)/rNew * c;
+
+    next.U.i = fdot*r.s.i + gdot*r.U.i;
+    next.U.j = fdot*r.s.j + gdot*r.U.j;
+    next.U.k = fdot*r.s.k + gdot*r.U.k;
+
+    gravity = -MU / (rNew*rNew*rNew);
+    next.a.i = gravity * next.s.i;
+    next.a.j = gravity * next.s.j;
+    next.a.k = gravity * next.s.k;
+
+    next.fuelMass = r.fuelMass;
+    next.met = r.met + dt;
+
+    return next;
+}
+
+/*!
+ * How long until r reaches the top of its orbit, or HUGE_VAL if it is already
+ * coming down or is never coming back.
+ */
+double KeplerApogeeTime(state r)
+{
+    double r0 = Norm(r.s);
+    double alpha = 2.0/r0 - Square(Norm(r.U))/MU;
+    double rv = DotProd(r.s, r.U);
+    double a, e, E, M;
+
+    if (alpha <= 0 || rv <= 0)
+        return HUGE_VAL;
+
+    a = 1.0/alpha;
+    e = sqrt(Square(1 - r0/a) + Square(rv)/(MU*a));
+    E = atan2(rv/sqrt(MU*a), 1 - r0/a);
+    M = E - e*sin(E);
+
+    return (PI - M) / sqrt(MU*alpha*alpha*alpha);
+}
+
+/*!
+ * How long until r comes back down through radius, or HUGE_VAL if it never
+ * does (it is in orbit, or escaping).
+ */
+double KeplerReentryTime(state r, double radius)
+{
+    double r0 = Norm(r.s);
+    double alpha = 2.0/r0 - Square(Norm(r.U))/MU;
+    double rv = DotProd(r.s, r.U);
+    double a, e, E, M, cosE, Ed, Md, t;
+
+    // Nothing that is climbing on an open orbit ever comes back, and nothing
+    // we launch can be falling on one
+    if (alpha <= 0)
+        return HUGE_VAL;
+
+    a = 1.0/alpha;
+    e = sqrt(Square(1 - r0/a) + Square(rv)/(MU*a));
+    if (a*(1 - e) >= radius)
+        return HUGE_VAL;
+
+    E = atan2(rv/sqrt(MU*a), 1 - r0/a);
+    M = E - e*sin(E);
+
+    // On the way down, so the eccentric anomaly is negative
+    cosE = (1 - radius/a)/e;
+    Ed = -acos(fmax(-1.0, fmin(1.0, cosE)));
+    Md = Ed - e*sin(Ed);
+
+    t = (Md - M) / sqrt(MU*alpha*alpha*alpha);
+    if (t < 0)
+        t += 2*PI / sqrt(MU*alpha*alpha*alpha);
+
+    return t;
+}
+
+/*!
+ * Coasts r along its orbit for maxStep seconds, or less if it gets to apogee
+ * or back to the top of the atmosphere first.
+ * \param r Where to start from
+ * \param maxStep The longest to coast for (s), may be HUGE_VAL
+ * \param step Set to how long it did coast for (s)
+ * \param apogee Set to 1 if it stopped at apogee, otherwise 0
+ * \return The state at the end of the coast
+ */
+state KeplerCoast(state r, double maxStep, double *step, int *apogee)
+{
+    double radius = Re + AtmosphereTable().top;
+    double toApogee = KeplerApogeeTime(r);
+    double dt = fmin(maxStep, KeplerReentryTime(r, radius));
+
+    // Already sitting on it, most likely because the last coast stopped there
+    if (toApogee < EVENT_SLOP)
+        toApogee = HUGE_VAL;
+
+    *apogee = 0;
+    if (toApogee <= dt)
+    {
+        dt = toApogee;
+        *apogee = 1;
+    }
+
+    *step = dt;
+    return KeplerPropagate(r, dt);
+}
+
+/**
+ * The Stumpff functions C(z) and S(z), with their series near zero where the
+ * closed forms lose everything to cancellation.
+ */
+static void stumpff(double z, double *c, double *s)
+{
+    double sz;
+
+    if (z > 1.0e-6)
+    {
+        sz = sqrt(z);
+        *c = (1 - cos(sz))/z;
+        *s = (sz - sin(sz))/(sz*sz*sz);
+    }
+    else if (z < -1.0e-6)
+    {
+        sz = sqrt(-z);
+        *c = (cosh(sz) - 1)/(-z);
+        *s = (sinh(sz) - sz)/(sz*sz*sz);
+    }
+    else
+    {
+        *c = 1.0/2.0 - z/24.0 + z*z/720.0;
+        *s = 1.0/6.0 - z/120.0 + z*z/5040.0;
+    }
+}
@@ -0,0 +1,5 @@
+int InVacuum(simContext *sim, state r);
+state KeplerPropagate(state r, double dt);
+double KeplerApogeeTime(state r);
+double KeplerReentryTime(state r, double radius);
+state KeplerCoast(state r, double maxStep, double *step, int *apogee);
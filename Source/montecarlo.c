@@ -0,0 +1,454 @@
+/*! 
+ * \file montecarlo.c
+ * \brief Monte Carlo dispersion campaigns
+ *  
+ * Every run gets its own simContext, so runs are handed out to one worker 
+ * thread per core. Each run seeds its own random numbers from the campaign
+ * seed and the run number, so the answers don't depend on how many threads
+ * there were or what order they finished in.
+ *
+ * Nothing is kept per run: each thread tallies what its runs did into its
+ * own statistics (see stats.h), and those are merged once everyone is done,
+ * so a million runs take no more memory than a hundred.
+ *
+ * When only the upper stages are dispersed, the runs all carry on from one
+ * snapshot of the flight (see snapshot.h) instead of each flying the same
+ * first stages again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "structs.h"
+#include "vecmath.h"
+#include "coord.h"
+#include "orbit.h"
+#include "batch.h"
+#include "stats.h"
+#include "snapshot.h"
+#include "montecarlo.h"
+
+#define NUM_RESULTS 6
+#define ELLIPSE_SIGMAS 3
+#define ELLIPSE_POINTS 72
+
+typedef struct {double thrustScale;
+                    double ispScale;
+                    double emptyMassScale;
+                    double launchAngle;
+                    double cdScale;
+                    double launchTime;
+                    flightResult result;} monteCarloRun;
+typedef struct {dispersionDesc d;
+                    snapshot *branch;       // What every run starts from, or NULL for the pad
+                    FILE *table;
+                    int next;} monteCarloJob;
+typedef struct {monteCarloJob *job;
+                    runningStats stats[NUM_RESULTS];
+                    tdigest digests[NUM_RESULTS];
+                    footprint impacts;} monteCarloTally;
+
+static void *worker(void *arg);
+static void *batchWorker(void *arg);
+static void disperse(monteCarloJob *job, int n, simContext *sim, monteCarloRun *run);
+static void branch(dispersionDesc d, snapshot *snap);
+static void tallyInit(monteCarloTally *t, monteCarloJob *job, flightResult nominal);
+static void tally(monteCarloTally *t, int n, monteCarloRun *run);
+static void tallyMerge(monteCarloTally *into, monteCarloTally *from);
+static unsigned long long splitmix64(unsigned long long *x);
+static void printSummary(monteCarloTally *t);
+static void writeFootprint(footprint *f);
+
+void MonteCarlo(dispersionDesc d)
+{
+    monteCarloJob job;
+    snapshot snap;
+    monteCarloTally *tallies;
+    pthread_t *threads;
+    simContext sim;
+    flightResult nominal;
+    int numThreads = d.threads;
+    int i;
+    void *(*work)(void *) = worker;
+    struct timespec begin, end;
+    
+    if (numThreads <= 0)
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads < 1)
+        numThreads = 1;
+    if (numThreads > d.runs)
+        numThreads = d.runs;
+    
+    // The batch propagator only knows fixed step RK4, pointed one way
+    if (d.batch > 0 && Integrator().method == RK4 && !Steered())
+    {
+        work = batchWorker;
+        if (numThreads > (d.runs + d.batch - 1) / d.batch)
+            numThreads = (d.runs + d.batch - 1) / d.batch;
+    }
+    
+    job.branch = NULL;
+    if (d.branch > 0)
+    {
+        branch(d, &snap);
+        job.branch = &snap;
+    }
+    
+    // The undispersed flight, to centre the footprint on
+    if (job.branch != NULL)
+        SnapshotStart(job.branch, &sim);
+    else
+        InitSimContext(&sim);
+    sim.verbose = 0;
+    sim.concurrent = 0;
+    Fly(&sim);
+    nominal = FlightResult(&sim);
+    FreeSimContext(&sim);
+    
+    job.d = d;
+    job.next = 0;
+    job.table = NULL;
+    tallies = malloc(numThreads * sizeof(monteCarloTally));
+    threads = malloc(numThreads * sizeof(pthread_t));
+    if (tallies == NULL || threads == NULL)
+    {
+        printf("Out of memory for %d threads\n", numThreads);
+        exit(1);
+    }
+    
+    /* One line per run, in whatever order they finish */
+    if (d.table)
+    {
+        job.table = fopen("Output/out-montecarlo.dat", "w");
+        if (job.table != NULL)
+            fprintf(job.table, "#Run\tThrust Scale\tIsp Scale\tEmpty Mass Scale\tLaunch Angle(°)"
+                               "\tCd Scale\tLaunch Time(s)\tApogee(m)\tBurnout Vel(m/s)"
+                               "\tImpact Lat(°)\tImpact Lon(°)\tDownrange(m)\tMax Q(Pa)\n");
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    
+    for (i = 0; i < numThreads; i++)
+    {
+        tallyInit(&tallies[i], &job, nominal);
+        pthread_create(&threads[i], NULL, work, &tallies[i]);
+    }
+    for (i = 0; i < numThreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (i > 0)
+            tallyMerge(&tallies[0], &tallies[i]);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    if (job.table != NULL)
+        fclose(job.table);
+    
+    printf("Flew %d runs on %d threads in %0.2f s\n\n"
+        ,   d.runs
+        ,   numThreads
+        ,   (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) * 1e-9);
+    printSummary(&tallies[0]);
+    writeFootprint(&tallies[0].impacts);
+    
+    free(threads);
+    free(tallies);
+    if (job.branch != NULL)
+        SnapshotFree(job.branch);
+}
+
+/**
+ * Grab the next run nobody has flown yet until they are all gone
+ */
+static void *worker(void *arg)
+{
+    monteCarloTally *t = arg;
+    monteCarloJob *job = t->job;
+    monteCarloRun run;
+    simContext sim;
+    int n;
+    
+    while ((n = __sync_fetch_and_add(&job->next, 1)) < job->d.runs)
+    {
+        disperse(job, n, &sim, &run);
+        Fly(&sim);
+        run.result = FlightResult(&sim);
+        FreeSimContext(&sim);
+        tally(t, n, &run);
+    }
+    
+    return NULL;
+}
+
+/**
+ * Same as worker(), but grabs d.batch runs at a time and flies them together
+ */
+static void *batchWorker(void *arg)
+{
+    monteCarloTally *t = arg;
+    monteCarloJob *job = t->job;
+    int lanes = job->d.batch;
+    simContext *sims = malloc(lanes * sizeof(simContext));
+    monteCarloRun *runs = malloc(lanes * sizeof(monteCarloRun));
+    int first, n, i;
+    
+    if (sims == NULL || runs == NULL)
+    {
+        printf("Out of memory for %d lanes\n", lanes);
+        exit(1);
+    }
+    
+    while ((first = __sync_fetch_and_add(&job->next, lanes)) < job->d.runs)
+    {
+        n = job->d.runs - first;
+        if (n > lanes)
+            n = lanes;
+        
+        for (i = 0; i < n; i++)
+            disperse(job, first + i, &sims[i], &runs[i]);
+        
+        BatchFly(sims, n);
+        
+        for (i = 0; i < n; i++)
+        {
+            runs[i].result = FlightResult(&sims[i]);
+            FreeSimContext(&sims[i]);
+            tally(t, first + i, &runs[i]);
+        }
+    }
+    
+    free(runs);
+    free(sims);
+    return NULL;
+}
+
+/**
+ * Set up sim as run number n of the campaign
+ */
+static void disperse(monteCarloJob *job, int n, simContext *sim, monteCarloRun *run)
+{
+    dispersionDesc d = job->d;
+    unsigned long long rng = d.seed * 0x9E3779B97F4A7C15ULL + n;
+    double delay;
+    int i;
+    
+    if (job->branch != NULL)
+        SnapshotStart(job->branch, sim);
+    else
+        InitSimContext(sim);
+    sim->verbose = 0;
+    // The runs already have every core, so each flies its stages in turn
+    sim->concurrent = 0;
+    
+    run->thrustScale = 1.0 + d.thrustScale * GaussianRandom(&rng);
+    run->ispScale = 1.0 + d.isp * GaussianRandom(&rng);
+    run->emptyMassScale = 1.0 + d.emptyMass * GaussianRandom(&rng);
+    run->launchAngle = sim->launchAngle + radians(d.launchAngle * GaussianRandom(&rng));
+    run->cdScale = 1.0 + d.cd * GaussianRandom(&rng);
+    run->launchTime = d.launchTime * GaussianRandom(&rng);
+    
+    sim->thrustScale = run->thrustScale;
+    sim->ispScale = run->ispScale;
+    sim->launchAngle = run->launchAngle;
+    sim->cdScale = run->cdScale;
+    sim->jd += SecondsToDecDay(run->launchTime);
+    for (i = 0; i < sim->numberOfStages; i++)
+        sim->stages[i].description.emptyMass *= run->emptyMassScale;
+    
+    // Drawn for every upper stage whether it is flown or not, so run n gets
+    // the same numbers wherever the campaign branches
+    for (i = 1; i < sim->numberOfStages; i++)
+    {
+        delay = d.ignitionDelay * GaussianRandom(&rng);
+        if (i >= d.branch)
+            sim->stages[i].description.ignitionDelay = fmax(sim->stages[i].description.ignitionDelay + delay, 0);
+    }
+}
+
+/**
+ * The snapshot every run carries on from: out of d.snapshot if it was saved
+ * for this rocket, otherwise flown (and saved, if there is a file for it)
+ */
+static void branch(dispersionDesc d, snapshot *snap)
+{
+    simContext sim;
+    
+    if (d.snapshot != NULL && SnapshotLoad(d.snapshot, d.branch, snap))
+    {
+        printf("Every run carries on from stages.[%d] in %s\n", d.branch, d.snapshot);
+        return;
+    }
+    
+    InitSimContext(&sim);
+    sim.verbose = 0;
+    sim.concurrent = 0;
+    SnapshotTake(&sim, d.branch, snap);
+    FreeSimContext(&sim);
+    
+    printf("Every run carries on from stages.[%d]\n", d.branch);
+    if (d.snapshot != NULL)
+        SnapshotSave(d.snapshot, snap);
+}
+
+static void tallyInit(monteCarloTally *t, monteCarloJob *job, flightResult nominal)
+{
+    int j;
+    
+    t->job = job;
+    for (j = 0; j < NUM_RESULTS; j++)
+    {
+        StatsInit(&t->stats[j]);
+        DigestInit(&t->digests[j]);
+    }
+    FootprintInit(&t->impacts, nominal.impactLat, nominal.impactLon, job->d.footprint);
+}
+
+/**
+ * Add one flown run to this thread's tally, and to the table if there is one
+ */
+static void tally(monteCarloTally *t, int n, monteCarloRun *run)
+{
+    flightResult r = run->result;
+    double x[NUM_RESULTS] = {r.apogee, r.burnoutVelocity, r.maxQ,
+                             r.impactLat, r.impactLon, r.downrange};
+    int j;
+    
+    for (j = 0; j < NUM_RESULTS; j++)
+    {
+        StatsAdd(&t->stats[j], x[j]);
+        DigestAdd(&t->digests[j], x[j]);
+    }
+    FootprintAdd(&t->impacts, r.impactLat, r.impactLon);
+    
+    // One call per line, so lines from different threads don't get mixed up
+    if (t->job->table != NULL)
+        fprintf(t->job->table, "%d\t%0.6f\t%0.6f\t%0.6f\t%0.6f\t%0.6f\t%0.3f\t%0.3f\t%0.3f\t%0.8f\t%0.8f\t%0.3f\t%0.3f\n"
+            ,   n
+            ,   run->thrustScale
+            ,   run->ispScale
+            ,   run->emptyMassScale
+            ,   degrees(run->launchAngle)
+            ,   run->cdScale
+            ,   run->launchTime
+            ,   r.apogee
+            ,   r.burnoutVelocity
+            ,   r.impactLat
+            ,   r.impactLon
+            ,   r.downrange
+            ,   r.maxQ);
+}
+
+static void tallyMerge(monteCarloTally *into, monteCarloTally *from)
+{
+    int j;
+    
+    for (j = 0; j < NUM_RESULTS; j++)
+    {
+        StatsMerge(&into->stats[j], &from->stats[j]);
+        DigestMerge(&into->digests[j], &from->digests[j]);
+    }
+    FootprintMerge(&into->impacts, &from->impacts);
+}
+
+/**
+ * Box-Muller, throwing away the second number so there is no state to keep
+ * besides the generator.
+ */
+double GaussianRandom(unsigned long long *rng)
+{
+    double u1, u2;
+    
+    // (0, 1], never zero so the log is safe
+    u1 = ((splitmix64(rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
+    u2 = (splitmix64(rng) >> 11) * (1.0 / 9007199254740992.0);
+    
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * PI * u2);
+}
+
+static unsigned long long splitmix64(unsigned long long *x)
+{
+    unsigned long long z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void printSummary(monteCarloTally *t)
+{
+    char *names[NUM_RESULTS] = {"Apogee (m)", "Burnout Velocity (m/s)", "Max Q (Pa)",
+                                "Impact Lat (°)", "Impact Lon (°)", "Downrange (m)"};
+    double lat, lon, major, minor, azimuth;
+    int j;
+    
+    printf("%24s%16s%16s%16s%16s%16s%16s%16s\n", "", "Mean", "Std Dev", "Min", "5%", "50%", "95%", "Max");
+    for (j = 0; j < NUM_RESULTS; j++)
+        printf("%24s%16.4f%16.4f%16.4f%16.4f%16.4f%16.4f%16.4f\n"
+            ,   names[j]
+            ,   t->stats[j].mean
+            ,   StatsStdDev(&t->stats[j])
+            ,   t->stats[j].min
+            ,   DigestQuantile(&t->digests[j], 0.05)
+            ,   DigestQuantile(&t->digests[j], 0.50)
+            ,   DigestQuantile(&t->digests[j], 0.95)
+            ,   t->stats[j].max);
+    
+    FootprintEllipse(&t->impacts, ELLIPSE_SIGMAS, &lat, &lon, &major, &minor, &azimuth);
+    printf("\n%d sigma impact ellipse: centre %0.6f° %0.6f°, %0.1f m by %0.1f m, major axis %0.1f°\n"
+        ,   ELLIPSE_SIGMAS
+        ,   lat
+        ,   lon
+        ,   major
+        ,   minor
+        ,   azimuth);
+    if (t->impacts.outside > 0)
+        printf("%llu impacts fell outside the %0.0f m footprint\n", t->impacts.outside, t->impacts.halfWidth);
+    printf("\n");
+}
+
+/**
+ * The impact histogram as a lat/lon/count grid, one blank line between rows
+ * so gnuplot can splot it, and the dispersion ellipse around it
+ */
+static void writeFootprint(footprint *f)
+{
+    FILE *out;
+    double lat, lon, major, minor, azimuth, t, east, north;
+    int i, j;
+    
+    out = fopen("Output/out-footprint.dat", "w");
+    if (out != NULL)
+    {
+        fprintf(out, "#Lat(°)\tLon(°)\tImpacts\n");
+        for (i = 0; i < FOOTPRINT_BINS; i++)
+        {
+            for (j = 0; j < FOOTPRINT_BINS; j++)
+            {
+                FootprintBin(f, i, j, &lat, &lon);
+                fprintf(out, "%0.8f\t%0.8f\t%llu\n", lat, lon, f->counts[i][j]);
+            }
+            fprintf(out, "\n");
+        }
+        fclose(out);
+    }
+    
+    FootprintEllipse(f, ELLIPSE_SIGMAS, &lat, &lon, &major, &minor, &azimuth);
+    azimuth = radians(azimuth);
+    
+    out = fopen("Output/out-ellipse.dat", "w");
+    if (out != NULL)
+    {
+        fprintf(out, "#Lat(°)\tLon(°)\n");
+        for (i = 0; i <= ELLIPSE_POINTS; i++)
+        {
+            t = 2 * PI * i / ELLIPSE_POINTS;
+            east = f->meanEast + major * cos(t) * sin(azimuth) + minor * sin(t) * cos(azimuth);
+            north = f->meanNorth + major * cos(t) * cos(azimuth) - minor * sin(t) * sin(azimuth);
+            FootprintOffset(f, east, north, &lat, &lon);
+            fprintf(out, "%0.8f\t%0.8f\n", lat, lon);
+        }
+        fclose(out);
+    }
+}
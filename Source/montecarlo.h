@@ -0,0 +1,23 @@
+/*! 
+ * \file montecarlo.h
+ * \brief Monte Carlo dispersion campaigns
+ *  
+ * Flies the rocket from the config file many times, scattering the thrust,
+ * Isp, dry mass, launch angle, drag and launch time of each flight, and sums
+ * up where they all went.
+ */
+
+/*!
+ * Flies every run in the campaign on a pool of threads and prints a summary
+ * to the screen. One line per run goes to Output/out-montecarlo.dat unless
+ * d.table is 0, the impact histogram to Output/out-footprint.dat and the
+ * 3 sigma ellipse to Output/out-ellipse.dat. No trajectory files are written.
+ * \param d How many runs, on how many threads, and how much to disperse them
+ */
+void MonteCarlo(dispersionDesc d);
+
+/*!
+ * A normally distributed random number with mean 0 and standard deviation 1.
+ * \param rng The generator state, one per thread
+ */
+double GaussianRandom(unsigned long long *rng);
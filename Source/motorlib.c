@@ -0,0 +1,48 @@
+/*!
+ * \file motorlib.c
+ * \brief Builds a motor library out of a directory of thrust curves
+ *
+ * Every .eng file in the directory is read once and written into one binary
+ * file, which orbit maps when a config file names it as motorLibrary. Curves
+ * are found in it by their file name, so thrustCurve = "Motors/foo.eng"
+ * finds foo.eng.
+ *
+ * Usage: motorlib [-o motors.lib] directory
+ *  -o  The library to write (default motors.lib)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "structs.h"
+#include "motors.h"
+
+int main(int argc, char **argv)
+{
+    const char *fileName = "motors.lib";
+    const char *directory = NULL;
+    int motors;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            fileName = argv[++i];
+        else if (argv[i][0] == '-')
+        {
+            fprintf(stderr, "Unknown switch %s\n", argv[i]);
+            exit(1);
+        }
+        else
+            directory = argv[i];
+    }
+    if (directory == NULL)
+    {
+        printf("Usage: motorlib [-o motors.lib] directory\n");
+        exit(1);
+    }
+
+    motors = MotorLibraryBuild(directory, fileName);
+    printf("%d motors written to %s\n", motors, fileName);
+
+    return 0;
+}
@@ -0,0 +1,410 @@
+/*!
+ * \file motors.c
+ * \brief Reading thrust curves, one at a time or from a motor library
+ *
+ * A library is every thrust curve from a directory of .eng files, parsed once
+ * and written as one binary file:
+ *
+ *  - a motorLibraryHeader,
+ *  - a hash table of motorLibraryEntry slots, keyed on the motor's file name
+ *    (FNV-1a), with an empty slot wherever nameLength is zero,
+ *  - the names, one after the other with no terminators,
+ *  - the curves, as (time, thrust) pairs of little-endian doubles.
+ *
+ * Opening it only maps the file. Looking a motor up is one hash and a probe
+ * or two, and the curve is read straight out of the mapping.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "structs.h"
+#include "motors.h"
+
+#define MOTORLIB_MAGIC "ORBMLIB"
+#define MOTORLIB_VERSION 1
+
+static const char *mapFile(const char *fileName, size_t *size);
+static int parseCurve(const char *text, size_t size, vec2 **curve);
+static const char *baseName(const char *path);
+static uint64_t hashName(const char *name, size_t length);
+static int littleEndian(void);
+
+int ReadThrustCurve(const char *fileName, vec2 **curve)
+{
+    size_t size;
+    const char *text = mapFile(fileName, &size);
+    int points;
+
+    if (text == NULL)
+    {
+        printf("Error reading Thrust Curve file %s\n", fileName);
+        exit(1);
+    }
+
+    points = parseCurve(text, size, curve);
+    if (size > 0)
+        munmap((void *) text, size);
+
+    return points;
+}
+
+int MotorLibraryBuild(const char *directory, const char *fileName)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char path[4096];
+    char **names = NULL;
+    vec2 **curves = NULL;
+    int *lengths = NULL;
+    int motors = 0;
+    int capacity = 0;
+    uint32_t slots;
+    uint64_t nameBytes = 0;
+    uint64_t point = 0;
+    motorLibraryHeader header;
+    motorLibraryEntry *table;
+    size_t length;
+    uint32_t j;
+    FILE *out;
+    int i;
+
+    if (!littleEndian())
+    {
+        printf("Motor libraries need a little-endian machine\n");
+        exit(1);
+    }
+
+    dir = opendir(directory);
+    if (dir == NULL)
+    {
+        printf("Couldn't open motor directory %s\n", directory);
+        exit(1);
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        length = strlen(entry->d_name);
+        if (length < 5 || strcmp(entry->d_name + length - 4, ".eng") != 0)
+            continue;
+
+        if (motors == capacity)
+        {
+            capacity = capacity ? 2*capacity : 256;
+            names = realloc(names, capacity * sizeof(char *));
+            curves = realloc(curves, capacity * sizeof(vec2 *));
+            lengths = realloc(lengths, capacity * sizeof(int));
+            if (names == NULL || curves == NULL || lengths == NULL)
+            {
+                printf("Out of memory for the motor library\n");
+                exit(1);
+            }
+        }
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        lengths[motors] = ReadThrustCurve(path, &curves[motors]);
+        // orbit can't fly a curve without a start and an end
+        if (lengths[motors] < 2)
+        {
+            printf("Skipping %s, it has %d thrust curve points\n", path, lengths[motors]);
+            free(curves[motors]);
+            continue;
+        }
+        names[motors] = strdup(entry->d_name);
+        nameBytes += length;
+        motors++;
+    }
+    closedir(dir);
+
+    // At most half full, so misses stop quickly
+    for (slots = 16; slots < 2 * (uint32_t) motors; slots *= 2)
+        ;
+    table = calloc(slots, sizeof(motorLibraryEntry));
+    if (table == NULL)
+    {
+        printf("Out of memory for the motor library\n");
+        exit(1);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MOTORLIB_MAGIC, sizeof(MOTORLIB_MAGIC));
+    header.version = MOTORLIB_VERSION;
+    header.motors = motors;
+    header.slots = slots;
+    header.namesOffset = sizeof(header) + slots * sizeof(motorLibraryEntry);
+    // The curves are doubles, keep them lined up
+    header.pointsOffset = (header.namesOffset + nameBytes + 7) & ~(uint64_t) 7;
+
+    nameBytes = 0;
+    for (i = 0; i < motors; i++)
+    {
+        length = strlen(names[i]);
+        j = hashName(names[i], length) & (slots - 1);
+        while (table[j].nameLength != 0)
+            j = (j + 1) & (slots - 1);
+        table[j].hash = hashName(names[i], length);
+        table[j].name = nameBytes;
+        table[j].nameLength = length;
+        table[j].first = point;
+        table[j].points = lengths[i];
+        nameBytes += length;
+        point += lengths[i];
+    }
+
+    out = fopen(fileName, "wb");
+    if (out == NULL)
+    {
+        printf("File Handle error. Couldn't open %s\n", fileName);
+        exit(1);
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(table, sizeof(motorLibraryEntry), slots, out);
+    for (i = 0; i < motors; i++)
+        fwrite(names[i], 1, strlen(names[i]), out);
+    for (length = header.namesOffset + nameBytes; length < header.pointsOffset; length++)
+        fputc(0, out);
+    for (i = 0; i < motors; i++)
+        fwrite(curves[i], sizeof(vec2), lengths[i], out);
+    if (ferror(out))
+    {
+        printf("Couldn't write the motor library\n");
+        exit(1);
+    }
+    fclose(out);
+
+    for (i = 0; i < motors; i++)
+    {
+        free(names[i]);
+        free(curves[i]);
+    }
+    free(names);
+    free(curves);
+    free(lengths);
+    free(table);
+
+    return motors;
+}
+
+motorLibrary *MotorLibraryOpen(const char *fileName)
+{
+    motorLibrary *lib;
+    const motorLibraryHeader *header;
+    size_t size;
+
+    if (!littleEndian())
+    {
+        printf("Motor libraries need a little-endian machine\n");
+        exit(1);
+    }
+
+    lib = malloc(sizeof(motorLibrary));
+    if (lib == NULL)
+    {
+        printf("Out of memory for %s\n", fileName);
+        exit(1);
+    }
+    lib->map = (void *) mapFile(fileName, &size);
+    lib->size = size;
+    if (lib->map == NULL || size < sizeof(motorLibraryHeader))
+    {
+        printf("Couldn't open motor library %s\n", fileName);
+        exit(1);
+    }
+
+    header = lib->map;
+    if (memcmp(header->magic, MOTORLIB_MAGIC, sizeof(MOTORLIB_MAGIC)) != 0
+        || header->version != MOTORLIB_VERSION
+        || header->slots == 0 || (header->slots & (header->slots - 1)) != 0)
+    {
+        printf("%s is not a motor library this version can read\n", fileName);
+        exit(1);
+    }
+    if (header->namesOffset != sizeof(motorLibraryHeader) + header->slots * sizeof(motorLibraryEntry)
+        || header->pointsOffset < header->namesOffset
+        || header->pointsOffset > size)
+    {
+        printf("%s is cut short or damaged\n", fileName);
+        exit(1);
+    }
+
+    lib->header = header;
+    lib->slots = (const motorLibraryEntry *) (header + 1);
+    lib->names = (const char *) lib->map + header->namesOffset;
+    lib->points = (const vec2 *) ((const char *) lib->map + header->pointsOffset);
+
+    return lib;
+}
+
+const vec2 *MotorLibraryFind(motorLibrary *lib, const char *name, int *points)
+{
+    const motorLibraryEntry *e;
+    size_t length;
+    uint64_t hash;
+    uint32_t mask = lib->header->slots - 1;
+    uint32_t j;
+
+    name = baseName(name);
+    length = strlen(name);
+    hash = hashName(name, length);
+
+    for (j = hash & mask; lib->slots[j].nameLength != 0; j = (j + 1) & mask)
+    {
+        e = &lib->slots[j];
+        if (e->hash != hash || e->nameLength != length)
+            continue;
+        if (lib->header->namesOffset + e->name + e->nameLength > lib->header->pointsOffset)
+        {
+            printf("The motor library is cut short\n");
+            exit(1);
+        }
+        if (memcmp(lib->names + e->name, name, length) != 0)
+            continue;
+        if (lib->header->pointsOffset + (e->first + e->points) * sizeof(vec2) > lib->size)
+        {
+            printf("The motor library is cut short\n");
+            exit(1);
+        }
+        *points = e->points;
+        return lib->points + e->first;
+    }
+
+    return NULL;
+}
+
+void MotorLibraryFree(motorLibrary *lib)
+{
+    munmap(lib->map, lib->size);
+    free(lib);
+}
+
+/**
+ * Maps a whole file read only. An empty file gives a pointer to an empty
+ * string, since there is nothing to map.
+ */
+static const char *mapFile(const char *fileName, size_t *size)
+{
+    struct stat info;
+    void *map;
+    int fd;
+
+    fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    *size = info.st_size;
+    if (*size == 0)
+    {
+        close(fd);
+        return "";
+    }
+    map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    return map;
+}
+
+/**
+ * Pulls the points out of the text of a curve file, growing the array as it
+ * goes so the file is only read once.
+ */
+static int parseCurve(const char *text, size_t size, vec2 **curve)
+{
+    const char *end = text + size;
+    const char *line, *p;
+    char number[64];
+    double values[2];
+    int points = 0;
+    int capacity = 64;
+    size_t n;
+    int i;
+
+    *curve = malloc(capacity * sizeof(vec2));
+    if (*curve == NULL)
+    {
+        printf("Out of memory for a thrust curve\n");
+        exit(1);
+    }
+
+    for (line = text; line < end; line = p + 1)
+    {
+        p = line;
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        // Comments, blank lines and the RASP header (it starts with the
+        // motor's name) aren't points
+        if (p >= end || *p == '#' || *p == ';' || *p == '\n' || *p == '\r'
+            || !(*p == '-' || *p == '+' || *p == '.' || (*p >= '0' && *p <= '9')))
+        {
+            while (p < end && *p != '\n')
+                p++;
+            continue;
+        }
+
+        for (i = 0; i < 2; i++)
+        {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+                p++;
+            for (n = 0; p < end && n < sizeof(number) - 1
+                        && *p != ' ' && *p != '\t' && *p != ',' && *p != '\n' && *p != '\r'; n++)
+                number[n] = *p++;
+            number[n] = '\0';
+            values[i] = strtod(number, NULL);
+        }
+        while (p < end && *p != '\n')
+            p++;
+
+        if (points == capacity)
+        {
+            capacity *= 2;
+            *curve = realloc(*curve, capacity * sizeof(vec2));
+            if (*curve == NULL)
+            {
+                printf("Out of memory for a thrust curve\n");
+                exit(1);
+            }
+        }
+        curve[0][points].i = values[0];
+        curve[0][points].j = values[1];
+        points++;
+    }
+
+    return points;
+}
+
+static const char *baseName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return slash ? slash + 1 : path;
+}
+
+static uint64_t hashName(const char *name, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char) name[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static int littleEndian(void)
+{
+    uint16_t one = 1;
+
+    return *(unsigned char *) &one == 1;
+}
@@ -0,0 +1,37 @@
+/*!
+ * \file motors.h
+ * \brief Reading thrust curves, one at a time or from a motor library
+ */
+
+/*!
+ * Reads a thrust curve file in one pass: lines of time and thrust, separated
+ * by a comma or spaces. Comments (# or ;) and the RASP header line are
+ * skipped, so both our normalized curves and RASP .eng files work.
+ * \param curve Gets a new array of (time, thrust) points
+ * \return How many points there are
+ */
+int ReadThrustCurve(const char *fileName, vec2 **curve);
+
+/*!
+ * Reads every .eng file in directory and writes them all to one library file
+ * that MotorLibraryOpen() can map. Each curve goes in under its file name.
+ * \return How many motors went in
+ */
+int MotorLibraryBuild(const char *directory, const char *fileName);
+
+/*!
+ * Maps a library written by MotorLibraryBuild(). Nothing is read until a
+ * motor is looked up.
+ */
+motorLibrary *MotorLibraryOpen(const char *fileName);
+
+/*!
+ * Finds a motor by the file name its curve was read from (any directories in
+ * front of it are ignored).
+ * \param points Gets how many points the curve has
+ * \return The curve, straight out of the mapped file, or NULL if it isn't
+ * in the library
+ */
+const vec2 *MotorLibraryFind(motorLibrary *lib, const char *name, int *points);
+
+void MotorLibraryFree(motorLibrary *lib);
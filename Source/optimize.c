@@ -0,0 +1,415 @@
+/*!
+ * \file optimize.c
+ * \brief Searches for the launch angle, pitch program and staging times that
+ * fly best
+ *
+ * The search is CMA-ES: each generation is a cloud of candidates drawn from a
+ * normal distribution, and the best half of them move its mean and reshape
+ * its covariance towards where the good flights were (Hansen, "The CMA
+ * Evolution Strategy: A Tutorial"). It only ever looks at which candidate
+ * beat which, so the flights can be ranked however suits:
+ *
+ *  - ones that break fewer constraints come first,
+ *  - then ones that do better on the objective.
+ *
+ * The search works in units of each variable's range, 0 at from and 1 at to.
+ * Candidates that land outside are flown at the nearest edge and count how
+ * far out they were as breaking a constraint, so the search is pushed back
+ * inside.
+ *
+ * The candidates are drawn on the main thread from the seed, and a whole
+ * generation is flown at once with PoolRun(), so the answer doesn't depend
+ * on how many threads there were.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "structs.h"
+#include "montecarlo.h"
+#include "pool.h"
+#include "sweep.h"
+#include "optimize.h"
+
+#define N SWEEP_MAX_PARAMETERS
+#define OPTIMIZE_SIGMA 0.3      // First step size, as a fraction of each range
+
+typedef struct {double x[N];            // Where it is, in units of each range
+                    double y[N];        // How far from the mean, in sigmas
+                    flightResult result;
+                    double objective;
+                    double cost;        // Lower is better
+                    double violation;} candidate;
+typedef struct {optimizeDesc *o;
+                    candidate *c;} generation;
+
+static const char *resultNames[] = {"apogee", "apogeeTime", "burnoutVelocity",
+                                    "burnoutAltitude", "impactLat", "impactLon",
+                                    "impactTime", "downrange", "maxQ"};
+
+static void evaluate(void *arg, int k);
+static double actual(sweepParameter *p, double x);
+static int compare(const void *a, const void *b);
+static void eigen(int n, double C[N][N], double B[N][N], double d[N]);
+
+void Optimize(optimizeDesc o)
+{
+    int n = o.numberOfVariables;
+    int lambda = o.population > 0 ? o.population : 4 + (int) (3 * log(n));
+    int mu = lambda / 2;
+    double *weights;
+    double mueff, cc, cs, c1, cmu, damps, chiN;
+    double mean[N], old[N], step[N], ps[N], pc[N], d[N], z[N], t[N];
+    double B[N][N], C[N][N];
+    double sigma = OPTIMIZE_SIGMA;
+    double norm, hsig, sum, biggest;
+    unsigned long long rng = o.seed * 0x9E3779B97F4A7C15ULL;
+    generation gen;
+    candidate best;
+    struct timespec begin, end;
+    int flights = 0;
+    int threads = 0;
+    int g, i, j, k;
+    FILE *out;
+
+    if (mu < 1)
+        mu = 1;
+    gen.o = &o;
+    gen.c = malloc(lambda * sizeof(candidate));
+    weights = malloc(mu * sizeof(double));
+    if (gen.c == NULL || weights == NULL)
+    {
+        printf("Out of memory for %d candidates\n", lambda);
+        exit(1);
+    }
+
+    // Better candidates count for more
+    sum = 0;
+    for (i = 0; i < mu; i++)
+    {
+        weights[i] = log(mu + 0.5) - log(i + 1);
+        sum += weights[i];
+    }
+    mueff = 0;
+    for (i = 0; i < mu; i++)
+    {
+        weights[i] /= sum;
+        mueff += weights[i] * weights[i];
+    }
+    mueff = 1.0 / mueff;
+
+    // How fast everything adapts, the tutorial's defaults
+    cc = (4 + mueff/n) / (n + 4 + 2*mueff/n);
+    cs = (mueff + 2) / (n + mueff + 5);
+    c1 = 2 / ((n + 1.3)*(n + 1.3) + mueff);
+    cmu = fmin(1 - c1, 2 * (mueff - 2 + 1/mueff) / ((n + 2)*(n + 2) + mueff));
+    damps = 1 + 2*fmax(0, sqrt((mueff - 1) / (n + 1)) - 1) + cs;
+    chiN = sqrt(n) * (1 - 1.0/(4*n) + 1.0/(21*n*n));
+
+    // Start in the middle of every range, with no preferred direction
+    for (i = 0; i < n; i++)
+    {
+        mean[i] = 0.5;
+        ps[i] = pc[i] = 0;
+        d[i] = 1;
+        for (j = 0; j < n; j++)
+            B[i][j] = C[i][j] = (i == j);
+    }
+    best.violation = best.cost = HUGE_VAL;
+
+    out = fopen("Output/out-optimize.dat", "w");
+    if (out == NULL)
+    {
+        printf("File Handle error. Couldn't open Output/out-optimize.dat\n");
+        exit(1);
+    }
+    fprintf(out, "#Generation\tFlights\tSigma\t%s\tViolation", resultNames[o.objective]);
+    for (i = 0; i < n; i++)
+        fprintf(out, "\t%s", o.variables[i].key);
+    fprintf(out, "\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    for (g = 0; g < o.generations; g++)
+    {
+        /* Draw the generation */
+        for (k = 0; k < lambda; k++)
+        {
+            for (i = 0; i < n; i++)
+                z[i] = d[i] * GaussianRandom(&rng);
+            for (i = 0; i < n; i++)
+            {
+                gen.c[k].y[i] = 0;
+                for (j = 0; j < n; j++)
+                    gen.c[k].y[i] += B[i][j] * z[j];
+                gen.c[k].x[i] = mean[i] + sigma * gen.c[k].y[i];
+            }
+        }
+
+        /* Fly all of it at once */
+        threads = PoolRun(lambda, o.threads, evaluate, &gen);
+        flights += lambda;
+        qsort(gen.c, lambda, sizeof(candidate), compare);
+        if (compare(&gen.c[0], &best) < 0)
+            best = gen.c[0];
+
+        /* Move the mean towards the best half */
+        for (i = 0; i < n; i++)
+        {
+            old[i] = mean[i];
+            mean[i] = 0;
+            for (k = 0; k < mu; k++)
+                mean[i] += weights[k] * gen.c[k].x[i];
+            step[i] = (mean[i] - old[i]) / sigma;
+        }
+
+        /* Evolution paths, ps in the space where the cloud is round */
+        for (j = 0; j < n; j++)
+        {
+            t[j] = 0;
+            for (i = 0; i < n; i++)
+                t[j] += B[i][j] * step[i];
+            t[j] /= d[j];
+        }
+        norm = 0;
+        for (i = 0; i < n; i++)
+        {
+            sum = 0;
+            for (j = 0; j < n; j++)
+                sum += B[i][j] * t[j];
+            ps[i] = (1 - cs)*ps[i] + sqrt(cs*(2 - cs)*mueff) * sum;
+            norm += ps[i] * ps[i];
+        }
+        norm = sqrt(norm);
+        hsig = norm / sqrt(1 - pow(1 - cs, 2*(g + 1))) / chiN < 1.4 + 2.0/(n + 1);
+        for (i = 0; i < n; i++)
+            pc[i] = (1 - cc)*pc[i] + hsig * sqrt(cc*(2 - cc)*mueff) * step[i];
+
+        /* Reshape the cloud */
+        for (i = 0; i < n; i++)
+        {
+            for (j = 0; j <= i; j++)
+            {
+                sum = 0;
+                for (k = 0; k < mu; k++)
+                    sum += weights[k] * gen.c[k].y[i] * gen.c[k].y[j];
+                C[i][j] = (1 - c1 - cmu) * C[i][j]
+                        + c1 * (pc[i]*pc[j] + (1 - hsig)*cc*(2 - cc)*C[i][j])
+                        + cmu * sum;
+                C[j][i] = C[i][j];
+            }
+        }
+        sigma *= exp((cs / damps) * (norm / chiN - 1));
+        eigen(n, C, B, d);
+        biggest = 0;
+        for (i = 0; i < n; i++)
+        {
+            d[i] = sqrt(fmax(d[i], 1e-20));
+            biggest = fmax(biggest, d[i]);
+        }
+
+        /* Best so far */
+        fprintf(out, "%d\t%d\t%0.6g\t%0.6f\t%0.6g", g, flights, sigma * biggest,
+                best.objective, best.violation);
+        for (i = 0; i < n; i++)
+            fprintf(out, "\t%0.10g", actual(&o.variables[i], best.x[i]));
+        fprintf(out, "\n");
+        printf("Generation %3d: %s %0.4f%s\n", g, resultNames[o.objective], best.objective,
+               best.violation > 0 ? " (breaks a constraint)" : "");
+
+        // Every candidate is about the same now
+        if (sigma * biggest < o.tolerance)
+            break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fclose(out);
+
+    printf("\nFlew %d flights on %d threads in %0.2f s\n\n"
+        ,   flights
+        ,   threads
+        ,   (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) * 1e-9);
+    if (best.violation > 0)
+        printf("Nothing met every constraint, the closest was:\n");
+    else
+        printf("Best flight:\n");
+    for (i = 0; i < n; i++)
+        printf("%24s = %0.6f\n", o.variables[i].key, actual(&o.variables[i], best.x[i]));
+    printf("\n");
+    for (i = 0; i < (int) (sizeof(resultNames) / sizeof(resultNames[0])); i++)
+        printf("%24s   %0.4f\n", resultNames[i], ResultValue(best.result, i));
+    printf("\n");
+
+    free(weights);
+    free(gen.c);
+}
+
+int ResultIndex(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(resultNames) / sizeof(resultNames[0])); i++)
+        if (strcmp(name, resultNames[i]) == 0)
+            return i;
+
+    return -1;
+}
+
+double ResultValue(flightResult r, int which)
+{
+    switch (which)
+    {
+        case 0: return r.apogee;
+        case 1: return r.apogeeTime;
+        case 2: return r.burnoutVelocity;
+        case 3: return r.burnoutAltitude;
+        case 4: return r.impactLat;
+        case 5: return r.impactLon;
+        case 6: return r.impactTime;
+        case 7: return r.downrange;
+        default: return r.maxQ;
+    }
+}
+
+/**
+ * Flies candidate k and scores it
+ */
+static void evaluate(void *arg, int k)
+{
+    generation *gen = arg;
+    optimizeDesc *o = gen->o;
+    candidate *c = &gen->c[k];
+    double values[N];
+    double x, v, limit;
+    int i;
+
+    c->violation = 0;
+    for (i = 0; i < o->numberOfVariables; i++)
+    {
+        x = fmin(fmax(c->x[i], 0), 1);
+        c->violation += fabs(c->x[i] - x);
+        values[i] = actual(&o->variables[i], x);
+    }
+
+    c->result = FlyWith(o->variables, o->numberOfVariables, values);
+
+    // Constraints are broken by how far out they are, relative to the limit
+    for (i = 0; i < o->numberOfConstraints; i++)
+    {
+        v = ResultValue(c->result, o->constraints[i].result);
+        limit = o->constraints[i].min;
+        if (v < limit)
+            c->violation += (limit - v) / fmax(fabs(limit), 1);
+        limit = o->constraints[i].max;
+        if (v > limit)
+            c->violation += (v - limit) / fmax(fabs(limit), 1);
+        if (isnan(v))
+            c->violation = HUGE_VAL;
+    }
+
+    c->objective = ResultValue(c->result, o->objective);
+    if (o->goal == GOAL_MAX)
+        c->cost = -c->objective;
+    else if (o->goal == GOAL_MIN)
+        c->cost = c->objective;
+    else
+        c->cost = fabs(c->objective - o->target);
+    if (isnan(c->cost))
+        c->cost = HUGE_VAL;
+}
+
+/**
+ * The config value x (in units of p's range) stands for
+ */
+static double actual(sweepParameter *p, double x)
+{
+    return p->from + (p->to - p->from) * x;
+}
+
+/**
+ * Fewer broken constraints first, then lower cost
+ */
+static int compare(const void *a, const void *b)
+{
+    const candidate *ca = a;
+    const candidate *cb = b;
+
+    if (ca->violation != cb->violation)
+        return ca->violation < cb->violation ? -1 : 1;
+    if (ca->cost != cb->cost)
+        return ca->cost < cb->cost ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Eigenvalues d and eigenvectors (the columns of B) of the symmetric matrix
+ * C, by Jacobi rotations. There are never more than a handful of variables,
+ * so this is plenty fast.
+ */
+static void eigen(int n, double C[N][N], double B[N][N], double d[N])
+{
+    double a[N][N];
+    double off, scale, theta, t, c, s, x, y;
+    int sweep, p, q, k;
+
+    for (p = 0; p < n; p++)
+    {
+        for (q = 0; q < n; q++)
+        {
+            a[p][q] = C[p][q];
+            B[p][q] = (p == q);
+        }
+    }
+
+    for (sweep = 0; sweep < 50; sweep++)
+    {
+        off = scale = 0;
+        for (p = 0; p < n; p++)
+        {
+            scale += a[p][p] * a[p][p];
+            for (q = p + 1; q < n; q++)
+                off += a[p][q] * a[p][q];
+        }
+        if (off <= 1e-30 * scale)
+            break;
+
+        for (p = 0; p < n; p++)
+        {
+            for (q = p + 1; q < n; q++)
+            {
+                if (a[p][q] == 0)
+                    continue;
+                // The rotation that zeroes a[p][q]
+                theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+                t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta*theta + 1));
+                c = 1 / sqrt(t*t + 1);
+                s = t * c;
+                for (k = 0; k < n; k++)
+                {
+                    x = a[k][p];
+                    y = a[k][q];
+                    a[k][p] = c*x - s*y;
+                    a[k][q] = s*x + c*y;
+                }
+                for (k = 0; k < n; k++)
+                {
+                    x = a[p][k];
+                    y = a[q][k];
+                    a[p][k] = c*x - s*y;
+                    a[q][k] = s*x + c*y;
+                }
+                for (k = 0; k < n; k++)
+                {
+                    x = B[k][p];
+                    y = B[k][q];
+                    B[k][p] = c*x - s*y;
+                    B[k][q] = s*x + c*y;
+                }
+            }
+        }
+    }
+
+    for (p = 0; p < n; p++)
+        d[p] = a[p][p];
+}
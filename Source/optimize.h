@@ -0,0 +1,25 @@
+/*!
+ * \file optimize.h
+ * \brief Searches for the launch angle, pitch program and staging times that
+ * fly best
+ */
+
+/*!
+ * Runs the search, flying each generation's candidates on a pool of threads,
+ * and prints the best flight it found. Every generation's best goes to
+ * Output/out-optimize.dat, no trajectory files are written.
+ * \param o What to vary, what to aim for, and what has to hold
+ */
+void Optimize(optimizeDesc o);
+
+/*!
+ * Which flightResult value a name in the config file means (apogee,
+ * apogeeTime, burnoutVelocity, burnoutAltitude, impactLat, impactLon,
+ * impactTime, downrange or maxQ), or -1 for none of them.
+ */
+int ResultIndex(const char *name);
+
+/*!
+ * The value ResultIndex() gave which for
+ */
+double ResultValue(flightResult r, int which);
@@ -1,42 +1,84 @@
 #include <stdio.h>
 #include <libconfig.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include "structs.h"
 #include "coord.h"
 #include "physics.h"
 #include "vecmath.h"
 #include "rout.h"
 #include "rk4.h"
+#include "montecarlo.h"
+#include "atmosphere.h"
+#include "events.h"
+#include "kepler.h"
+#include "trajfile.h"
+#include "writer.h"
+#include "decimate.h"
+#include "format.h"
+#include "motors.h"
+#include "sweep.h"
+#include "optimize.h"
+#include "bench.h"
 #include "orbit.h"
 
 struct config_t cfg;                //Config File
 double beginTime;                   //Start time in JD
 float h;                            //Timestep
-double Jd;                          //Current time in Julian Date 
-double Met;                         //Current time in Mission Elapsed Time
+integratorDesc integrator;          //Which integrator to use and its settings
+outputPolicy output;                //How much of the flight to write down
 int numberOfStages;                 //Total number of stages
 double simulationRunTime;           //How long the simulation took in seconds
 
 char *configFileName = "orbit.cfg"; //Default Config File Name
-FILE *outBurn;
-FILE *outCoast;
-FILE *outKml;
-FILE *outForce;
-FILE *outSpent;
+int monteCarlo = 0;                 //Fly the dispersions instead of one flight
+int sweep = 0;                      //Fly the sweep's grid instead of one flight
+int optimize = 0;                   //Search for the best flight instead of one flight
+int binaryOutput = 0;               //Write Output/out.traj instead of the .dat files
+int summary = SUMMARY_NONE;         //Just print the results on stdout, no files
+int benchmark = SUMMARY_NONE;       //Time the hot paths instead of flying
+dispersionDesc dispersions;         //How to scatter the Monte Carlo flights
+sweepDesc sweeps;                   //Which config values to sweep
+optimizeDesc optimizer;             //What to search over and what for
 
 state launchState;                  //Position, time, etc at launch
-Rocket_Stage *stages;               //The rocket
-Rocket_Stage currentStage;          //The stage currently being simulated
+double launchAngle;                 //How far off vertical the thrust points, in radians
+double launchAzimuth;               //Which way it leans, clockwise from north in radians
+pitchProgram pitch;                 //Or how the thrust angle changes with time
+localFrame launchFrame;             //Which way is up, north and east at the launch site
+Rocket_Stage *stages;               //The rocket as read from the config file
+
+/* Each separation leaves two bodies that no longer have anything to do with
+ * each other, so the stage above gets a simContext of its own, starting from
+ * that moment, and flies on its own thread while the spent stage falls. */
+struct staging {simContext *bodies;     // One per stage, the one flying it
+                    pthread_t *threads;     // Where they are flying, if concurrent
+                    int concurrent;
+                    simContext *capture;    // Gets a copy of bodies[captureAt]
+                    int captureAt;};
 
 void printHelp();
 void printVersion();
 void readCommandLineSwitches(int argc, char **argv);
 void readConfigFile();
-void initOutputFiles();
-Rocket_Stage run(Rocket_Stage stage);
+void readIntegrator(config_setting_t *configIntegrator);
+void readOutput(config_setting_t *configOutput);
+void readDispersions(config_setting_t *configDispersions);
+void readSweep(config_setting_t *configSweep);
+void readParameter(config_setting_t *parameter, sweepParameter *p);
+void readOptimize(config_setting_t *configOptimize);
+void initOutputFiles(simContext *sim);
+void FreeSimContext(simContext *sim);
+void run(simContext *sim, Rocket_Stage *stage);
+static void flyBody(simContext *sim);
+static void *flyThread(void *arg);
+static void forkStage(simContext *sim);
+static void capture(staging *s, int i);
 static int thrustCurve_noFile(vec2 **curve, double thrust, double fuel, double isp);
 static int thrustCurve_File(vec2 **curve, const char *fileName, double thrust);
+static motorLibrary *motorLib = NULL;
 double initFuelMass(Rocket_Stage stage);
 
 /**
@@ -45,7 +87,7 @@ double initFuelMass(Rocket_Stage stage);
 int main(int argc, char **argv)
 {
     clock_t start, end;         //For seeing how long the simulation takes
-    int i;
+    simContext sim;             //Everything that changes while flying
     
     /* Read switches */
     readCommandLineSwitches(argc, argv);
@@ -55,70 +97,110 @@ int main(int argc, char **argv)
      * rocket stucts, so we can use them below */
     readConfigFile();
     
-    /* Attempt to create Output files */
-    initOutputFiles();
+    /* Work out the air once, everything after this just looks it up */
+    InitAtmosphere();
     
-    /* Begin Simulation */
-    start = clock();
+    /* Fly the whole campaign instead, no trajectory files */
+    if (monteCarlo)
+    {
+        start = clock();
+        MonteCarlo(dispersions);
+        end = clock();
+        simulationRunTime = ((double) (end - start)) / CLOCKS_PER_SEC;
+        free(stages);
+        return 0;
+    }
+    
+    /* Or every point of the sweep's grid */
+    if (sweep)
+    {
+        start = clock();
+        Sweep(sweeps);
+        end = clock();
+        simulationRunTime = ((double) (end - start)) / CLOCKS_PER_SEC;
+        free(sweeps.parameters);
+        free(stages);
+        return 0;
+    }
+    
+    /* Or search for the best one */
+    if (optimize)
+    {
+        start = clock();
+        Optimize(optimizer);
+        end = clock();
+        simulationRunTime = ((double) (end - start)) / CLOCKS_PER_SEC;
+        free(optimizer.variables);
+        free(optimizer.constraints);
+        free(stages);
+        return 0;
+    }
     
-    // Set the time
-    Met = 0;
-    Jd = BeginTime();
+    /* Or time how fast it flies */
+    if (benchmark)
+    {
+        Benchmark(configFileName, benchmark);
+        free(stages);
+        return 0;
+    }
     
-    stages[0].initialState = LaunchState();
-    stages[0].initialState.fuelMass = initFuelMass(stages[0]);
-    stages[0].mode = BURNING;
+    /* Set up a simulation of the rocket */
+    InitSimContext(&sim);
     
-    // Do it
-    for(i = 0; i < numberOfStages; i++)
+    /* Fly it without touching Output at all, one line of results at the end */
+    if (summary)
     {
-        /* This does all the work, returns a stage that has run throught the
-         * simulation
-         */
-        currentStage = stages[i];
-        stages[i] = run(stages[i]);
-
-        /* If this is not the last stage then prime the next stage
-         * with the data from when the last stage separated
-         */
-        if ((i + 1) < numberOfStages)
-        {
-            state nextStageInitialState = stages[i].separationState;
-            stages[i + 1].initialState.s = nextStageInitialState.s;
-            stages[i + 1].initialState.U = nextStageInitialState.U;
-            stages[i + 1].initialState.a = LinearAcceleration(stages[i + 1].initialState, Met);
-            stages[i + 1].initialState.met = nextStageInitialState.met;
-            // Go back in time to when the stages separated
-            double backInTime = Met - nextStageInitialState.met;
-            Met = nextStageInitialState.met;
-            Jd = Jd - SecondsToDecDay(backInTime);
-        }
-        // Print blank lines in the files to separate the stages in gnuplot
-        fprintf(outBurn, "\n");
-        fprintf(outCoast, "\n");
-        fprintf(outSpent, "\n");
-        // Show some output on the screen
-        PrintSimResult(stages[i]);
+        sim.verbose = 0;
+        start = clock();
+        Fly(&sim);
+        end = clock();
+        simulationRunTime = ((double) (end - start)) / CLOCKS_PER_SEC;
+        PrintSummary(stdout, &sim, configFileName, summary);
+        FreeSimContext(&sim);
+        free(stages);
+        return 0;
     }
     
+    /* Attempt to create Output files */
+    initOutputFiles(&sim);
+    
+    /* Everything written from here on is written by the writer thread */
+    WriterStart(&sim);
+    
+    /* Begin Simulation */
+    start = clock();
+    
+    // Do it
+    Fly(&sim);
+    
     /* Finished */
     end = clock();
     simulationRunTime = ((double) (end - start)) / CLOCKS_PER_SEC;
     
-    PrintHtmlResult(stages);
-    MakePltFiles(stages[numberOfStages - 1]);
+    // Let the writer catch up before anything is closed
+    WriterStop(&sim);
+    
+    PrintHtmlResult(sim.stages);
+    MakePltFiles(sim.stages[sim.numberOfStages - 1]);
     
     /* Close open files */
     // Print Footers
-    PrintKmlFooter(outKml);
+    PrintKmlFooter(sim.outKml);
     
     // close file
-    fclose(outBurn);
-    fclose(outCoast);
-    fclose(outKml);
-    fclose(outSpent);
+    if (sim.outTraj != NULL)
+        TrajClose(sim.outTraj);
+    else
+    {
+        fclose(sim.outBurn);
+        fclose(sim.outCoast);
+        fclose(sim.outSpent);
+    }
+    fclose(sim.outKml);
+    fclose(sim.outForce);
     
     /* Free memory */
+    FreeSimContext(&sim);
     free(stages);
     
     /* exit */
@@ -126,148 +208,409 @@ int main(int argc, char **argv)
 }
 
 /**
- * Handles the actual running of the program
+ * Flies every stage of the rocket in sim, from its current stage (the launch
+ * pad, unless sim came from a snapshot) until the last one hits the ground.
+ * Every stage is forked off from the one below it when they separate (see
+ * forkStage()), and when sim->concurrent is set it flies on a thread of its
+ * own while the spent stage falls, otherwise each one flies once the one
+ * below it has landed. Either way sim is left where the last stage hit the
+ * ground.
+ */
+void Fly(simContext *sim)
+{
+    FlyAndCapture(sim, -1, NULL);
+}
+
+/**
+ * Fly(), also copying the context that stage at starts flying from into
+ * *at: primed, with the clocks at the separation and the stages below it
+ * as they ended up. *at gets its own stages and no files. Nothing is copied
+ * if stage at isn't flown.
+ */
+void FlyAndCapture(simContext *sim, int at, simContext *capturing)
+{
+    staging s;
+    int first = sim->currentStage->description.stage;
+    int i;
+    
+    s.bodies = malloc(sim->numberOfStages * sizeof(simContext));
+    s.threads = malloc(sim->numberOfStages * sizeof(pthread_t));
+    if (s.bodies == NULL || s.threads == NULL)
+    {
+        printf("Out of memory for %d stages\n", sim->numberOfStages);
+        exit(1);
+    }
+    s.concurrent = sim->concurrent;
+    s.capture = capturing;
+    s.captureAt = at;
+    
+    s.bodies[first] = *sim;
+    s.bodies[first].staging = &s;
+    PrimeStage(&s.bodies[first], first);
+    capture(&s, first);
+    flyBody(&s.bodies[first]);
+    
+    // Every stage has been forked by the time the one below it has landed
+    for (i = first + 1; i < sim->numberOfStages; i++)
+    {
+        if (s.concurrent)
+            pthread_join(s.threads[i], NULL);
+        else
+            flyBody(&s.bodies[i]);
+    }
+    
+    // The stages below the capture have all landed now
+    if (capturing != NULL && at >= first && at < sim->numberOfStages)
+        memcpy(capturing->stages, sim->stages, at * sizeof(Rocket_Stage));
+    
+    *sim = s.bodies[sim->numberOfStages - 1];
+    sim->staging = NULL;
+    
+    free(s.threads);
+    free(s.bodies);
+}
+
+/**
+ * Flies the stage sim was primed with to the ground, forking the stage above
+ * when they separate
+ */
+static void flyBody(simContext *sim)
+{
+    Rocket_Stage *stage = sim->currentStage;
+    
+    /* This does all the work, leaves the stage having run throught the
+     * simulation
+     */
+    run(sim, stage);
+    
+    // Print blank lines in the files to separate the stages in gnuplot
+    PrintBreak(sim, TRAJ_ALL);
+    // Show some output on the screen
+    PrintStageResult(sim, stage);
+    
+    // That's everything from this stage
+    if (sim->writer != NULL)
+        WriterClose(sim->writer, stage->description.stage);
+}
+
+static void *flyThread(void *arg)
+{
+    flyBody(arg);
+    return NULL;
+}
+
+/**
+ * The stage above sim's has just separated from it: give it a copy of sim
+ * to fly on, primed from the separation and with the clocks as they are now,
+ * and start it flying if the stages fly concurrently.
+ */
+static void forkStage(simContext *sim)
+{
+    staging *s = sim->staging;
+    int next = sim->currentStage->description.stage + 1;
+    
+    if (s == NULL || next >= sim->numberOfStages)
+        return;
+    
+    s->bodies[next] = *sim;
+    PrimeStage(&s->bodies[next], next);
+    capture(s, next);
+    
+    if (s->concurrent
+        && pthread_create(&s->threads[next], NULL, flyThread, &s->bodies[next]) != 0)
+    {
+        printf("Couldn't start a thread for stage %d\n", next + 1);
+        exit(1);
+    }
+}
+
+/**
+ * If body i is the one being captured, copies it before it flies
+ */
+static void capture(staging *s, int i)
+{
+    simContext *c = s->capture;
+    simContext *body = &s->bodies[i];
+    
+    if (c == NULL || i != s->captureAt)
+        return;
+    
+    *c = *body;
+    c->stages = malloc(body->numberOfStages * sizeof(Rocket_Stage));
+    if (c->stages == NULL)
+    {
+        printf("Out of memory for a snapshot\n");
+        exit(1);
+    }
+    memcpy(c->stages, body->stages, body->numberOfStages * sizeof(Rocket_Stage));
+    c->currentStage = &c->stages[i];
+    c->staging = NULL;
+    c->writer = NULL;
+    c->outBurn = NULL;
+    c->outCoast = NULL;
+    c->outKml = NULL;
+    c->outForce = NULL;
+    c->outSpent = NULL;
+    c->outTraj = NULL;
+}
+
+/**
+ * Gets stage i of sim ready to fly. The first stage starts on the launch pad,
+ * the rest start from where the stage below them separated, which is where
+ * sim's clocks have to be.
+ */
+void PrimeStage(simContext *sim, int i)
+{
+    sim->currentStage = &sim->stages[i];
+    
+    if (i == 0)
+    {
+        sim->stages[0].initialState = LaunchState();
+        sim->stages[0].initialState.fuelMass = initFuelMass(sim->stages[0]);
+        sim->stages[0].mode = BURNING;
+        UpdateMassCache(sim);
+        sim->ignitionTime = sim->met;
+        sim->ignitionFuelMass = sim->stages[0].initialState.fuelMass;
+        sim->stages[0].initialState.a = LinearAcceleration(sim, sim->stages[0].initialState, 0);
+        return;
+    }
+    
+    UpdateMassCache(sim);
+    
+    /* Prime the stage with the data from when the last stage separated */
+    state nextStageInitialState = sim->stages[i - 1].separationState;
+    sim->stages[i].initialState.s = nextStageInitialState.s;
+    sim->stages[i].initialState.U = nextStageInitialState.U;
+    sim->stages[i].initialState.fuelMass = initFuelMass(sim->stages[i]);
+    sim->stages[i].initialState.a = LinearAcceleration(sim, sim->stages[i].initialState, sim->met);
+    sim->stages[i].initialState.met = nextStageInitialState.met;
+}
+
+/**
+ * The numbers that matter from a flight that has been flown. These come from
+ * the last stage, the one that makes it the farthest, except for max Q,
+ * which is the worst any stage saw.
  */
-Rocket_Stage run(Rocket_Stage stage)
+flightResult FlightResult(simContext *sim)
+{
+    flightResult result;
+    Rocket_Stage last = sim->stages[sim->numberOfStages - 1];
+    int i;
+    
+    result.apogee = Altitude(last.apogeeState);
+    result.apogeeTime = last.apogeeState.met;
+    result.burnoutVelocity = Velocity(last.burnoutState);
+    result.burnoutAltitude = Altitude(last.burnoutState);
+    result.impactLat = degrees(latitude(last.splashdownState));
+    result.impactLon = degrees(longitude(last.splashdownState));
+    result.impactTime = last.splashdownState.met;
+    result.downrange = Downrange(last.splashdownState);
+    result.maxQ = 0;
+    for (i = 0; i < sim->numberOfStages; i++)
+        result.maxQ = fmax(result.maxQ, sim->stages[i].maxQ);
+    
+    return result;
+}
+
+/**
+ * Handles the actual running of the program. Flies one stage of sim from its
+ * initial state to the ground, filling in the event states as it goes.
+ */
+void run(simContext *sim, Rocket_Stage *stage)
 {   
     double simTime;
-    double lastTime = 0;
-    double currentAltitude, lastAltitude;
-    double burnoutTime = 0;
+    double currentAltitude;
+    double eventTime;               //MET of the next ignition, burnout or separation
+    double step = sim->h;           //Size of the step about to be taken
+    double nextStep = sim->h;       //Adaptive integrator's next step guess
+    double guess;
+    double q;
     unsigned int mode, lastMode;
     int notLastStage = 1;
+    int coasting = 0, atApogee = 0;
     int i;
     state currentState;
     state lastState;
+    state event;
+    decimator thinning;             //Which states get written
 
     // Init
-    currentState = stage.initialState;
-    lastState = stage.initialState;
-    lastAltitude = Altitude(currentState);
-    lastMode = stage.mode;
+    sim->currentStage = stage;
+    UpdateMassCache(sim);
+    currentState = stage->initialState;
+    lastState = stage->initialState;
+    lastMode = stage->mode;
+    stage->maxQ = 0;
+    stage->maxAccel = 0;
+    stage->steps = 0;
+    sim->work.overTolerance = 0;
+    stage->maxQState = currentState;
+    stage->maxAccelState = currentState;
+    DecimateStart(sim, &thinning);
     
-    if (stage.description.stage >= (NumberOfStages() - 1))
+    if (stage->description.stage >= (sim->numberOfStages - 1))
     {
         notLastStage = 0;
     }
     
+    if (stage->mode == INIT)
+        eventTime = sim->met + stage->description.ignitionDelay;
+    else if (stage->mode == BURNING)
+        eventTime = BurnoutTime(sim);
+    else
+        eventTime = HUGE_VAL;
+    
     /* Run the simulation until the stage hits the ground or it's takeing too
      * long. whichever comes first. 
      */
-    for (simTime = 0; simTime < 10000; simTime += h)
+    for (simTime = 0; simTime < 10000; simTime += step)
     {
         // State Logic
         currentAltitude = Altitude(currentState);
-        if (stage.mode == INIT
-            && simTime >= stage.description.ignitionDelay)
+        if (stage->mode == INIT
+            && sim->met >= eventTime - EVENT_SLOP)
         {   
-            printf("Stage Ignition!\n");
-            fprintf(outCoast, "\n");
-            stage.mode = BURNING;
+            PrintNote(sim, "Stage Ignition!");
+            DecimateFlush(sim, &thinning);
+            PrintBreak(sim, TRAJ_COAST);
+            stage->mode = BURNING;
+            UpdateMassCache(sim);
+            // Start the motor's clock
+            sim->ignitionTime = sim->met;
+            sim->ignitionFuelMass = currentState.fuelMass;
+            eventTime = BurnoutTime(sim);
         }
-        if (stage.mode == BURNING && currentState.fuelMass < 0)
+        // Out of fuel, or the motor has finished its thrust curve
+        if (stage->mode == BURNING 
+            && sim->met >= eventTime - EVENT_SLOP)
         {
-            printf("Burnout!\n");
-            PrintStateLine(outBurn, Jd, lastState);
-            PrintStateLine(outCoast, Jd, currentState);
-            stage.mode = COASING;
-            stage.burnoutState = lastState;
-            burnoutTime = Met;
+            PrintNote(sim, "Burnout!");
+            DecimateFlush(sim, &thinning);
+            PrintTrajectory(sim, TRAJ_BURN, sim->jd, currentState);
+            PrintTrajectory(sim, TRAJ_COAST, sim->jd, currentState);
+            stage->mode = COASING;
+            UpdateMassCache(sim);
+            stage->burnoutState = currentState;
+            eventTime = HUGE_VAL;
+            if (notLastStage > 0)
+                eventTime = sim->met + stage->description.stageDelay;
         }
         
-        mode = stage.mode;
+        mode = stage->mode;
         
-        // If the rocket starts to decend, then we must have pased apogee
-        ///TODO: this is, of course, not always true.
-        ///TODO: also, I should interpolate this.
-        if (lastAltitude < currentAltitude)
+        // Apogee is wherever the stage stops climbing during the last step
+        if (LocateEvent(sim, RadialVelocity, lastState, currentState, &event))
         {
-            stage.apogeeState = lastState;
+            stage->apogeeState = event;
+            DecimateEvent(sim, &thinning, mode, 
+                          sim->jd - SecondsToDecDay(sim->met - event.met), event);
         }
         
         // If the stage is below the "ground"
-        ///TODO: this should be interpolated
         if (currentAltitude < 0)
         {
-            printf("Hit the Ground!!\n");
-            stage.splashdownState = lastState;
+            PrintNote(sim, "Hit the Ground!!");
+            if (!LocateEvent(sim, GroundEvent, lastState, currentState, &event))
+                event = lastState;
+            stage->splashdownState = event;
+            DecimateEvent(sim, &thinning, mode, 
+                          sim->jd - SecondsToDecDay(sim->met - event.met), event);
             break;
         }
         
-        ///TODO: Actually integrate this.
-        if (mode == BURNING)
+        if (mode == COASING) // Wait some time, then separate
         {
-            double fuelLoss =  MDot(currentState, Met) * h;
-            currentState.fuelMass -= fuelLoss;
-        }
-        
-        if (mode > BURNING) // Wait some time, then separate
-        {
-            if (Met - burnoutTime > stage.description.stageDelay 
-                && mode != SEPARATED
-                && notLastStage > 0)
+            if (sim->met >= eventTime - EVENT_SLOP)
             {
-                printf("Separation!\n");
-                stage.separationState = lastState;
-                stage.mode = SEPARATED;
+                PrintNote(sim, "Separation!");
+                stage->separationState = currentState;
+                DecimateFlush(sim, &thinning);
+                stage->mode = SEPARATED;
+                UpdateMassCache(sim);
+                eventTime = HUGE_VAL;
+                // The rest of the rocket goes its own way from here
+                forkStage(sim);
             }
         }
         
-        // Print files no more often than every tenth of a second.
-        if ( (Met - lastTime) > 0.01 )
+        // The forces just changed, so the next step starts from the new ones
+        if (stage->mode != lastMode)
+            currentState.a = LinearAcceleration(sim, currentState, sim->met);
+        
+        // Worst of the ride so far
+        q = Kinematics(currentState).dynamicPressure;
+        if (q > stage->maxQ)
         {
-           // PrintKmlLine(outKml, currentState);
-            if ( (longitude(currentState) < 0 && longitude(lastState) > 0)
-                || (longitude(currentState) > 0 && longitude(lastState) < 0)
-                )
-            
-            {
-                printf("Cross the line!\n");
-                fprintf(outBurn, "\n");
-                fprintf(outCoast, "\n");
-                fprintf(outSpent, "\n");
-            }
-            switch (mode)
-            {
-                case INIT:
-                    PrintStateLine(outCoast, Jd, currentState);
-                    PrintKmlLine(outKml, currentState);
-                    PrintForceLine(outForce, Jd, currentState);
-                    break;
-                case BURNING:
-                    PrintStateLine(outBurn, Jd, currentState);
-                    PrintKmlLine(outKml, currentState);
-                    PrintForceLine(outForce, Jd, currentState);
-                    break;
-                case COASING:
-                    PrintStateLine(outCoast, Jd, currentState);
-                    PrintKmlLine(outKml, currentState);
-                    PrintForceLine(outForce, Jd, currentState);
-                    break;
-                case SEPARATED:
-                    PrintStateLine(outSpent, Jd, currentState);
-                    PrintForceLine(outForce, Jd, currentState);
-                    break;
-                default:
-                    PrintStateLine(outCoast, Jd, currentState);
-                    break;
-            }  
-            lastTime = Met;         
+            stage->maxQ = q;
+            stage->maxQState = currentState;
         }
+        if (Acceleration(currentState) > stage->maxAccel)
+        {
+            stage->maxAccel = Acceleration(currentState);
+            stage->maxAccelState = currentState;
+        }
+        
+        // Print files, as often as the output policy wants
+        if (coasting && atApogee)
+            DecimateEvent(sim, &thinning, mode, sim->jd, currentState);
+        else
+            DecimateSample(sim, &thinning, mode, sim->jd, currentState);
         
         lastState = currentState;                       //LastRocket
-        lastAltitude = Altitude(currentState);
-        lastMode = stage.mode;                          //LastMode
-        currentState = rk4(currentState, h);            //NewRocket
-        Jd += SecondsToDecDay(h);                       //Increment time
-        Met += h;
-        currentState.met = Met;
+        lastMode = stage->mode;                         //LastMode
+        if (sim->integrator.method == DOPRI54)
+            step = nextStep;
+        else
+            step = sim->h;
+        // Land on the next event rather than stepping over it
+        guess = step;
+        if (eventTime - sim->met < step)
+            step = eventTime - sim->met;
+        coasting = InVacuum(sim, currentState);
+        if (coasting)
+        {
+            // Nothing but gravity, so go straight along the orbit. Still keep
+            // to the time step when there are files to fill in, unless all
+            // they want is the events.
+            double maxStep = step;
+            if (!Printing(sim) || sim->output.mode == OUTPUT_EVENTS)
+                maxStep = fmin(eventTime - sim->met, 10000 - simTime);
+            currentState = KeplerCoast(currentState, maxStep, &step, &atApogee);
+        }
+        else if (sim->integrator.method == DOPRI54)
+        {
+            double tried = step;
+            currentState = dopri54(sim, currentState, &step, &nextStep);
+            if (tried < guess && step == tried)
+                nextStep = fmax(nextStep, guess);
+        }
+        else
+        {
+            currentState = rk4(sim, currentState, step);  //NewRocket
+        }
+        sim->jd += SecondsToDecDay(step);               //Increment time
+        sim->met += step;
+        currentState.met = sim->met;
+        stage->steps++;
+        if (coasting)
+        {
+            // The jump can be far too long to interpolate events across
+            lastState = currentState;
+            if (atApogee)
+                stage->apogeeState = currentState;
+        }
     }
     
-    if (stage.separationState.met == 0.0)
-        stage.separationState = currentState;
+    DecimateEnd(sim, &thinning);
+    stage->overTolerance = sim->work.overTolerance;
     
-    return stage;
+    // Never came apart, so the stage above starts from wherever this one
+    // ended up
+    if (stage->separationState.met == 0.0)
+    {
+        stage->separationState = currentState;
+        forkStage(sim);
+    }
 }
 
 void readCommandLineSwitches(int argc, char **argv)
@@ -285,6 +628,28 @@ void readCommandLineSwitches(int argc, char **argv)
 		        case 'c':   // set config file name
 		            configFileName = argv[i+1];
 				    break;
+				case 'm':   // Monte Carlo
+				    monteCarlo = 1;
+				    break;
+				case 'w':   // Parameter sweep
+				    sweep = 1;
+				    break;
+				case 'o':   // Optimize
+				    optimize = 1;
+				    break;
+				case 'b':   // Binary trajectory
+				    binaryOutput = 1;
+				    break;
+				case 's':   // Summary only, as json or csv
+				    summary = SUMMARY_JSON;
+				    if (i + 1 < argc && strcmp(argv[i+1], "csv") == 0)
+				        summary = SUMMARY_CSV;
+				    break;
+				case 'B':   // Benchmark, as json or csv
+				    benchmark = SUMMARY_JSON;
+				    if (i + 1 < argc && strcmp(argv[i+1], "csv") == 0)
+				        benchmark = SUMMARY_CSV;
+				    break;
 				case 'h':   // print help
 				    printHelp();
 				    exit(0);
@@ -329,15 +694,55 @@ void readConfigFile()
     config_setting_t *configLaunchVelocity  = NULL;
     config_setting_t *configLaunchTime      = NULL;
     config_setting_t *configStages          = NULL;
+    config_setting_t *configIntegrator      = NULL;
+    config_setting_t *configOutput          = NULL;
+    config_setting_t *configDispersions     = NULL;
+    config_setting_t *configSweep           = NULL;
+    config_setting_t *configOptimize        = NULL;
     
     configTStep             = config_lookup(&cfg, "timeStep");
     configLaunchPosition    = config_lookup(&cfg, "launch.position");
     configLaunchVelocity    = config_lookup(&cfg, "launch.velocity");
     configLaunchTime        = config_lookup(&cfg, "launch.juliandate");
     configStages            = config_lookup(&cfg, "stages");
+    configIntegrator        = config_lookup(&cfg, "integrator");
+    configOutput            = config_lookup(&cfg, "output");
+    configDispersions       = config_lookup(&cfg, "dispersions");
+    configSweep             = config_lookup(&cfg, "sweep");
+    configOptimize          = config_lookup(&cfg, "optimize");
+    
+    // Integrator (not required, defaults to fixed step RK4)
+    integrator.method = RK4;
+    if (configIntegrator)
+        readIntegrator(configIntegrator);
+    
+    // Output (not required, defaults to a line every hundredth of a second)
+    output.mode = OUTPUT_INTERVAL;
+    output.interval = 0.01;
+    output.position = 1.0;
+    output.velocity = 0.1;
+    output.chord = 10.0;
+    if (configOutput)
+        readOutput(configOutput);
+
+    // Motor library (not required, thrust curves are read from their files)
+    const char *libraryName = NULL;
+    if (config_lookup_string(&cfg, "motorLibrary", &libraryName))
+        motorLib = MotorLibraryOpen(libraryName);
+
+    // Dispersions (only needed for Monte Carlo)
+    if (monteCarlo)
+    {
+        if (!configDispersions)
+        {
+            printf("Monte Carlo needs a dispersions section\n");
+            exit(1);
+        }
+        readDispersions(configDispersions);
+    }
 
     /* Make sure values are found in the config file */
-    if (    !configTStep 
+    if (    (!configTStep && integrator.method == RK4)
          || !configLaunchPosition 
          || !configLaunchTime 
          || !configStages) 
@@ -346,8 +751,11 @@ void readConfigFile()
         exit(1);
     }
 
-    // Time Step
-    h = config_setting_get_float(configTStep);
+    // Time Step, for the adaptive integrators this is just the first guess
+    if (configTStep)
+        h = config_setting_get_float(configTStep);
+    else
+        h = integrator.minStep;
     
     // Launch Position
     double lat = (double) config_setting_get_float_elem(configLaunchPosition, 0);
@@ -375,6 +783,40 @@ void readConfigFile()
     // Time
     beginTime = (double) config_setting_get_float(configLaunchTime);
     
+    // Thrust angle off vertical, and which way from north (not required,
+    // 20 degrees towards the east)
+    double angle = 20.0;
+    double azimuth = 90.0;
+    config_lookup_float(&cfg, "launch.angle", &angle);
+    config_lookup_float(&cfg, "launch.azimuth", &azimuth);
+    launchAngle = radians(angle);
+    launchAzimuth = radians(azimuth);
+    
+    // Pitch program (not required), ([time, angle], ...) in s from launch
+    // and degrees off vertical
+    pitch.knots = 0;
+    config_setting_t *configPitch = config_lookup(&cfg, "launch.pitchProgram");
+    if (configPitch)
+    {
+        pitch.knots = config_setting_length(configPitch);
+        if (pitch.knots > PITCH_KNOTS)
+        {
+            printf("A pitch program can have at most %d knots\n", PITCH_KNOTS);
+            exit(1);
+        }
+        for (i = 0; i < pitch.knots; i++)
+        {
+            config_setting_t *knot = config_setting_get_elem(configPitch, i);
+            pitch.time[i] = (double) config_setting_get_float_elem(knot, 0);
+            pitch.angle[i] = radians((double) config_setting_get_float_elem(knot, 1));
+            if (i > 0 && pitch.time[i] <= pitch.time[i - 1])
+            {
+                printf("The pitch program's times have to go up\n");
+                exit(1);
+            }
+        }
+    }
+    
     /* Stages */
     // Allocate Memory
     numOfStages = config_setting_length(configStages);
@@ -443,8 +885,10 @@ void readConfigFile()
 
             desc.motors[j].thrustCurve = thrustCurve;
             desc.motors[j].curveLength = dataLength;
+            MotorTableInit(&desc.motors[j]);
             double fakeIsp = AverageIsp(desc.motors[j]);
-            printf("Average Isp: %f\n", fakeIsp);
+            if (!summary && !benchmark)
+                printf("Average Isp: %f\n", fakeIsp);
             desc.motors[j].isp = fakeIsp;
         }
 
@@ -502,6 +946,12 @@ void readConfigFile()
         stages[i].separationState = initialState;    
         stages[i].apogeeState = initialState;    
         stages[i].splashdownState = initialState;    
+        stages[i].maxQState = initialState;
+        stages[i].maxAccelState = initialState;
+        stages[i].maxQ = 0;
+        stages[i].maxAccel = 0;
+        stages[i].steps = 0;
+        stages[i].overTolerance = 0;
         stages[i].mode = INIT;
     }// End Stages Loop
 
@@ -512,9 +962,413 @@ void readConfigFile()
     initialRocketState = stages[0].initialState;
     initialRocketState.s = cartesian(Re + alt, PI/2.0 - radians(lat), radians(lon));
     initialRocketState.U = stages[0].initialState.U;
-    initialRocketState.a = LinearAcceleration(initialRocketState, 0);
     
     launchState = initialRocketState;
+    // Every downrange distance is measured from here, so only do it once
+    launchFrame = LocalFrame(launchState, 1);
+
+    // Sweep (only needed for a sweep, and after the stages it might change)
+    if (sweep)
+    {
+        if (!configSweep)
+        {
+            printf("A sweep needs a sweep section\n");
+            exit(1);
+        }
+        readSweep(configSweep);
+    }
+    if (optimize)
+    {
+        if (!configOptimize)
+        {
+            printf("Optimizing needs an optimize section\n");
+            exit(1);
+        }
+        readOptimize(configOptimize);
+    }
+
+    // Every curve has been copied out of the library by now
+    if (motorLib != NULL)
+    {
+        MotorLibraryFree(motorLib);
+        motorLib = NULL;
+    }
+}
+
+/**
+ * Which integrator to use. RK4 is fixed step and uses timeStep, DOPRI54 picks
+ * its own step between minStep and maxStep to stay inside tolerance.
+ */
+void readIntegrator(config_setting_t *configIntegrator)
+{
+    const char *method = NULL;
+    
+    integrator.tolerance = 1.0e-9;
+    integrator.minStep = 1.0e-4;
+    integrator.maxStep = 10.0;
+    
+    config_setting_lookup_string(configIntegrator, "method", &method);
+    config_setting_lookup_float(configIntegrator, "tolerance", &integrator.tolerance);
+    config_setting_lookup_float(configIntegrator, "minStep", &integrator.minStep);
+    config_setting_lookup_float(configIntegrator, "maxStep", &integrator.maxStep);
+    
+    if (method == NULL || strcmp(method, "RK4") == 0)
+        integrator.method = RK4;
+    else if (strcmp(method, "DOPRI54") == 0)
+        integrator.method = DOPRI54;
+    else
+    {
+        printf("Unknown integrator \"%s\"\n", method);
+        exit(1);
+    }
+    
+    if (integrator.minStep <= 0 || integrator.maxStep < integrator.minStep)
+    {
+        printf("Bad integrator step limits\n");
+        exit(1);
+    }
+}
+
+/**
+ * Which states end up in the output files. "interval" writes one every
+ * interval seconds, "events" just ignition, burnout, separation, apogee and
+ * landing, and "thin" as few as it takes to draw the path again to within
+ * position (m) and velocity (m/s) with cubic Hermite curves, and to within
+ * chord (m) with gnuplot's straight lines (0 to not care about those).
+ */
+void readOutput(config_setting_t *configOutput)
+{
+    const char *mode = NULL;
+    
+    config_setting_lookup_string(configOutput, "mode", &mode);
+    config_setting_lookup_float(configOutput, "interval", &output.interval);
+    config_setting_lookup_float(configOutput, "position", &output.position);
+    config_setting_lookup_float(configOutput, "velocity", &output.velocity);
+    config_setting_lookup_float(configOutput, "chord", &output.chord);
+    
+    if (mode == NULL || strcmp(mode, "interval") == 0)
+        output.mode = OUTPUT_INTERVAL;
+    else if (strcmp(mode, "events") == 0)
+        output.mode = OUTPUT_EVENTS;
+    else if (strcmp(mode, "thin") == 0)
+        output.mode = OUTPUT_THIN;
+    else
+    {
+        printf("Unknown output mode \"%s\"\n", mode);
+        exit(1);
+    }
+    
+    if (output.interval < 0 || output.position <= 0 || output.velocity <= 0
+        || output.chord < 0)
+    {
+        printf("Bad output tolerances\n");
+        exit(1);
+    }
+}
+
+/**
+ * How many Monte Carlo flights to fly and how much to scatter each one. If
+ * batch is more than zero that many flights are flown side by side with
+ * BatchFly() (fixed step RK4 only). All of the spreads are one sigma:
+ * thrustScale, isp, emptyMass and cd as a fraction of nominal, launchAngle
+ * in degrees and launchTime in seconds. Anything left out is not dispersed.
+ * table = 0 skips the one line per run file, and footprint is how far (m)
+ * the impact histogram reaches from the nominal impact point each way.
+ * ignitionDelay (s) scatters every upper stage's ignition delay.
+ *
+ * If branch is a stage above the first, the stages below it are flown once
+ * and every run carries on from a snapshot taken as stages.[branch] starts
+ * flying, so only the upper stages are dispersed. The snapshot is kept in
+ * the file snapshot, if there is one, and read back next time for as long as
+ * the rocket and launch stay the same.
+ */
+void readDispersions(config_setting_t *configDispersions)
+{
+    int seed = 1;
+    
+    dispersions.runs = 100;
+    dispersions.threads = 0;
+    dispersions.batch = 0;
+    dispersions.thrustScale = 0;
+    dispersions.isp = 0;
+    dispersions.emptyMass = 0;
+    dispersions.launchAngle = 0;
+    dispersions.cd = 0;
+    dispersions.launchTime = 0;
+    dispersions.table = 1;
+    dispersions.footprint = 10000;
+    dispersions.ignitionDelay = 0;
+    dispersions.branch = 0;
+    dispersions.snapshot = NULL;
+    
+    config_setting_lookup_int(configDispersions, "runs", &dispersions.runs);
+    config_setting_lookup_int(configDispersions, "threads", &dispersions.threads);
+    config_setting_lookup_int(configDispersions, "batch", &dispersions.batch);
+    config_setting_lookup_int(configDispersions, "seed", &seed);
+    config_setting_lookup_float(configDispersions, "thrustScale", &dispersions.thrustScale);
+    config_setting_lookup_float(configDispersions, "isp", &dispersions.isp);
+    config_setting_lookup_float(configDispersions, "emptyMass", &dispersions.emptyMass);
+    config_setting_lookup_float(configDispersions, "launchAngle", &dispersions.launchAngle);
+    config_setting_lookup_float(configDispersions, "Cd", &dispersions.cd);
+    config_setting_lookup_float(configDispersions, "launchTime", &dispersions.launchTime);
+    config_setting_lookup_int(configDispersions, "table", &dispersions.table);
+    config_setting_lookup_float(configDispersions, "footprint", &dispersions.footprint);
+    config_setting_lookup_float(configDispersions, "ignitionDelay", &dispersions.ignitionDelay);
+    config_setting_lookup_int(configDispersions, "branch", &dispersions.branch);
+    config_setting_lookup_string(configDispersions, "snapshot", &dispersions.snapshot);
+    dispersions.seed = seed;
+    
+    if (dispersions.runs <= 0)
+    {
+        printf("Monte Carlo needs at least one run\n");
+        exit(1);
+    }
+    if (dispersions.footprint <= 0)
+    {
+        printf("The Monte Carlo footprint has to be wider than nothing\n");
+        exit(1);
+    }
+    if (dispersions.branch < 0)
+    {
+        printf("dispersions.branch has to be a stage number\n");
+        exit(1);
+    }
+    // Already flown by the time the runs branch off
+    if (dispersions.branch > 0 && (dispersions.launchAngle != 0 || dispersions.launchTime != 0))
+    {
+        printf("launchAngle and launchTime can't be dispersed after stages.[%d]\n", dispersions.branch);
+        exit(1);
+    }
+}
+
+/**
+ * Which config values to sweep. Each parameter is a key (see readParameter())
+ * and steps values evenly spaced from from to to.
+ */
+void readSweep(config_setting_t *configSweep)
+{
+    config_setting_t *configParameters;
+    sweepParameter *p;
+    int i;
+    
+    sweeps.threads = 0;
+    config_setting_lookup_int(configSweep, "threads", &sweeps.threads);
+    
+    configParameters = config_setting_get_member(configSweep, "parameters");
+    if (configParameters == NULL || config_setting_length(configParameters) == 0
+        || config_setting_length(configParameters) > SWEEP_MAX_PARAMETERS)
+    {
+        printf("A sweep needs 1 to %d parameters\n", SWEEP_MAX_PARAMETERS);
+        exit(1);
+    }
+    sweeps.numberOfParameters = config_setting_length(configParameters);
+    sweeps.parameters = malloc(sweeps.numberOfParameters * sizeof(sweepParameter));
+    
+    for (i = 0; i < sweeps.numberOfParameters; i++)
+    {
+        p = &sweeps.parameters[i];
+        readParameter(config_setting_get_elem(configParameters, i), p);
+        if (p->steps < 1)
+        {
+            printf("Sweep parameter %s needs at least one step\n", p->key);
+            exit(1);
+        }
+    }
+    
+    if (SweepRuns(sweeps) > 1 << 30)
+    {
+        printf("A sweep of %lld runs is too many\n", SweepRuns(sweeps));
+        exit(1);
+    }
+}
+
+/**
+ * What the optimizer varies (variables, each a key from readParameter()
+ * searched between from and to), what it aims for (objective, a flight
+ * result to "max"imize, "min"imize or bring to target) and what has to hold
+ * (constraints, a min and/or max on a flight result). population 0 is
+ * picked from the number of variables, and the search stops after
+ * generations or once it has closed in to tolerance of each range.
+ */
+void readOptimize(config_setting_t *configOptimize)
+{
+    config_setting_t *configVariables;
+    config_setting_t *configConstraints;
+    config_setting_t *constraint;
+    const char *objective = NULL;
+    const char *goal = NULL;
+    const char *result;
+    int seed = 1;
+    int i;
+    
+    optimizer.threads = 0;
+    optimizer.population = 0;
+    optimizer.generations = 100;
+    optimizer.tolerance = 1.0e-4;
+    optimizer.target = 0;
+    optimizer.numberOfConstraints = 0;
+    optimizer.constraints = NULL;
+    
+    config_setting_lookup_int(configOptimize, "threads", &optimizer.threads);
+    config_setting_lookup_int(configOptimize, "population", &optimizer.population);
+    config_setting_lookup_int(configOptimize, "generations", &optimizer.generations);
+    config_setting_lookup_int(configOptimize, "seed", &seed);
+    config_setting_lookup_float(configOptimize, "tolerance", &optimizer.tolerance);
+    config_setting_lookup_string(configOptimize, "objective", &objective);
+    config_setting_lookup_string(configOptimize, "goal", &goal);
+    config_setting_lookup_float(configOptimize, "target", &optimizer.target);
+    optimizer.seed = seed;
+    
+    if (optimizer.generations < 1 || optimizer.population < 0)
+    {
+        printf("Optimizing needs at least one generation\n");
+        exit(1);
+    }
+    if (objective == NULL || (optimizer.objective = ResultIndex(objective)) < 0)
+    {
+        printf("Unknown objective \"%s\"\n", objective ? objective : "");
+        exit(1);
+    }
+    if (goal == NULL || strcmp(goal, "max") == 0)
+        optimizer.goal = GOAL_MAX;
+    else if (strcmp(goal, "min") == 0)
+        optimizer.goal = GOAL_MIN;
+    else if (strcmp(goal, "target") == 0)
+        optimizer.goal = GOAL_TARGET;
+    else
+    {
+        printf("Unknown goal \"%s\"\n", goal);
+        exit(1);
+    }
+    
+    configVariables = config_setting_get_member(configOptimize, "variables");
+    if (configVariables == NULL || config_setting_length(configVariables) == 0
+        || config_setting_length(configVariables) > SWEEP_MAX_PARAMETERS)
+    {
+        printf("Optimizing needs 1 to %d variables\n", SWEEP_MAX_PARAMETERS);
+        exit(1);
+    }
+    optimizer.numberOfVariables = config_setting_length(configVariables);
+    optimizer.variables = malloc(optimizer.numberOfVariables * sizeof(sweepParameter));
+    for (i = 0; i < optimizer.numberOfVariables; i++)
+        readParameter(config_setting_get_elem(configVariables, i), &optimizer.variables[i]);
+    
+    // Constraints (not required)
+    configConstraints = config_setting_get_member(configOptimize, "constraints");
+    if (configConstraints)
+    {
+        optimizer.numberOfConstraints = config_setting_length(configConstraints);
+        optimizer.constraints = malloc(optimizer.numberOfConstraints * sizeof(optimizeConstraint));
+        for (i = 0; i < optimizer.numberOfConstraints; i++)
+        {
+            constraint = config_setting_get_elem(configConstraints, i);
+            result = NULL;
+            optimizer.constraints[i].min = -HUGE_VAL;
+            optimizer.constraints[i].max = HUGE_VAL;
+            config_setting_lookup_string(constraint, "result", &result);
+            config_setting_lookup_float(constraint, "min", &optimizer.constraints[i].min);
+            config_setting_lookup_float(constraint, "max", &optimizer.constraints[i].max);
+            if (result == NULL || (optimizer.constraints[i].result = ResultIndex(result)) < 0)
+            {
+                printf("Unknown constraint result \"%s\"\n", result ? result : "");
+                exit(1);
+            }
+        }
+    }
+}
+
+/**
+ * One config value to vary, for a sweep or the optimizer. The key is written
+ * the way libconfig paths are (e.g. "stages.[0].emptyMass"), and can be
+ * timeStep, launch.juliandate, launch.angle, launch.azimuth, the angle of one
+ * of the launch.pitchProgram knots ("launch.pitchProgram.[1]"), the
+ * integrator's tolerance, minStep and maxStep, and each stage's emptyMass,
+ * ignitionDelay, stageDelay and motors' fuelMass. Angles are in degrees.
+ * The time step, the step limits and the tolerance have to stay above zero.
+ */
+void readParameter(config_setting_t *parameter, sweepParameter *p)
+{
+    char name[32];
+    int end = 0;
+    
+    p->key = NULL;
+    p->stage = 0;
+    p->motor = 0;
+    p->knot = 0;
+    p->from = 0;
+    p->to = 0;
+    p->steps = 1;
+    config_setting_lookup_string(parameter, "key", &p->key);
+    config_setting_lookup_float(parameter, "from", &p->from);
+    config_setting_lookup_float(parameter, "to", &p->to);
+    config_setting_lookup_int(parameter, "steps", &p->steps);
+    if (p->key == NULL)
+    {
+        printf("Every parameter needs a key\n");
+        exit(1);
+    }
+    
+    p->field = -1;
+    if (strcmp(p->key, "timeStep") == 0)
+        p->field = SWEEP_TIMESTEP;
+    else if (strcmp(p->key, "launch.juliandate") == 0)
+        p->field = SWEEP_JULIANDATE;
+    else if (strcmp(p->key, "launch.angle") == 0)
+        p->field = SWEEP_LAUNCHANGLE;
+    else if (strcmp(p->key, "launch.azimuth") == 0)
+        p->field = SWEEP_AZIMUTH;
+    else if (strcmp(p->key, "integrator.tolerance") == 0)
+        p->field = SWEEP_TOLERANCE;
+    else if (strcmp(p->key, "integrator.minStep") == 0)
+        p->field = SWEEP_MINSTEP;
+    else if (strcmp(p->key, "integrator.maxStep") == 0)
+        p->field = SWEEP_MAXSTEP;
+    else if (sscanf(p->key, "launch.pitchProgram.[%d]%n", &p->knot, &end) == 1
+             && p->key[end] == '\0')
+    {
+        p->field = SWEEP_PITCH;
+        if (p->knot < 0 || p->knot >= pitch.knots)
+        {
+            printf("There is no %s to vary\n", p->key);
+            exit(1);
+        }
+    }
+    else if (sscanf(p->key, "stages.[%d].motors.[%d].%31[A-Za-z]%n", 
+                    &p->stage, &p->motor, name, &end) == 3 && p->key[end] == '\0')
+    {
+        if (strcmp(name, "fuelMass") == 0)
+            p->field = SWEEP_FUELMASS;
+    }
+    else if (sscanf(p->key, "stages.[%d].%31[A-Za-z]%n", &p->stage, name, &end) == 2
+             && p->key[end] == '\0')
+    {
+        if (strcmp(name, "emptyMass") == 0)
+            p->field = SWEEP_EMPTYMASS;
+        else if (strcmp(name, "ignitionDelay") == 0)
+            p->field = SWEEP_IGNITIONDELAY;
+        else if (strcmp(name, "stageDelay") == 0)
+            p->field = SWEEP_STAGEDELAY;
+    }
+    
+    if (p->field < 0)
+    {
+        printf("Can't vary \"%s\"\n", p->key);
+        exit(1);
+    }
+    // Same as readIntegrator(), none of these can ever reach zero
+    if ((p->field == SWEEP_TIMESTEP || p->field == SWEEP_TOLERANCE
+         || p->field == SWEEP_MINSTEP || p->field == SWEEP_MAXSTEP)
+        && (p->from <= 0 || p->to <= 0))
+    {
+        printf("%s has to stay above 0\n", p->key);
+        exit(1);
+    }
+    if (p->stage < 0 || p->stage >= numberOfStages
+        || p->motor < 0 || p->motor >= stages[p->stage].description.numOfMotors)
+    {
+        printf("There is no %s to vary\n", p->key);
+        exit(1);
+    }
 }
 
 /**
@@ -541,85 +1395,138 @@ static int thrustCurve_noFile(vec2 **curve, double thrust, double fuel, double i
     return 2;
 }
 
+/**
+ * Reads a normalized thrust curve and scales it up to thrust. Curves in the
+ * motor library (if there is one) are copied out of it rather than read.
+ */
 static int thrustCurve_File(vec2 **curve, const char *fileName, double thrust)
-{    
-    FILE *data;
+{
+    const vec2 *stored = NULL;
     int dataLength = 0;
-    char line[128];         // or other suitable maximum line size
-    int i = 0;
-    
-    data = fopen(fileName, "r");
-    if (data == NULL)
+    int i;
+
+    if (motorLib != NULL)
+        stored = MotorLibraryFind(motorLib, fileName, &dataLength);
+
+    if (stored != NULL)
     {
-        printf("Error reading Thrust Curve file\n");
-        exit(1);
+        *curve = malloc(dataLength * sizeof(vec2));
+        if (*curve == NULL)
+        {
+            printf("Out of memory for thrust curve %s\n", fileName);
+            exit(1);
+        }
+        memcpy(*curve, stored, dataLength * sizeof(vec2));
     }
+    else
+        dataLength = ReadThrustCurve(fileName, curve);
 
-    /* Read through once and figure out how long the file is, ignoring lines
-     * that start with "#"
-     */
-    while ( fgets(line, sizeof line, data) != NULL )
+    // The motor tables need a start and an end to spread out between
+    if (dataLength < 2)
     {
-        if (line[0] != '#')
-            dataLength++;
+        printf("Thrust curve %s needs at least 2 points, it has %d\n", fileName, dataLength);
+        exit(1);
     }
 
-    rewind(data);
+    for (i = 0; i < dataLength; i++)
+        curve[0][i].j *= thrust;
 
-    // Allocate data
-    *curve = malloc(dataLength * sizeof(vec2));
+    return dataLength;
+}
 
-    double impulse = 0;
-    /* Put the data in an array */
-    while ( fgets(line, sizeof line, data) != NULL )
+void initOutputFiles(simContext *sim)
+{
+    // The trajectory goes in one binary file, trajconv turns it back into
+    // the .dat files when they are wanted
+    if (binaryOutput)
+        sim->outTraj = TrajCreate("Output/out.traj");
+    else
     {
-        float time, normalThrust;
-        if (line[0] != '#')
+        // Don't leave an old one around to be converted over these
+        remove("Output/out.traj");
+        
+        // Try to open files
+        sim->outBurn = fopen("Output/out-burn.dat", "w");
+        sim->outCoast = fopen("Output/out-coast.dat", "w");
+        sim->outSpent = fopen("Output/out-spentStages.dat", "w");
+        
+        if (   sim->outBurn == NULL 
+            || sim->outCoast == NULL 
+            || sim->outSpent == NULL)
         {
-            sscanf(line, "%f,%f", &time, &normalThrust);
-            vec2 point;
-            curve[0][i].i = time;
-            curve[0][i].j = normalThrust * thrust;
-            double interval = 0;
-            if (i == 0)
-                interval = time;
-            else
-                interval = time - curve[0][i - 1].i;
-            impulse += (normalThrust * thrust) * interval;
-            i++;
+            printf("File Handle error.");
+            exit(1);
         }
+        
+        // Written a line at a time, so let them go out in big blocks
+        setvbuf(sim->outBurn, NULL, _IOFBF, FORMAT_BUFFER);
+        setvbuf(sim->outCoast, NULL, _IOFBF, FORMAT_BUFFER);
+        setvbuf(sim->outSpent, NULL, _IOFBF, FORMAT_BUFFER);
+        
+        // Print Headers
+        PrintHeader(sim->outBurn);
+        PrintHeader(sim->outCoast);
+        PrintHeader(sim->outSpent);
     }
-    // Close the file
-    fclose(data);
-
-    return dataLength;
-}
-
-void initOutputFiles()
-{
-    // Try to open files
-    outBurn = fopen("Output/out-burn.dat", "w");
-    outCoast = fopen("Output/out-coast.dat", "w");
-    outKml = fopen("Output/out.kml", "w");
-    outForce = fopen("Output/out-force.dat", "w");
-    outSpent = fopen("Output/out-spentStages.dat", "w");
+    
+    sim->outKml = fopen("Output/out.kml", "w");
+    sim->outForce = fopen("Output/out-force.dat", "w");
     
     // See if it worked
-    if (   outBurn == NULL 
-        || outCoast == NULL 
-        || outKml == NULL
-        || outForce == NULL 
-        || outSpent == NULL)
+    if (sim->outKml == NULL || sim->outForce == NULL)
     {
         printf("File Handle error.");
         exit(1);
     }
+    setvbuf(sim->outForce, NULL, _IOFBF, FORMAT_BUFFER);
     
-    // Print Headers
-    PrintHeader(outBurn);
-    PrintHeader(outCoast);
-    PrintHeader(outSpent);
-    PrintKmlHeader(outKml);
+    PrintKmlHeader(sim->outKml);
+}
+
+/**
+ * A simulation gets its own copy of the rocket read from the config file, so
+ * that it can be flown without touching anyone else's. The motors and chutes
+ * are only ever read and stay shared.
+ */
+void InitSimContext(simContext *sim)
+{
+    sim->met = 0;
+    sim->jd = BeginTime();
+    sim->h = h;
+    sim->integrator = integrator;
+    sim->output = output;
+    sim->numberOfStages = numberOfStages;
+    sim->stages = malloc(numberOfStages * sizeof(Rocket_Stage));
+    memcpy(sim->stages, stages, numberOfStages * sizeof(Rocket_Stage));
+    sim->currentStage = &sim->stages[0];
+    sim->currentMass = 0;
+    sim->thrustScale = 1.0;
+    sim->ispScale = 1.0;
+    sim->cdScale = 1.0;
+    sim->launchAngle = launchAngle;
+    sim->heading = Heading(launchAzimuth);
+    sim->pitch = pitch;
+    sim->cachedMass = 0;
+    sim->ignitionTime = 0;
+    sim->ignitionFuelMass = 0;
+    sim->verbose = 1;
+    sim->concurrent = 1;
+    sim->staging = NULL;
+    sim->work.dopriFsal = 0;
+    sim->outBurn = NULL;
+    sim->outCoast = NULL;
+    sim->outKml = NULL;
+    sim->outForce = NULL;
+    sim->outSpent = NULL;
+    sim->outTraj = NULL;
+    sim->writer = NULL;
+}
+
+void FreeSimContext(simContext *sim)
+{
+    free(sim->stages);
+    sim->stages = NULL;
+    sim->currentStage = NULL;
 }
 
 state LaunchState()
@@ -627,6 +1534,11 @@ state LaunchState()
     return launchState;
 }
 
+localFrame LaunchFrame()
+{
+    return launchFrame;
+}
+
 double BeginTime()
 {
     return beginTime;
@@ -637,19 +1549,24 @@ double RunTime()
     return simulationRunTime;
 }
 
-Rocket_Stage CurrentStage()
+integratorDesc Integrator()
 {
-    return currentStage;
+    return integrator;
 }
 
-int NumberOfStages()
+/**
+ * Whether the thrust ever points anywhere but launchAngle towards the east
+ */
+int Steered()
 {
-    return numberOfStages;
+    vec2 heading = Heading(launchAzimuth);
+    
+    return pitch.knots > 0 || heading.i != 1.0;
 }
 
-Rocket_Stage *WholeRocket()
+int NumberOfStages()
 {
-    return stages;
+    return numberOfStages;
 }
 
 double initFuelMass(Rocket_Stage stage)
@@ -657,7 +1574,7 @@ double initFuelMass(Rocket_Stage stage)
     int i;
     stageDesc desc = stage.description;
     int numOfMotors = desc.numOfMotors;
-    int fuelMass = 0;
+    double fuelMass = 0;
     for (i = 0; i < numOfMotors; i++)
         fuelMass += desc.motors[i].fuelMass;
     return fuelMass;
@@ -669,6 +1586,12 @@ void printHelp()
     printf("©2009 Nathan Bergey availible under GPL v3\n\n");
     printf("Switches:\n");
     printf("\t-c - Config file name\n");
+    printf("\t-m - Monte Carlo, fly the config's dispersions\n");
+    printf("\t-w - Sweep, fly every point of the config's sweep grid\n");
+    printf("\t-o - Optimize, search for the config's best flight\n");
+    printf("\t-b - Binary trajectory in Output/out.traj, see trajconv\n");
+    printf("\t-s [json|csv] - No files, just print the results of the flight\n");
+    printf("\t-B [json|csv] - Benchmark the physics and a whole flight\n");
     printf("\t-v - Version number\n");
     printf("\n");
     printf("Examples:\n");
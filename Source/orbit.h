@@ -3,6 +3,13 @@
 double BeginTime();
 double RunTime();
 state LaunchState();
+localFrame LaunchFrame();
 int NumberOfStages();
-Rocket_Stage CurrentStage();
-Rocket_Stage *WholeRocket();
+integratorDesc Integrator();
+int Steered();
+void InitSimContext(simContext *sim);
+void FreeSimContext(simContext *sim);
+void Fly(simContext *sim);
+void FlyAndCapture(simContext *sim, int at, simContext *capturing);
+void PrimeStage(simContext *sim, int i);
+flightResult FlightResult(simContext *sim);
@@ -5,25 +5,25 @@
 #include "coord.h"
 #include "orbit.h"
 #include "physics.h"
+#include "atmosphere.h"
 
-double currentMass;
+vec force_Gravity(simContext *sim, state r, kinematics *k);
+static double motorThrust(simContext *sim, double met);
+static vec thrustVector(simContext *sim, state r, double met, double thrust, double radius);
 
-vec force_Gravity(state r);
-static double rho(double h);
-static double zTemperature(double h);
-
-vec LinearAcceleration(state r, double t)
+vec LinearAcceleration(simContext *sim, state r, double t)
 {
     vec g, d, th, physics;
-    currentMass = RocketMass(r, t);
+    kinematics k = Kinematics(r);
+    sim->currentMass = RocketMass(sim, r, t);
     
-    g = force_Gravity(r);
-    d = Force_Drag(r, t);
-    th = Force_Thrust(r, t);
+    g = force_Gravity(sim, r, &k);
+    d = Force_Drag(sim, r, t, &k);
+    th = Force_Thrust(sim, r, t, &k);
     
-    physics.i = (g.i + d.i + th.i) / currentMass;
-    physics.j = (g.j + d.j + th.j) / currentMass;
-    physics.k = (g.k + d.k + th.k) / currentMass;
+    physics.i = (g.i + d.i + th.i) / sim->currentMass;
+    physics.j = (g.j + d.j + th.j) / sim->currentMass;
+    physics.k = (g.k + d.k + th.k) / sim->currentMass;
     
     return physics;
 }
@@ -39,13 +39,43 @@ vec AngularAcceleration(state r, double t)
     return alpha;
 }
 
-vec force_Gravity(state r)
+/**
+ * Everything the force models want to know about where r is and how fast it
+ * is going, so each sqrt and divide is done once per evaluation instead of
+ * once per force.
+ */
+kinematics Kinematics(state r)
+{
+    kinematics k;
+    double invSpeed = 0;
+    
+    k.radius = Position(r);
+    k.invRadius = 1.0 / k.radius;
+    k.altitude = k.radius - Re;
+    k.speed = Velocity(r);
+    if (k.speed > 0)
+        invSpeed = 1.0 / k.speed;
+    
+    k.unitPosition.i = r.s.i * k.invRadius;
+    k.unitPosition.j = r.s.j * k.invRadius;
+    k.unitPosition.k = r.s.k * k.invRadius;
+    k.unitVelocity.i = r.U.i * invSpeed;
+    k.unitVelocity.j = r.U.j * invSpeed;
+    k.unitVelocity.k = r.U.k * invSpeed;
+    
+    k.density = AtmosphereDensity(k.altitude);
+    k.dynamicPressure = 0.5 * k.density * k.speed*k.speed;
+    
+    return k;
+}
+
+vec force_Gravity(simContext *sim, state r, kinematics *k)
 {
     vec g, e;
     double gravity;
     
-    gravity = G * ((Me * currentMass)/Square(Position(r)));
-    e = UnitVec(r.s);
+    gravity = G * Me * sim->currentMass * k->invRadius*k->invRadius;
+    e = k->unitPosition;
 
     g.i = gravity * e.i;
     g.j = gravity * e.j;
@@ -54,23 +84,23 @@ vec force_Gravity(state r)
     return g;
 }
 
-vec Force_Drag(state r , double t)
+vec Force_Drag(simContext *sim, state r, double t, kinematics *k)
 {
     vec d, v;
     double Cd = 0.8;
     double A = 0.09;
-    double totalDrag, alt;
+    double totalDrag;
     
-    if (CurrentStage().mode == SEPARATED)
+    if (sim->currentStage->mode == SEPARATED)
     {
         Cd = 1.4;
         A = 10.0;
     }
+    Cd *= sim->cdScale;
     
-    v = UnitVec(r.U);
-    alt = Altitude(r);
+    v = k->unitVelocity;
     
-    totalDrag = -(0.5 * rho(alt) * Velocity(r)*Velocity(r) * A  * Cd);
+    totalDrag = -(k->dynamicPressure * A  * Cd);
     
     d.i = totalDrag * v.i;
     d.j = totalDrag * v.j;
@@ -84,31 +114,16 @@ vec Force_Drag(state r , double t)
 /**
  * Thrust on the rocket
  */
-vec Force_Thrust(state r, double t)
+vec Force_Thrust(simContext *sim, state r, double t, kinematics *k)
 {
     vec Ft;
-    vec Ft_enu, Ft_ecef;
     vec velocityHat;
-    double thrust;
-    double phi;
     double rate = radians(40.0) / 100.0;
-    phi = radians(20);
 
     Ft = ZeroVec();
     
-    if (CurrentStage().mode == BURNING)
-    {
-        vec2 *curve = CurrentStage().description.motors[0].thrustCurve;
-        int length = CurrentStage().description.motors[0].curveLength;
-        thrust = Interpolat1D(curve, t, length);
-        
-        Ft_enu.i = thrust * sin(phi);
-        Ft_enu.j = 0.0;
-        Ft_enu.k = thrust * cos(phi);
-        
-        Ft_ecef = EnuToEcef(Ft_enu, r);
-        Ft = Ft_ecef;
-    }
+    if (sim->currentStage->mode == BURNING)
+        Ft = thrustVector(sim, r, t, motorThrust(sim, t), k->radius);
     
     ///TODO: Fix this as a function of time
     /*
@@ -116,7 +131,7 @@ vec Force_Thrust(state r, double t)
     //thrust = Interpolat1D(ThrustCurve(), t);
     phi = radians(6.0);
     
-    if (CurrentStage().mode == BURNING)
+    if (sim->currentStage->mode == BURNING)
     {
         Ft_enu.i = thrust * sin(phi);
         Ft_enu.j = 0.0;
@@ -139,76 +154,133 @@ vec Force_Thrust(state r, double t)
     return Ft;
 }
 
-static double rho(double h)
+double KE(simContext *sim, state r, double met)
+{
+    return 0.5 * RocketMass(sim, r, met) * Square(Velocity(r));
+}
+
+double PE(simContext *sim, state r, double met)
 {
-    double p, T, rho, R = 287.05;
+    return (G * Me * RocketMass(sim, r, met))/Position(r) - (G * Me * RocketMass(sim, r, met))/Re;
+}
+
+double MDot(simContext *sim, state r, double met)
+{
+    double mdot = 0;
+    motor *m = &sim->currentStage->description.motors[0];
+    double Isp = sim->ispScale * m->isp;
     
-    p = 100*pow((44331.5 - h)/11880.516, 1.0/0.190263);
-    T = zTemperature(h) + 273; //K
+    mdot =  motorThrust(sim, met) / (g_0 * Isp);
+
+    return mdot;
+}
+
+/**
+ * What the output files want to know about the rocket at r, besides r itself.
+ * Worked out together so the motor is only looked up once.
+ */
+derived Derived(simContext *sim, state r)
+{
+    derived d;
+    motor *m = &sim->currentStage->description.motors[0];
+    double thrust = motorThrust(sim, r.met);
     
-    //return 1.293;
-    rho = p/(R*T);
+    d.mass = RocketMass(sim, r, r.met);
+    d.thrust = ZeroVec();
+    if (sim->currentStage->mode == BURNING)
+        d.thrust = thrustVector(sim, r, r.met, thrust, Position(r));
+    d.mdot = thrust / (g_0 * (sim->ispScale * m->isp));
     
-    if (rho > 1.0e-5)
-        return rho;
-    return 0.0;
+    return d;
 }
 
-static double zTemperature(double h)
+/**
+ * How hard the motor is pushing at met, none unless the stage is burning
+ */
+static double motorThrust(simContext *sim, double met)
 {
-    if (h < 11.019e3)
-        return -0.0065*h + 15.0;
-    if (h >= 11.019e3 && h < 20.063e3)
-        return -56.5;
-    if (h >= 20.063e3 && h < 32.162e3)
-        return 0.001*h - 76.563;
-    if (h >= 32.162e3 && h < 47.350e3)
-        return 0.0028*h - 134.554;
-    if (h >= 47.350e3 && h < 51.413e3)
-        return -1.974;
-    if (h >= 51.413e3 && h < 71.802e3)
-        return -0.0028*h + 141.982;
-   return -100.0;
+    motor *m = &sim->currentStage->description.motors[0];
+    
+    if (sim->currentStage->mode != BURNING)
+        return 0;
+    return sim->thrustScale * MotorThrust(m, met - sim->ignitionTime);
 }
 
-double KE(state r, double met)
+/**
+ * How far off vertical the thrust points at met. launchAngle the whole way
+ * unless there is a pitch program, which goes in straight lines between its
+ * knots and holds the first and last angles before and after them.
+ */
+double PitchAngle(simContext *sim, double met)
 {
-    return 0.5 * RocketMass(r, met) * Square(Velocity(r));
+    pitchProgram *p = &sim->pitch;
+    int i;
+    
+    if (p->knots == 0)
+        return sim->launchAngle;
+    if (met <= p->time[0])
+        return p->angle[0];
+    for (i = 1; i < p->knots; i++)
+    {
+        if (met < p->time[i])
+            return p->angle[i - 1] + (p->angle[i] - p->angle[i - 1])
+                 * (met - p->time[i - 1]) / (p->time[i] - p->time[i - 1]);
+    }
+    return p->angle[p->knots - 1];
 }
 
-double PE(state r, double met)
+/**
+ * thrust pointed PitchAngle() off vertical, leaning towards sim->heading
+ */
+static vec thrustVector(simContext *sim, state r, double met, double thrust, double radius)
 {
-    return (G * Me * RocketMass(r, met))/Position(r) - (G * Me * RocketMass(r, met))/Re;
+    vec Ft_enu;
+    double phi = PitchAngle(sim, met);
+    double across = thrust * sin(phi);
+    
+    Ft_enu.i = across * sim->heading.i;
+    Ft_enu.j = across * sim->heading.j;
+    Ft_enu.k = thrust * cos(phi);
+    
+    return LocalToEcef(Ft_enu, LocalFrameAt(r, radius, 0));
 }
 
-double MDot(state r, double met)
+/**
+ * How much fuel is left in the burning stage at met, straight from the
+ * motor's impulse table instead of adding up MDot() every step.
+ */
+double FuelMass(simContext *sim, double met)
 {
-    double mdot = 0;
-    double thrust = Norm(Force_Thrust(r, met));
-    double Isp = CurrentStage().description.motors[0].isp;
+    motor *m = &sim->currentStage->description.motors[0];
+    double Isp = sim->ispScale * m->isp;
+    double impulse = sim->thrustScale * MotorImpulse(m, met - sim->ignitionTime);
     
-    mdot =  thrust / (g_0 * Isp);
-
-    return mdot;
+    return sim->ignitionFuelMass - impulse / (g_0 * Isp);
 }
 
-double RocketMass(state r, double met)
+/**
+ * Works out the mass of everything that is flying with the current stage,
+ * less the fuel it is burning, and keeps it in sim->cachedMass. That only
+ * changes when the stage changes mode, so call this at ignition, burnout and
+ * separation and RocketMass() is just an add.
+ */
+void UpdateMassCache(simContext *sim)
 {
-    Rocket_Stage currentStage = CurrentStage();
-    Rocket_Stage *rocket = WholeRocket();
+    Rocket_Stage *currentStage = sim->currentStage;
+    Rocket_Stage *rocket = sim->stages;
     double totalMass = 0;
     int i;
     
     // If we are atteched to the rocket
-    if (currentStage.mode < SEPARATED)
+    if (currentStage->mode < SEPARATED)
     {
         // Get attached stages
-        for (i = currentStage.description.stage; i < NumberOfStages(); i++)
+        for (i = currentStage->description.stage; i < sim->numberOfStages; i++)
         {
             // Add empty mass's
             totalMass += rocket[i].description.emptyMass;
             // Get the fuel of the unlit stages
-            if (i > currentStage.description.stage)
+            if (i > currentStage->description.stage)
             {   
                 int j;
                 for (j = 0; j < rocket[i].description.numOfMotors; j++)
@@ -220,12 +292,17 @@ double RocketMass(state r, double met)
     }
     else
     {
-        totalMass += currentStage.description.emptyMass;
+        totalMass += currentStage->description.emptyMass;
     }
     
+    sim->cachedMass = totalMass;
+    // The forces are different now, so the integrator starts afresh
+    sim->work.dopriFsal = 0;
+}
+
+double RocketMass(simContext *sim, state r, double met)
+{
     // Get Current fuel mass
-    totalMass += r.fuelMass;
-    
-    return totalMass;
+    return sim->cachedMass + r.fuelMass;
 }
 
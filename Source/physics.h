@@ -3,11 +3,16 @@
 #define Me 5.9742e24
 #define g_0 9.80665
 
-vec LinearAcceleration(state r, double t);
+vec LinearAcceleration(simContext *sim, state r, double t);
 vec AngularAcceleration(state r, double t);
-vec Force_Drag(state r, double t);
-vec Force_Thrust(state r, double t);
-double KE(state r, double met);
-double PE(state r, double met);
-double RocketMass(state r, double met);
-double MDot(state r, double met);
+kinematics Kinematics(state r);
+vec Force_Drag(simContext *sim, state r, double t, kinematics *k);
+vec Force_Thrust(simContext *sim, state r, double t, kinematics *k);
+double KE(simContext *sim, state r, double met);
+double PE(simContext *sim, state r, double met);
+double RocketMass(simContext *sim, state r, double met);
+void UpdateMassCache(simContext *sim);
+double MDot(simContext *sim, state r, double met);
+derived Derived(simContext *sim, state r);
+double FuelMass(simContext *sim, double met);
+double PitchAngle(simContext *sim, double met);
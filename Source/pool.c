@@ -0,0 +1,182 @@
+/*!
+ * \file pool.c
+ * \brief Runs a lot of jobs of different lengths on a pool of threads
+ *
+ * Every thread starts with an even share of the jobs, as a range of job
+ * numbers of its own, and works through it from the front. A thread that runs
+ * out takes the back half of whichever thread has the most left and carries
+ * on with that. So the threads that got the flights that hit the ground early
+ * help out the ones that got the flights that go to space, and threads only
+ * ever touch each other's memory when one of them has run dry.
+ *
+ * Each range is one 64 bit word, the first job in the low half and one past
+ * the last in the high half, so taking from the front and stealing from the
+ * back are both a single compare and swap. Nothing else is shared: the jobs
+ * write their own answers and pthread_join() hands them back.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pool.h"
+
+#define POOL_LINE 64            // Bytes in a cache line, one queue to each
+
+typedef struct {atomic_ullong range;
+                    char pad[POOL_LINE - sizeof(atomic_ullong)];} poolQueue;
+typedef struct {poolQueue *queues;
+                    int threads;
+                    void (*work)(void *arg, int job);
+                    void *arg;} pool;
+typedef struct {pool *p;
+                    int id;} poolThread;
+
+static void *poolWorker(void *arg);
+static int take(poolQueue *q, int *job);
+static int steal(pool *p, int id, int *job);
+static unsigned long long pack(uint32_t first, uint32_t end);
+
+int PoolRun(int jobs, int threads, void (*work)(void *arg, int job), void *arg)
+{
+    pool p;
+    poolThread *workers;
+    pthread_t *handles;
+    int i;
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > jobs)
+        threads = jobs;
+    if (threads < 1)
+        threads = 1;
+
+    p.threads = threads;
+    p.work = work;
+    p.arg = arg;
+    p.queues = malloc(threads * sizeof(poolQueue));
+    workers = malloc(threads * sizeof(poolThread));
+    handles = malloc(threads * sizeof(pthread_t));
+    if (p.queues == NULL || workers == NULL || handles == NULL)
+    {
+        printf("Out of memory for %d threads\n", threads);
+        exit(1);
+    }
+
+    for (i = 0; i < threads; i++)
+    {
+        atomic_init(&p.queues[i].range,
+                    pack((long long) jobs * i / threads, (long long) jobs * (i + 1) / threads));
+        workers[i].p = &p;
+        workers[i].id = i;
+    }
+
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&handles[i], NULL, poolWorker, &workers[i]) != 0)
+        {
+            printf("Couldn't start thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++)
+        pthread_join(handles[i], NULL);
+
+    free(handles);
+    free(workers);
+    free(p.queues);
+
+    return threads;
+}
+
+/**
+ * Works through this thread's own jobs, then everyone else's
+ */
+static void *poolWorker(void *arg)
+{
+    poolThread *t = arg;
+    pool *p = t->p;
+    int job;
+
+    while (take(&p->queues[t->id], &job) || steal(p, t->id, &job))
+        p->work(p->arg, job);
+
+    return NULL;
+}
+
+/**
+ * The next job from the front of q, if there is one
+ */
+static int take(poolQueue *q, int *job)
+{
+    unsigned long long range = atomic_load_explicit(&q->range, memory_order_relaxed);
+    uint32_t first, end;
+
+    do
+    {
+        first = (uint32_t) range;
+        end = range >> 32;
+        if (first >= end)
+            return 0;
+    } while (!atomic_compare_exchange_weak_explicit(&q->range, &range, pack(first + 1, end),
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    *job = first;
+    return 1;
+}
+
+/**
+ * Takes the back half of the longest queue there is. The first job of it is
+ * done straight away, the rest become thread id's queue. Fails once every
+ * queue is empty, and as no job ever goes back into a queue once it has been
+ * taken, that means they are all done or being done.
+ */
+static int steal(pool *p, int id, int *job)
+{
+    unsigned long long range, most;
+    uint32_t first, end, half;
+    int victim, i;
+
+    for (;;)
+    {
+        victim = -1;
+        most = 0;
+        for (i = 0; i < p->threads; i++)
+        {
+            if (i == id)
+                continue;
+            range = atomic_load_explicit(&p->queues[i].range, memory_order_relaxed);
+            first = (uint32_t) range;
+            end = range >> 32;
+            if (first < end && end - first > most)
+            {
+                most = end - first;
+                victim = i;
+            }
+        }
+        if (victim < 0)
+            return 0;
+
+        range = atomic_load_explicit(&p->queues[victim].range, memory_order_relaxed);
+        first = (uint32_t) range;
+        end = range >> 32;
+        if (first >= end)
+            continue;
+        half = (end - first + 1) / 2;
+        if (atomic_compare_exchange_strong_explicit(&p->queues[victim].range, &range,
+                                                    pack(first, end - half),
+                                                    memory_order_relaxed, memory_order_relaxed))
+        {
+            *job = end - half;
+            atomic_store_explicit(&p->queues[id].range, pack(end - half + 1, end),
+                                  memory_order_relaxed);
+            return 1;
+        }
+    }
+}
+
+static unsigned long long pack(uint32_t first, uint32_t end)
+{
+    return (unsigned long long) end << 32 | first;
+}
@@ -0,0 +1,13 @@
+/*!
+ * \file pool.h
+ * \brief Runs a lot of jobs of different lengths on a pool of threads
+ */
+
+/*!
+ * Calls work(arg, n) once for every n from 0 to jobs - 1, spread over a pool
+ * of threads that steal jobs from each other when they run out. Returns once
+ * every job is done.
+ * \param threads How many threads, 0 is one per core
+ * \return How many threads there were
+ */
+int PoolRun(int jobs, int threads, void (*work)(void *arg, int job), void *arg);
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include "structs.h"
 #include "physics.h"
 #include "vecmath.h"
@@ -6,25 +8,34 @@
 #include "rk4.h"
 
 #define ERR 1.0e-6
-#define DOF 3
+#define SAFETY 0.9
+#define MIN_SCALE 0.2
+#define MAX_SCALE 5.0
 
-static state updateState(state r, int previousStep, double point);
-static void initilize(state r);
-static void evalSecondDeriv(state r, double t);
-static void evalFirstDeriv(state r, double t);
+static state updateState(integratorWork *w, state r, int previousStep, double point);
+static void initilize(integratorWork *w, state r);
+static void evalSecondDeriv(simContext *sim, state r, double t);
+static void evalFirstDeriv(integratorWork *w, state r, double t);
+static void evalScalarDeriv(simContext *sim, state r, double t);
 static state setFirstDeriv(state r, double *firstDerivative);
 static state setFunction(state r, double *function);
+static state setScalar(state r, double *scalar);
 
-double function_n[DOF];
-double firstDeriv_n[DOF];
-double function_n1[DOF];
-double firstDeriv_n1[DOF];
-
-double firstDeriv[DOF];
-double secondDeriv[DOF];
-
-double rk4firstDeriv[4][DOF];
-double rk4secondDeriv[4][DOF];
+/* Dormand-Prince 5(4) Butcher tableau */
+static const double dopriC[DOPRI_STAGES] = 
+    {0.0, 1.0/5.0, 3.0/10.0, 4.0/5.0, 8.0/9.0, 1.0, 1.0};
+static const double dopriA[DOPRI_STAGES][DOPRI_STAGES - 1] = {
+    {0},
+    {1.0/5.0},
+    {3.0/40.0, 9.0/40.0},
+    {44.0/45.0, -56.0/15.0, 32.0/9.0},
+    {19372.0/6561.0, -25360.0/2187.0, 64448.0/6561.0, -212.0/729.0},
+    {9017.0/3168.0, -355.0/33.0, 46732.0/5247.0, 49.0/176.0, -5103.0/18656.0},
+    {35.0/384.0, 0.0, 500.0/1113.0, 125.0/192.0, -2187.0/6784.0, 11.0/84.0}};
+// Difference between the 5th and 4th order weights
+static const double dopriE[DOPRI_STAGES] = 
+    {71.0/57600.0, 0.0, -71.0/16695.0, 71.0/1920.0, -17253.0/339200.0, 
+     22.0/525.0, -1.0/40.0};
 
 /*!
  * A generic fourth-order Runge-Kutta numerical integration engine for second 
@@ -45,86 +56,328 @@ double rk4secondDeriv[4][DOF];
  * rk4firstDeriv = Guesses for the first Derivitive
  * rk4secondDeriv = Guesses for the second Derivitve
  *
+ * Scalars (eg, fuel mass) are first order, scalarDeriv is their rate of
+ * change, and they are stepped with the same stages so that the forces see
+ * them at the right time inside the step.
+ *
+ * All of the working arrays live in sim->work so that any number of
+ * simulations can be stepped at once.
+ *
  * You are not expected to understand this.
  */
-state rk4(state r, float h)
+state rk4(simContext *sim, state r, double h)
 {
     int i;
     double average;
     double t = r.met;
+    integratorWork *w = &sim->work;
     
     // Prime the pump
-    initilize(r);
+    initilize(w, r);
      
     /* First Steps */
-    evalSecondDeriv(r, t);                  //Begining
+    evalSecondDeriv(sim, r, t);                 //Begining
+    evalScalarDeriv(sim, r, t);
     
     for (i = 0; i < DOF; i++)
     {
-        rk4firstDeriv[0][i] = firstDeriv_n[i];      //Using initial values
-        rk4secondDeriv[0][i] = secondDeriv[i];
+        w->rk4firstDeriv[0][i] = w->firstDeriv_n[i];      //Using initial values
+        w->rk4secondDeriv[0][i] = w->secondDeriv[i];
     }    
+    for (i = 0; i < SCALAR_DOF; i++)
+        w->rk4scalarDeriv[0][i] = w->scalarDeriv[i];
     
     /* Second Steps */
-    r = updateState(r, 0, 0.5*h);           //Midpoint
-    evalFirstDeriv(r, t + 0.5*h);           //Midpoint
-    evalSecondDeriv(r, t + 0.5*h);          //Midpoint
+    r = updateState(w, r, 0, 0.5*h);        //Midpoint
+    evalFirstDeriv(w, r, t + 0.5*h);        //Midpoint
+    evalSecondDeriv(sim, r, t + 0.5*h);     //Midpoint
+    evalScalarDeriv(sim, r, t + 0.5*h);
 
     for (i = 0; i < DOF; i++)
     {
-        rk4firstDeriv[1][i] = firstDeriv[i];
-        rk4secondDeriv[1][i] = secondDeriv[i];
+        w->rk4firstDeriv[1][i] = w->firstDeriv[i];
+        w->rk4secondDeriv[1][i] = w->secondDeriv[i];
     }
+    for (i = 0; i < SCALAR_DOF; i++)
+        w->rk4scalarDeriv[1][i] = w->scalarDeriv[i];
 
 
     /* Third Steps */
-    r = updateState(r, 1, 0.5*h);           //Midpoint
-    evalFirstDeriv(r, t + 0.5*h);           //Midpoint
-    evalSecondDeriv(r, t + 0.5*h);          //Midpoint
+    r = updateState(w, r, 1, 0.5*h);        //Midpoint
+    evalFirstDeriv(w, r, t + 0.5*h);        //Midpoint
+    evalSecondDeriv(sim, r, t + 0.5*h);     //Midpoint
+    evalScalarDeriv(sim, r, t + 0.5*h);
 
     for (i = 0; i < DOF; i++)
     {
-        rk4firstDeriv[2][i] = firstDeriv[i];
-        rk4secondDeriv[2][i] = secondDeriv[i];
+        w->rk4firstDeriv[2][i] = w->firstDeriv[i];
+        w->rk4secondDeriv[2][i] = w->secondDeriv[i];
     }
+    for (i = 0; i < SCALAR_DOF; i++)
+        w->rk4scalarDeriv[2][i] = w->scalarDeriv[i];
 
 
     /* Fourth Steps */
-    r = updateState(r, 2, h);               //Endpoint
-    evalFirstDeriv(r, t + h);               //Endpoint
-    evalSecondDeriv(r, t + h);              //Endpoint
+    r = updateState(w, r, 2, h);            //Endpoint
+    evalFirstDeriv(w, r, t + h);            //Endpoint
+    evalSecondDeriv(sim, r, t + h);         //Endpoint
+    evalScalarDeriv(sim, r, t + h);
     
     for (i = 0; i < DOF; i++)
     {
-        rk4firstDeriv[3][i] = firstDeriv[i];
-        rk4secondDeriv[3][i] = secondDeriv[i];
+        w->rk4firstDeriv[3][i] = w->firstDeriv[i];
+        w->rk4secondDeriv[3][i] = w->secondDeriv[i];
     }
+    for (i = 0; i < SCALAR_DOF; i++)
+        w->rk4scalarDeriv[3][i] = w->scalarDeriv[i];
     
     
     /* Add it up */
     for (i = 0; i < DOF; i++)
     {
-        average = rk4firstDeriv[0][i] 
-                + 2*rk4firstDeriv[1][i] 
-                + 2*rk4firstDeriv[2][i]
-                + rk4firstDeriv[3][i];
+        average = w->rk4firstDeriv[0][i] 
+                + 2*w->rk4firstDeriv[1][i] 
+                + 2*w->rk4firstDeriv[2][i]
+                + w->rk4firstDeriv[3][i];
                 
-        function_n1[i] = function_n[i] + (h*average)/6.0;
+        w->function_n1[i] = w->function_n[i] + (h*average)/6.0;
         
         
-        average = rk4secondDeriv[0][i] 
-                + 2*rk4secondDeriv[1][i] 
-                + 2*rk4secondDeriv[2][i]
-                + rk4secondDeriv[3][i];
+        average = w->rk4secondDeriv[0][i] 
+                + 2*w->rk4secondDeriv[1][i] 
+                + 2*w->rk4secondDeriv[2][i]
+                + w->rk4secondDeriv[3][i];
                 
-        firstDeriv_n1[i] = firstDeriv_n[i] + (h*average)/6.0;
+        w->firstDeriv_n1[i] = w->firstDeriv_n[i] + (h*average)/6.0;
+    }
+    for (i = 0; i < SCALAR_DOF; i++)
+    {
+        average = w->rk4scalarDeriv[0][i] 
+                + 2*w->rk4scalarDeriv[1][i] 
+                + 2*w->rk4scalarDeriv[2][i]
+                + w->rk4scalarDeriv[3][i];
+        
+        w->scalar_n1[i] = w->scalar_n[i] + (h*average)/6.0;
+    }
+    
+    /* Update State */
+    r = setFirstDeriv(r, w->firstDeriv_n1);
+    r = setFunction(r, w->function_n1);
+    r = setScalar(r, w->scalar_n1);
+    r.a = LinearAcceleration(sim, r, t + h);
+
+    return r;
+}
+
+/*!
+ * Dormand-Prince 5(4) embedded Runge-Kutta with adaptive step size control.
+ *
+ * Takes one accepted step from r. On entry *h is the step to try, on exit it
+ * is the step that was actually taken and *hNext is the step to try next
+ * time. Steps whose error estimate is over the tolerance are thrown
+ * away and retried smaller, never going below sim->integrator.minStep or above
+ * sim->integrator.maxStep.
+ *
+ * The seventh stage is evaluated at the end of the step, so it doubles as the
+ * acceleration of the returned state and costs nothing extra. It is also the
+ * first stage of the next step (FSAL), as long as that step starts from the
+ * state this one returned and nothing has changed the forces in between, so
+ * an accepted step costs six force evaluations and a retry six more.
+ *
+ * A step that is still over the tolerance at minStep is taken anyway, and
+ * counted in sim->work.overTolerance.
+ */
+state dopri54(simContext *sim, state r, double *h, double *hNext)
+{
+    int i, j, stage;
+    double t = r.met;
+    double step = *h;
+    double firstDerivative[DOF];
+    double function[DOF];
+    double scalar[SCALAR_DOF];
+    double error, scale, factor;
+    state trial;
+    integratorWork *w = &sim->work;
+    integratorDesc integrator = sim->integrator;
+    double tol = integrator.tolerance;
+    
+    if (tol <= 0)
+        tol = ERR;
+    if (step > integrator.maxStep)
+        step = integrator.maxStep;
+    if (step < integrator.minStep)
+        step = integrator.minStep;
+    
+    // Prime the pump
+    initilize(w, r);
+    
+    /* The first stage is where the step starts, whatever its size */
+    if (w->dopriFsal
+        && w->dopriEnd.met == t
+        && w->dopriEnd.fuelMass == r.fuelMass
+        && memcmp(&w->dopriEnd.s, &r.s, sizeof(vec)) == 0
+        && memcmp(&w->dopriEnd.U, &r.U, sizeof(vec)) == 0)
+    {
+        for (i = 0; i < DOF; i++)
+        {
+            w->dopriFirstDeriv[0][i] = w->dopriFirstDeriv[DOPRI_STAGES - 1][i];
+            w->dopriSecondDeriv[0][i] = w->dopriSecondDeriv[DOPRI_STAGES - 1][i];
+        }
+        for (i = 0; i < SCALAR_DOF; i++)
+            w->dopriScalarDeriv[0][i] = w->dopriScalarDeriv[DOPRI_STAGES - 1][i];
+    }
+    else
+    {
+        evalFirstDeriv(w, r, t);
+        evalSecondDeriv(sim, r, t);
+        evalScalarDeriv(sim, r, t);
+        for (i = 0; i < DOF; i++)
+        {
+            w->dopriFirstDeriv[0][i] = w->firstDeriv[i];
+            w->dopriSecondDeriv[0][i] = w->secondDeriv[i];
+        }
+        for (i = 0; i < SCALAR_DOF; i++)
+            w->dopriScalarDeriv[0][i] = w->scalarDeriv[i];
+    }
+    
+    for (;;)
+    {
+        trial = r;
+        
+        /* Stages */
+        for (stage = 1; stage < DOPRI_STAGES; stage++)
+        {
+            for (i = 0; i < DOF; i++)
+            {
+                firstDerivative[i] = w->firstDeriv_n[i];
+                function[i] = w->function_n[i];
+                for (j = 0; j < stage; j++)
+                {
+                    firstDerivative[i] += step*dopriA[stage][j]*w->dopriSecondDeriv[j][i];
+                    function[i] += step*dopriA[stage][j]*w->dopriFirstDeriv[j][i];
+                }
+            }
+            for (i = 0; i < SCALAR_DOF; i++)
+            {
+                scalar[i] = w->scalar_n[i];
+                for (j = 0; j < stage; j++)
+                    scalar[i] += step*dopriA[stage][j]*w->dopriScalarDeriv[j][i];
+            }
+            trial = setFirstDeriv(trial, firstDerivative);
+            trial = setFunction(trial, function);
+            trial = setScalar(trial, scalar);
+            evalFirstDeriv(w, trial, t + dopriC[stage]*step);
+            evalSecondDeriv(sim, trial, t + dopriC[stage]*step);
+            evalScalarDeriv(sim, trial, t + dopriC[stage]*step);
+            
+            for (i = 0; i < DOF; i++)
+            {
+                w->dopriFirstDeriv[stage][i] = w->firstDeriv[i];
+                w->dopriSecondDeriv[stage][i] = w->secondDeriv[i];
+            }
+            for (i = 0; i < SCALAR_DOF; i++)
+                w->dopriScalarDeriv[stage][i] = w->scalarDeriv[i];
+        }
+        
+        /* The last stage is the 5th order solution (FSAL), now get the error
+         * from the embedded 4th order one */
+        error = 0;
+        for (i = 0; i < DOF; i++)
+        {
+            double errFunction = 0;
+            double errFirstDeriv = 0;
+            for (j = 0; j < DOPRI_STAGES; j++)
+            {
+                errFunction += dopriE[j]*w->dopriFirstDeriv[j][i];
+                errFirstDeriv += dopriE[j]*w->dopriSecondDeriv[j][i];
+            }
+            
+            scale = tol + tol*fmax(fabs(w->function_n[i]), fabs(function[i]));
+            error += Square(step*errFunction/scale);
+            scale = tol + tol*fmax(fabs(w->firstDeriv_n[i]), fabs(firstDerivative[i]));
+            error += Square(step*errFirstDeriv/scale);
+        }
+        for (i = 0; i < SCALAR_DOF; i++)
+        {
+            double errScalar = 0;
+            for (j = 0; j < DOPRI_STAGES; j++)
+                errScalar += dopriE[j]*w->dopriScalarDeriv[j][i];
+            
+            scale = tol + tol*fmax(fabs(w->scalar_n[i]), fabs(scalar[i]));
+            error += Square(step*errScalar/scale);
+        }
+        error = sqrt(error / (2*DOF + SCALAR_DOF));
+        
+        // Pick the next step size
+        if (error == 0)
+            factor = MAX_SCALE;
+        else
+            factor = fmin(MAX_SCALE, fmax(MIN_SCALE, SAFETY*pow(error, -0.2)));
+        
+        // Good enough, or can't go any smaller
+        if (error <= 1.0)
+            break;
+        if (step <= integrator.minStep)
+        {
+            w->overTolerance++;
+            break;
+        }
+        
+        step = fmax(step*factor, integrator.minStep);
     }
     
     /* Update State */
-    r = setFirstDeriv(r, firstDeriv_n1);
-    r = setFunction(r, function_n1);
-    r.a = LinearAcceleration(r, t + h);
+    trial.a.i = w->secondDeriv[0];
+    trial.a.j = w->secondDeriv[1];
+    trial.a.k = w->secondDeriv[2];
+    
+    // Where the next step's first stage comes from
+    w->dopriFsal = 1;
+    w->dopriEnd = trial;
+    w->dopriEnd.met = t + step;
+    
+    *h = step;
+    *hNext = fmin(integrator.maxStep, fmax(integrator.minStep, step*factor));
+    
+    return trial;
+}
 
+/*!
+ * Dense output: the state at any time between two states that are one step
+ * apart. Position and velocity are cubic Hermite curves through the ends of
+ * the step, which is as good as RK4 itself and only needs the s, U and a 
+ * that every step already has.
+ */
+state DenseOutput(state r0, state r1, double met)
+{
+    state r;
+    double h = r1.met - r0.met;
+    double tau, h00, h10, h01, h11;
+    
+    if (h == 0)
+        return r0;
+    
+    tau = (met - r0.met) / h;
+    h00 = (2*tau - 3)*tau*tau + 1;
+    h10 = ((tau - 2)*tau + 1)*tau;
+    h01 = (3 - 2*tau)*tau*tau;
+    h11 = (tau - 1)*tau*tau;
+    
+    r.s.i = h00*r0.s.i + h10*h*r0.U.i + h01*r1.s.i + h11*h*r1.U.i;
+    r.s.j = h00*r0.s.j + h10*h*r0.U.j + h01*r1.s.j + h11*h*r1.U.j;
+    r.s.k = h00*r0.s.k + h10*h*r0.U.k + h01*r1.s.k + h11*h*r1.U.k;
+    
+    r.U.i = h00*r0.U.i + h10*h*r0.a.i + h01*r1.U.i + h11*h*r1.a.i;
+    r.U.j = h00*r0.U.j + h10*h*r0.a.j + h01*r1.U.j + h11*h*r1.a.j;
+    r.U.k = h00*r0.U.k + h10*h*r0.a.k + h01*r1.U.k + h11*h*r1.a.k;
+    
+    r.a.i = r0.a.i + tau*(r1.a.i - r0.a.i);
+    r.a.j = r0.a.j + tau*(r1.a.j - r0.a.j);
+    r.a.k = r0.a.k + tau*(r1.a.k - r0.a.k);
+    
+    r.fuelMass = r0.fuelMass + tau*(r1.fuelMass - r0.fuelMass);
+    r.met = met;
+    
     return r;
 }
 
@@ -132,15 +385,17 @@ state rk4(state r, float h)
  * BEGIN Setting up Degree of Freedom mapping
  ******************************************************************************/
 
-static void initilize(state r)
+static void initilize(integratorWork *w, state r)
 {
-    function_n[0] = r.s.i;
-    function_n[1] = r.s.j;
-    function_n[2] = r.s.k;
+    w->function_n[0] = r.s.i;
+    w->function_n[1] = r.s.j;
+    w->function_n[2] = r.s.k;
+    
+    w->firstDeriv_n[0] = r.U.i;
+    w->firstDeriv_n[1] = r.U.j;
+    w->firstDeriv_n[2] = r.U.k;
     
-    firstDeriv_n[0] = r.U.i;
-    firstDeriv_n[1] = r.U.j;
-    firstDeriv_n[2] = r.U.k;
+    w->scalar_n[0] = r.fuelMass;
 }
 
 static state setFirstDeriv(state r, double *firstDerivative)
@@ -161,39 +416,56 @@ static state setFunction(state r, double *function)
     return r;
 }
 
-static void evalSecondDeriv(state r, double t)
+static state setScalar(state r, double *scalar)
 {
-    vec accel = LinearAcceleration(r, t);
-    secondDeriv[0] = accel.i;
-    secondDeriv[1] = accel.j;
-    secondDeriv[2] = accel.k;
+    r.fuelMass = scalar[0];
+    
+    return r;
 }
 
-static void evalFirstDeriv(state r, double t)
+static void evalSecondDeriv(simContext *sim, state r, double t)
 {
-    firstDeriv[0] = r.U.i;
-    firstDeriv[1] = r.U.j;
-    firstDeriv[2] = r.U.k;
+    vec accel = LinearAcceleration(sim, r, t);
+    sim->work.secondDeriv[0] = accel.i;
+    sim->work.secondDeriv[1] = accel.j;
+    sim->work.secondDeriv[2] = accel.k;
+}
+
+static void evalFirstDeriv(integratorWork *w, state r, double t)
+{
+    w->firstDeriv[0] = r.U.i;
+    w->firstDeriv[1] = r.U.j;
+    w->firstDeriv[2] = r.U.k;
+}
+
+static void evalScalarDeriv(simContext *sim, state r, double t)
+{
+    sim->work.scalarDeriv[0] = -MDot(sim, r, t);
 }
 
 /*******************************************************************************
  * END Setting up Degree of Freedom mapping
  ******************************************************************************/
 
-static state updateState(state r, int previousStep, double point)
+static state updateState(integratorWork *w, state r, int previousStep, double point)
 {
     double firstDerivative[DOF];
     double function[DOF];
+    double scalar[SCALAR_DOF];
     int i;
     
     for (i = 0; i < DOF; i++)
     {
-        firstDerivative[i] = firstDeriv_n[i] + point*rk4secondDeriv[previousStep][i];
-        function[i] = function_n[i] + point*rk4firstDeriv[previousStep][i];
+        firstDerivative[i] = w->firstDeriv_n[i] + point*w->rk4secondDeriv[previousStep][i];
+        function[i] = w->function_n[i] + point*w->rk4firstDeriv[previousStep][i];
     }
     
+    for (i = 0; i < SCALAR_DOF; i++)
+        scalar[i] = w->scalar_n[i] + point*w->rk4scalarDeriv[previousStep][i];
+    
     r = setFirstDeriv(r, firstDerivative);
     r = setFunction(r, function);
+    r = setScalar(r, scalar);
     
     return r;
 }
@@ -1 +1,3 @@
-state rk4(state r, float h);
+state rk4(simContext *sim, state r, double h);
+state dopri54(simContext *sim, state r, double *h, double *hNext);
+state DenseOutput(state r0, state r1, double met);
@@ -11,8 +11,12 @@
 #include <time.h>
 #include "structs.h"
 #include "physics.h"
+#include "vecmath.h"
 #include "coord.h"
 #include "orbit.h"
+#include "trajfile.h"
+#include "writer.h"
+#include "format.h"
 #include "rout.h"
 
 void printHtmlFileHeader(FILE *out);
@@ -29,109 +33,303 @@ void makeStageBurnPltHeader(FILE *pltOut);
 void makeStageBurnPltSection(FILE *pltOut, state ignition, state burnout, int stage);
 void makeStageBurnPltFooter(FILE *pltOut);
 char nar(double impulse);
+static void forceLine(FILE *outfile, double jd, state r, vec thrust, double mdot);
+static void trajectory(simContext *sim, int phase, double jd, state r, const derived *d);
+static void forces(simContext *sim, double jd, state r, const derived *d);
+static void emit(simContext *sim, outputMessage *m);
+static void jsonEvent(FILE *out, const char *name, state r, const char *extraName, double extra);
+static void csvField(FILE *out, state r, double value);
 
-void PrintStateLine(FILE *outfile, double jd, state r)
-{
-    char format[512] = "";
-    char exp[8] = "%0.10e\t";
-    double lat = degrees(latitude(r));
-    double lon = degrees(longitude(r));
-    
-    strcat(format, "%0.4f  \t");    //1     Time MET
-    strcat(format, "%0.8f  \t");    //2     Time MJD
-    strcat(format, exp);            //3     X
-    strcat(format, exp);            //4     Y
-    strcat(format, exp);            //5     Z
-    strcat(format, exp);            //6     U_x
-    strcat(format, exp);            //7     U_y
-    strcat(format, exp);            //8     U_z
-    strcat(format, exp);            //9     a_x
-    strcat(format, exp);            //10    a_y
-    strcat(format, exp);            //11    a_z
-    strcat(format, exp);            //12    mass
-    strcat(format, exp);            //13    KE
-    strcat(format, exp);            //14    PE
-    strcat(format, "%0.12f\t");     //15    Lat
-    strcat(format, "%0.12f\t");     //16    Lon
-    strcat(format, exp);            //17    Alt
-    strcat(format, "%0.10f\t");     //18    Downrange
-    strcat(format, "\n");
-    
-    
-    fprintf(outfile, format
-        ,   r.met                   //1     Time MET
-        ,   jd                      //2     Time JD
-        ,   r.s.i                   //3     X
-        ,   r.s.j                   //4     Y
-        ,   r.s.k                   //5     Z
-        ,   r.U.i                   //6     U_x
-        ,   r.U.j                   //7     U_y
-        ,   r.U.k                   //8     U_z
-        ,   r.a.i                   //9     a_x
-        ,   r.a.j                   //10    a_y
-        ,   r.a.k                   //11    a_z
-        ,   RocketMass(r, r.met)    //12    mass
-        ,   KE(r, r.met)            //13    KE
-        ,   PE(r, r.met)            //14    PE
-        ,   lat                     //15    Lat
-        ,   lon                     //16    Lon
-        ,   Altitude(r)             //17    Alt
-        ,   Downrange(r));          //18    Downrange
-        
+/*!
+ * The columns of one trajectory line, for the text files or the binary one
+ */
+void StateRecord(double jd, state r, double mass, double *record)
+{
+    double radius = Position(r);
+    localFrame f = LocalFrameAt(r, radius, 1);
+    
+    record[0] = r.met;                      //1     Time MET
+    record[1] = jd;                         //2     Time JD
+    record[2] = r.s.i;                      //3     X
+    record[3] = r.s.j;                      //4     Y
+    record[4] = r.s.k;                      //5     Z
+    record[5] = r.U.i;                      //6     U_x
+    record[6] = r.U.j;                      //7     U_y
+    record[7] = r.U.k;                      //8     U_z
+    record[8] = r.a.i;                      //9     a_x
+    record[9] = r.a.j;                      //10    a_y
+    record[10] = r.a.k;                     //11    a_z
+    record[11] = mass;                      //12    mass
+    record[12] = 0.5 * mass * Square(Velocity(r));                  //13    KE
+    record[13] = (G * Me * mass)/radius - (G * Me * mass)/Re;       //14    PE
+    record[14] = degrees(f.lat);            //15    Lat
+    record[15] = degrees(f.lon);            //16    Lon
+    record[16] = radius - Re;               //17    Alt
+    record[17] = DownrangeAt(f.up);         //18    Downrange
+}
+
+void PrintStateLine(FILE *outfile, simContext *sim, double jd, state r)
+{
+    double record[TRAJ_COLUMNS];
+    
+    StateRecord(jd, r, RocketMass(sim, r, r.met), record);
+    TrajPrintRecord(outfile, record);
 }
 
 void PrintHeader(FILE *outfile)
 {
-    char header[512] = "#";
-    
-    strcat(header, "Time(s)");                  //1
-    strcat(header, "\tJulian Date     ");       //2
-    strcat(header, "\tX(m)            ");       //3
-    strcat(header, "\tY(m)            ");       //4
-    strcat(header, "\tZ(m)            ");       //5
-    strcat(header, "\tVel_x(m/s)      ");       //6
-    strcat(header, "\tVel_y(m/s)      ");       //7
-    strcat(header, "\tVel_z(m/s)      ");       //8
-    strcat(header, "\tAccel_x(m/s^2)  ");       //9
-    strcat(header, "\tAccel_y(m/s^2)  ");       //10
-    strcat(header, "\tAccel_z(m/s^2)  ");       //11
-    strcat(header, "\tMass            ");       //12
-    strcat(header, "\tKE(J)           ");       //13
-    strcat(header, "\tPE(J)           ");       //14
-    strcat(header, "\tLat(°)          ");       //15
-    strcat(header, "\tLon(°)          ");       //16
-    strcat(header, "\tAlt(m MSL)      ");       //17
-    strcat(header, "\tDownrange(m)");           //18
-    strcat(header, "\n");
-    
-    fprintf(outfile, "%s", header);
-}
-
-void PrintForceLine(FILE *outfile, double jd, state r)
-{
-    char format[512] = "";
-    char exp[8] = "%0.10e\t";
-    vec thrust = Force_Thrust(r, r.met);
-    double mdot = MDot(r, r.met);
-
-    strcat(format, "%0.4f  \t");    //1     Time MET
-    strcat(format, "%0.8f  \t");    //2     Time JD
-    strcat(format, exp);            //3     Thrust_x
-    strcat(format, exp);            //4     Thrust_y
-    strcat(format, exp);            //5     Thrust_z
-    strcat(format, exp);            //6     Mdot
-    strcat(format, exp);            //7     Mass
-    strcat(format, "\n");
-
-    fprintf(outfile, format
-        ,   r.met                   //1     Time MET
-        ,   jd                      //2     Time JD
-        ,   thrust.i                //3     Thrust_x
-        ,   thrust.j                //4     Thrust_y
-        ,   thrust.k                //5     Thrust_z
-        ,   mdot                    //6     Mdot
-        ,   r.fuelMass);            //6     Mass
+    TrajPrintHeader(outfile);
+}
+
+int Printing(simContext *sim)
+{
+    return sim->outBurn != NULL || sim->outTraj != NULL;
+}
+
+void PrintTrajectory(simContext *sim, int phase, double jd, state r)
+{
+    derived d;
+    
+    if (!Printing(sim))
+        return;
+    
+    d = Derived(sim, r);
+    trajectory(sim, phase, jd, r, &d);
+}
+
+void PrintBreak(simContext *sim, int phase)
+{
+    outputMessage m;
+    
+    if (!Printing(sim))
+        return;
+    
+    m.kind = OUT_BREAK;
+    m.phase = phase;
+    emit(sim, &m);
+}
+
+void PrintNote(simContext *sim, const char *note)
+{
+    outputMessage m;
+    
+    if (!sim->verbose)
+        return;
+    
+    m.kind = OUT_NOTE;
+    m.note = note;
+    emit(sim, &m);
+}
+
+void PrintStageResult(simContext *sim, Rocket_Stage *stage)
+{
+    outputMessage m;
+    
+    if (!sim->verbose)
+        return;
+    
+    m.kind = OUT_RESULT;
+    m.stage = stage->description.stage;
+    emit(sim, &m);
+}
+
+void PrintKml(simContext *sim, state r)
+{
+    outputMessage m;
+    
+    if (sim->outKml == NULL)
+        return;
+    
+    m.kind = OUT_KML;
+    m.r = r;
+    emit(sim, &m);
+}
+
+void PrintForces(simContext *sim, double jd, state r)
+{
+    derived d;
+    
+    if (sim->outForce == NULL)
+        return;
+    
+    d = Derived(sim, r);
+    forces(sim, jd, r, &d);
+}
+
+void PrintState(simContext *sim, unsigned int mode, double jd, state r)
+{
+    // Everything below shares the one look at the rocket
+    derived d = Derived(sim, r);
+    
+    switch (mode)
+    {
+        case INIT:
+            trajectory(sim, TRAJ_COAST, jd, r, &d);
+            PrintKml(sim, r);
+            forces(sim, jd, r, &d);
+            break;
+        case BURNING:
+            trajectory(sim, TRAJ_BURN, jd, r, &d);
+            PrintKml(sim, r);
+            forces(sim, jd, r, &d);
+            break;
+        case COASING:
+            trajectory(sim, TRAJ_COAST, jd, r, &d);
+            PrintKml(sim, r);
+            forces(sim, jd, r, &d);
+            break;
+        case SEPARATED:
+            trajectory(sim, TRAJ_SPENT, jd, r, &d);
+            forces(sim, jd, r, &d);
+            break;
+        default:
+            trajectory(sim, TRAJ_COAST, jd, r, &d);
+            break;
+    }
+}
+
+static void trajectory(simContext *sim, int phase, double jd, state r, const derived *d)
+{
+    outputMessage m;
+    
+    if (!Printing(sim))
+        return;
+    
+    m.kind = OUT_STATE;
+    m.phase = phase;
+    m.stage = sim->currentStage->description.stage;
+    m.jd = jd;
+    m.r = r;
+    m.d = *d;
+    emit(sim, &m);
+}
+
+static void forces(simContext *sim, double jd, state r, const derived *d)
+{
+    outputMessage m;
+    
+    if (sim->outForce == NULL)
+        return;
+    
+    m.kind = OUT_FORCE;
+    m.jd = jd;
+    m.r = r;
+    m.d = *d;
+    emit(sim, &m);
+}
+
+/*!
+ * Does the formatting and file writing for one message from PrintTrajectory(),
+ * PrintBreak(), PrintKml(), PrintForces(), PrintNote() or PrintStageResult().
+ * Everything it needs is in the message or the files, never sim itself or
+ * any stage that hasn't finished flying, so the writer thread can call it
+ * while sim carries on flying.
+ */
+void WriteOutput(const outputFiles *files, const outputMessage *m)
+{
+    double record[TRAJ_COLUMNS];
+    int phase = m->phase;
+    
+    switch (m->kind)
+    {
+        case OUT_STATE:
+            StateRecord(m->jd, m->r, m->d.mass, record);
+            if (files->outTraj != NULL)
+                TrajWrite(files->outTraj, m->stage, phase, record);
+            else if (phase == TRAJ_BURN)
+                TrajPrintRecord(files->outBurn, record);
+            else if (phase == TRAJ_SPENT)
+                TrajPrintRecord(files->outSpent, record);
+            else
+                TrajPrintRecord(files->outCoast, record);
+            break;
+        case OUT_BREAK:
+            if (files->outTraj != NULL)
+            {
+                TrajBreak(files->outTraj);
+                break;
+            }
+            if (phase == TRAJ_BURN || phase == TRAJ_ALL)
+                fprintf(files->outBurn, "\n");
+            if (phase == TRAJ_COAST || phase == TRAJ_ALL)
+                fprintf(files->outCoast, "\n");
+            if (phase == TRAJ_SPENT || phase == TRAJ_ALL)
+                fprintf(files->outSpent, "\n");
+            break;
+        case OUT_KML:
+            PrintKmlLine(files->outKml, m->r);
+            break;
+        case OUT_FORCE:
+            forceLine(files->outForce, m->jd, m->r, m->d.thrust, m->d.mdot);
+            break;
+        case OUT_NOTE:
+            printf("%s\n", m->note);
+            break;
+        case OUT_RESULT:
+            PrintSimResult(files->stages[m->stage]);
+            break;
+    }
+}
 
+outputFiles OutputFiles(simContext *sim)
+{
+    outputFiles files;
+    
+    files.outBurn = sim->outBurn;
+    files.outCoast = sim->outCoast;
+    files.outKml = sim->outKml;
+    files.outForce = sim->outForce;
+    files.outSpent = sim->outSpent;
+    files.outTraj = sim->outTraj;
+    files.stages = sim->stages;
+    
+    return files;
+}
+
+void PrintForceLine(FILE *outfile, simContext *sim, double jd, state r)
+{
+    derived d = Derived(sim, r);
+    
+    forceLine(outfile, jd, r, d.thrust, d.mdot);
+}
+
+static void forceLine(FILE *outfile, double jd, state r, vec thrust, double mdot)
+{
+    char line[7 * (FORMAT_MAX + 3)];
+    char *p = line;
+    
+    p = FormatFixed(p, r.met, 4);           //1     Time MET
+    p = FormatText(p, "  \t");
+    p = FormatFixed(p, jd, 8);              //2     Time JD
+    p = FormatText(p, "  \t");
+    p = FormatExp(p, thrust.i, 10);         //3     Thrust_x
+    *p++ = '\t';
+    p = FormatExp(p, thrust.j, 10);         //4     Thrust_y
+    *p++ = '\t';
+    p = FormatExp(p, thrust.k, 10);         //5     Thrust_z
+    *p++ = '\t';
+    p = FormatExp(p, mdot, 10);             //6     Mdot
+    *p++ = '\t';
+    p = FormatExp(p, r.fuelMass, 10);       //7     Mass
+    p = FormatText(p, "\t\n");
+    
+    fwrite(line, 1, p - line, outfile);
+}
+
+/**
+ * Hands m to the writer thread if there is one, otherwise writes it now
+ */
+static void emit(simContext *sim, outputMessage *m)
+{
+    outputFiles files;
+    
+    if (sim->writer != NULL)
+        WriterPush(sim->writer, sim->currentStage->description.stage, m);
+    else
+    {
+        files = OutputFiles(sim);
+        WriteOutput(&files, m);
+    }
 }
 
 void PrintSimResult(Rocket_Stage stage)
@@ -141,9 +339,124 @@ void PrintSimResult(Rocket_Stage stage)
     
     printf("%s%16.2f %s\n", "\t        Burn Time: ", burnTime, "s");
     printf("%s%16.2f %s\n", "\t Burnout Velocity: ", Velocity(burnout), "m/s");
+    if (stage.overTolerance > 0)
+        printf("\t%ld steps were over the tolerance at the integrator's minStep\n", stage.overTolerance);
     printf("\n");
 }
 
+void PrintSummary(FILE *out, simContext *sim, const char *name, int format)
+{
+    Rocket_Stage *s;
+    state separation;
+    state never;
+    int i;
+    
+    memset(&never, 0, sizeof(never));
+    
+    if (format == SUMMARY_CSV)
+    {
+        for (i = 0; i < sim->numberOfStages; i++)
+        {
+            s = &sim->stages[i];
+            // The last stage has nothing to separate from
+            separation = i < sim->numberOfStages - 1 ? s->separationState : never;
+            fprintf(out, "%s,%d", name, i + 1);
+            csvField(out, s->burnoutState, s->burnoutState.met);
+            csvField(out, s->burnoutState, Altitude(s->burnoutState));
+            csvField(out, s->burnoutState, Velocity(s->burnoutState));
+            csvField(out, s->apogeeState, s->apogeeState.met);
+            csvField(out, s->apogeeState, Altitude(s->apogeeState));
+            csvField(out, separation, separation.met);
+            csvField(out, separation, Altitude(separation));
+            csvField(out, s->splashdownState, s->splashdownState.met);
+            csvField(out, s->splashdownState, degrees(latitude(s->splashdownState)));
+            csvField(out, s->splashdownState, degrees(longitude(s->splashdownState)));
+            csvField(out, s->splashdownState, Downrange(s->splashdownState));
+            csvField(out, s->maxQState, s->maxQ);
+            csvField(out, s->maxQState, s->maxQState.met);
+            csvField(out, s->maxAccelState, s->maxAccel);
+            csvField(out, s->maxAccelState, s->maxAccelState.met);
+            fprintf(out, "\n");
+        }
+        return;
+    }
+    
+    fprintf(out, "{\"config\":");
+    JsonString(out, name);
+    fprintf(out, ",\"runTime\":%.6g,\"stages\":[", RunTime());
+    for (i = 0; i < sim->numberOfStages; i++)
+    {
+        s = &sim->stages[i];
+        separation = i < sim->numberOfStages - 1 ? s->separationState : never;
+        fprintf(out, "%s{\"stage\":%d,", i ? "," : "", i + 1);
+        jsonEvent(out, "burnout", s->burnoutState, NULL, 0);
+        fprintf(out, ",");
+        jsonEvent(out, "apogee", s->apogeeState, NULL, 0);
+        fprintf(out, ",");
+        jsonEvent(out, "separation", separation, NULL, 0);
+        fprintf(out, ",");
+        jsonEvent(out, "splashdown", s->splashdownState, NULL, 0);
+        fprintf(out, ",");
+        jsonEvent(out, "maxQ", s->maxQState, "q", s->maxQ);
+        fprintf(out, ",");
+        jsonEvent(out, "maxAcceleration", s->maxAccelState, NULL, 0);
+        fprintf(out, "}");
+    }
+    fprintf(out, "]}\n");
+}
+
+/**
+ * "name":{...} with where and when r was, or null if the stage never got
+ * there. extraName, if there is one, goes first.
+ */
+static void jsonEvent(FILE *out, const char *name, state r, const char *extraName, double extra)
+{
+    localFrame f;
+    
+    fprintf(out, "\"%s\":", name);
+    if (Position(r) == 0)
+    {
+        fprintf(out, "null");
+        return;
+    }
+    
+    f = LocalFrame(r, 1);
+    fprintf(out, "{");
+    if (extraName != NULL)
+        fprintf(out, "\"%s\":%.10g,", extraName, extra);
+    fprintf(out, "\"time\":%.10g,\"altitude\":%.10g,\"velocity\":%.10g,"
+                 "\"acceleration\":%.10g,\"lat\":%.10g,\"lon\":%.10g,"
+                 "\"downrange\":%.10g}",
+            r.met, Altitude(r), Velocity(r), Acceleration(r),
+            degrees(f.lat), degrees(f.lon), DownrangeAt(f.up));
+}
+
+void JsonString(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', out);
+        if ((unsigned char) *s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+/**
+ * ,value or just , if the stage never got to r
+ */
+static void csvField(FILE *out, state r, double value)
+{
+    if (Position(r) == 0)
+        fprintf(out, ",");
+    else
+        fprintf(out, ",%.10g", value);
+}
+
 void PrintKmlHeader(FILE *outfile)
 {
     /* KML Header */
@@ -185,8 +498,9 @@ void PrintKmlFooter(FILE *outfile)
 
 void PrintKmlLine(FILE *outfile, state r)
 {
-    double lat = degrees(latitude(r));
-    double lon = degrees(longitude(r));
+    localFrame f = LocalFrame(r, 1);
+    double lat = degrees(f.lat);
+    double lon = degrees(f.lon);
     fprintf(outfile, "          %f,%f,%#.1f\n", lon, lat, Altitude(r));
 }
 
@@ -666,11 +980,10 @@ void makeLaunchMapPlt(state burnout)
     FILE *pltOut = NULL;
     double lat0, lon0, lat1, lon1;
     double latLaunch, lonLaunch;
-    state launchState = LaunchState();
     double timeEnd = burnout.met + 600;
     
-    latLaunch = degrees(latitude(launchState));
-    lonLaunch = degrees(longitude(launchState));
+    latLaunch = degrees(LaunchFrame().lat);
+    lonLaunch = degrees(LaunchFrame().lon);
     
     lat0 = latLaunch - 7.0;
     lat1 = latLaunch + 7.0;
@@ -700,9 +1013,8 @@ void makeLaunch_3dPlt()
     FILE *pltOut;
     double lat0, lon0, lat1, lon1;
     double latLaunch, lonLaunch;
-    state launchState = LaunchState();
-    latLaunch = degrees(latitude(launchState));
-    lonLaunch = degrees(longitude(launchState));
+    latLaunch = degrees(LaunchFrame().lat);
+    lonLaunch = degrees(LaunchFrame().lon);
     
     pltOut = fopen("Output/Gnuplot/tmp/launch-3d.plt", "w");
     
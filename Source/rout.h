@@ -6,13 +6,23 @@
  * output both to the screen and to file.
  */
 
+/*!
+ * Fills in the TRAJ_COLUMNS values of one trajectory line
+ * \param jd The current time in Julian Date
+ * \param r The current rocket state
+ * \param mass The mass of the rocket in state r
+ * \param record Where to put them
+ */
+void StateRecord(double jd, state r, double mass, double *record);
+
 /*!
  * Prints a line of rocekt state to a file
  * \param outfile The file to write to
+ * \param sim The simulation the state belongs to
  * \param jd The current time in Julian Date
  * \param r The current rocket state to write
  */
-void PrintStateLine(FILE *outfile, double jd, state r);
+void PrintStateLine(FILE *outfile, simContext *sim, double jd, state r);
 
 /*!
  * Prints the header line of an output file
@@ -20,14 +30,79 @@ void PrintStateLine(FILE *outfile, double jd, state r);
  */
 void PrintHeader(FILE *outfile);
 
+/*!
+ * Whether sim is writing a trajectory, as text or binary
+ */
+int Printing(simContext *sim);
+
+/*!
+ * Writes a state to sim's trajectory, whichever kind it is writing. Does
+ * nothing if it isn't. Anything that depends on sim is worked out here, the
+ * rest is left to the writer thread if one is running.
+ * \param sim The simulation the state belongs to
+ * \param phase TRAJ_COAST, TRAJ_BURN or TRAJ_SPENT, which picks the text file
+ * \param jd The current time in Julian Date
+ * \param r The current rocket state to write
+ */
+void PrintTrajectory(simContext *sim, int phase, double jd, state r);
+
+/*!
+ * Lifts gnuplot's pen: a blank line in the text files, a new segment in the
+ * binary one.
+ * \param sim The simulation
+ * \param phase Which file, or TRAJ_ALL for all of them
+ */
+void PrintBreak(simContext *sim, int phase);
+
+/*!
+ * A line on the screen, when sim is verbose, through sim's writer like
+ * PrintTrajectory() so that it comes out in order with the other stages'
+ * \param note A string that is around for good, such as a literal
+ */
+void PrintNote(simContext *sim, const char *note);
+
+/*!
+ * PrintSimResult() for a stage of sim that has finished flying, through
+ * sim's writer like PrintNote()
+ */
+void PrintStageResult(simContext *sim, Rocket_Stage *stage);
+
+/*!
+ * A line of the KML track, through sim's writer like PrintTrajectory()
+ */
+void PrintKml(simContext *sim, state r);
+
+/*!
+ * A line of the force file, through sim's writer like PrintTrajectory()
+ */
+void PrintForces(simContext *sim, double jd, state r);
+
+/*!
+ * Everything that gets written for one state of a stage flying in mode: the
+ * trajectory line for that phase, the kml and the forces.
+ */
+void PrintState(simContext *sim, unsigned int mode, double jd, state r);
+
+/*!
+ * Writes one message from the functions above to files. Called by the writer
+ * thread, or straight away when there isn't one.
+ */
+void WriteOutput(const outputFiles *files, const outputMessage *m);
+
+/*!
+ * sim's files and stages, for WriteOutput()
+ */
+outputFiles OutputFiles(simContext *sim);
+
 /*!
  * Prints a line in the output file that tracks forces
  * \param outfile The file to write to
+ * \param sim The simulation the state belongs to
  * \param t The current time in mission elapsed time in seconds
  * \param Jd The time in Julian Date
  * \param rocket The current state
  */
-void PrintForceLine(FILE *outfile, double jd, state r);
+void PrintForceLine(FILE *outfile, simContext *sim, double jd, state r);
 
 /*!
  * Prints the results of an entire simulation to the screen.
@@ -38,6 +113,26 @@ void PrintForceLine(FILE *outfile, double jd, state r);
  * \param t_apogee The time at apogee.
  */
 void PrintSimResult();
+
+/*!
+ * The results of a flight that has been flown, with nothing else: burnout,
+ * apogee, separation, splashdown, max Q and max acceleration for every stage.
+ * As one line of JSON, or as CSV with a line per stage:
+ *
+ * config, stage, burnout time, altitude and velocity, apogee time and
+ * altitude, separation time and altitude, splashdown time, lat, lon and
+ * downrange, max Q and its time, max acceleration and its time
+ *
+ * Anything the stage never got to is left empty (null in JSON).
+ * \param name The config file the flight came from
+ * \param format SUMMARY_JSON or SUMMARY_CSV
+ */
+void PrintSummary(FILE *out, simContext *sim, const char *name, int format);
+
+/*!
+ * Writes s as a quoted JSON string, escaping anything that needs it
+ */
+void JsonString(FILE *out, const char *s);
 void PrintKmlHeader(FILE *outfile);
 void PrintKmlFooter(FILE *outfile);
 void PrintKmlLine(FILE *outfile, state r);
@@ -0,0 +1,254 @@
+/*!
+ * \file snapshot.c
+ * \brief Saved flights to carry on from
+ *
+ * Taking a snapshot is just flying with FlyAndCapture(), which copies the
+ * context a stage is forked with when the one below it separates. Carrying on
+ * is copying that context back and letting Fly() pick up from its stage.
+ *
+ * A snapshot file is a snapshotHeader followed by the parts of the context
+ * that flying changes, the clocks and scales and then every stage's design
+ * numbers, mode and states. The motors, chutes and everything else come from
+ * the config file when it is read back, which is why the header has a
+ * fingerprint of them: a snapshot saved for another rocket is ignored.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "structs.h"
+#include "orbit.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "ORBSNAP"
+#define SNAPSHOT_VERSION 1
+
+static uint64_t fingerprint(void);
+static void mix(uint64_t *hash, const void *data, size_t size);
+static void put(FILE *f, const char *fileName, const void *data, size_t size);
+static void get(FILE *f, const char *fileName, void *data, size_t size);
+
+void SnapshotTake(simContext *sim, int stage, snapshot *snap)
+{
+    if (stage <= (int) sim->currentStage->description.stage || stage >= sim->numberOfStages)
+    {
+        printf("There is no stage %d above stage %d to snapshot\n", stage, sim->currentStage->description.stage);
+        exit(1);
+    }
+
+    FlyAndCapture(sim, stage, &snap->sim);
+    snap->stage = stage;
+}
+
+void SnapshotStart(const snapshot *snap, simContext *sim)
+{
+    *sim = snap->sim;
+    sim->stages = malloc(sim->numberOfStages * sizeof(Rocket_Stage));
+    if (sim->stages == NULL)
+    {
+        printf("Out of memory for a flight from a snapshot\n");
+        exit(1);
+    }
+    memcpy(sim->stages, snap->sim.stages, sim->numberOfStages * sizeof(Rocket_Stage));
+    sim->currentStage = &sim->stages[snap->stage];
+}
+
+void SnapshotFree(snapshot *snap)
+{
+    FreeSimContext(&snap->sim);
+}
+
+void SnapshotSave(const char *fileName, const snapshot *snap)
+{
+    const simContext *sim = &snap->sim;
+    snapshotHeader header;
+    FILE *f;
+    int i;
+
+    f = fopen(fileName, "wb");
+    if (f == NULL)
+    {
+        printf("File Handle error. Couldn't open %s\n", fileName);
+        exit(1);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.stages = sim->numberOfStages;
+    header.stage = snap->stage;
+    header.fingerprint = fingerprint();
+    put(f, fileName, &header, sizeof(header));
+
+    put(f, fileName, &sim->met, sizeof(double));
+    put(f, fileName, &sim->jd, sizeof(double));
+    put(f, fileName, &sim->thrustScale, sizeof(double));
+    put(f, fileName, &sim->ispScale, sizeof(double));
+    put(f, fileName, &sim->cdScale, sizeof(double));
+    put(f, fileName, &sim->launchAngle, sizeof(double));
+    put(f, fileName, &sim->ignitionTime, sizeof(double));
+    put(f, fileName, &sim->ignitionFuelMass, sizeof(double));
+    for (i = 0; i < sim->numberOfStages; i++)
+    {
+        Rocket_Stage *st = &sim->stages[i];
+
+        put(f, fileName, &st->description.emptyMass, sizeof(double));
+        put(f, fileName, &st->description.ignitionDelay, sizeof(double));
+        put(f, fileName, &st->description.stageDelay, sizeof(double));
+        put(f, fileName, &st->mode, sizeof(unsigned int));
+        put(f, fileName, &st->initialState, sizeof(state));
+        put(f, fileName, &st->currentState, sizeof(state));
+        put(f, fileName, &st->burnoutState, sizeof(state));
+        put(f, fileName, &st->separationState, sizeof(state));
+        put(f, fileName, &st->apogeeState, sizeof(state));
+        put(f, fileName, &st->splashdownState, sizeof(state));
+        put(f, fileName, &st->maxQState, sizeof(state));
+        put(f, fileName, &st->maxAccelState, sizeof(state));
+        put(f, fileName, &st->maxQ, sizeof(double));
+        put(f, fileName, &st->maxAccel, sizeof(double));
+    }
+
+    fclose(f);
+}
+
+int SnapshotLoad(const char *fileName, int stage, snapshot *snap)
+{
+    snapshotHeader header;
+    simContext *sim = &snap->sim;
+    FILE *f;
+    int i;
+
+    f = fopen(fileName, "rb");
+    if (f == NULL)
+        return 0;
+
+    if (fread(&header, sizeof(header), 1, f) != 1
+        || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+    {
+        printf("%s isn't a snapshot\n", fileName);
+        exit(1);
+    }
+    if (header.version != SNAPSHOT_VERSION
+        || header.stages != (uint32_t) NumberOfStages()
+        || header.stage != (uint32_t) stage
+        || header.fingerprint != fingerprint())
+    {
+        fclose(f);
+        return 0;
+    }
+
+    // Everything that isn't in the file comes from the config, as usual
+    InitSimContext(sim);
+    sim->verbose = 0;
+    get(f, fileName, &sim->met, sizeof(double));
+    get(f, fileName, &sim->jd, sizeof(double));
+    get(f, fileName, &sim->thrustScale, sizeof(double));
+    get(f, fileName, &sim->ispScale, sizeof(double));
+    get(f, fileName, &sim->cdScale, sizeof(double));
+    get(f, fileName, &sim->launchAngle, sizeof(double));
+    get(f, fileName, &sim->ignitionTime, sizeof(double));
+    get(f, fileName, &sim->ignitionFuelMass, sizeof(double));
+    for (i = 0; i < sim->numberOfStages; i++)
+    {
+        Rocket_Stage *st = &sim->stages[i];
+
+        get(f, fileName, &st->description.emptyMass, sizeof(double));
+        get(f, fileName, &st->description.ignitionDelay, sizeof(double));
+        get(f, fileName, &st->description.stageDelay, sizeof(double));
+        get(f, fileName, &st->mode, sizeof(unsigned int));
+        get(f, fileName, &st->initialState, sizeof(state));
+        get(f, fileName, &st->currentState, sizeof(state));
+        get(f, fileName, &st->burnoutState, sizeof(state));
+        get(f, fileName, &st->separationState, sizeof(state));
+        get(f, fileName, &st->apogeeState, sizeof(state));
+        get(f, fileName, &st->splashdownState, sizeof(state));
+        get(f, fileName, &st->maxQState, sizeof(state));
+        get(f, fileName, &st->maxAccelState, sizeof(state));
+        get(f, fileName, &st->maxQ, sizeof(double));
+        get(f, fileName, &st->maxAccel, sizeof(double));
+    }
+    fclose(f);
+
+    sim->currentStage = &sim->stages[stage];
+    snap->stage = stage;
+    return 1;
+}
+
+/**
+ * FNV-1a over everything from the config file that a flight depends on:
+ * the launch, the integrator, the steering and every stage and motor
+ */
+static uint64_t fingerprint(void)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    simContext sim;
+    state launch = LaunchState();
+    double jd = BeginTime();
+    double h;
+    int i, j;
+
+    InitSimContext(&sim);
+    h = sim.h;
+
+    mix(&hash, &jd, sizeof(double));
+    mix(&hash, &launch.s, sizeof(vec));
+    mix(&hash, &launch.U, sizeof(vec));
+    mix(&hash, &h, sizeof(double));
+    mix(&hash, &sim.integrator.method, sizeof(unsigned int));
+    mix(&hash, &sim.integrator.tolerance, sizeof(double));
+    mix(&hash, &sim.integrator.minStep, sizeof(double));
+    mix(&hash, &sim.integrator.maxStep, sizeof(double));
+    mix(&hash, &sim.launchAngle, sizeof(double));
+    mix(&hash, &sim.heading, sizeof(vec2));
+    mix(&hash, &sim.pitch.knots, sizeof(int));
+    mix(&hash, sim.pitch.time, sim.pitch.knots * sizeof(double));
+    mix(&hash, sim.pitch.angle, sim.pitch.knots * sizeof(double));
+    for (i = 0; i < sim.numberOfStages; i++)
+    {
+        stageDesc *d = &sim.stages[i].description;
+
+        mix(&hash, &d->emptyMass, sizeof(double));
+        mix(&hash, &d->ignitionDelay, sizeof(double));
+        mix(&hash, &d->stageDelay, sizeof(double));
+        mix(&hash, &d->numOfMotors, sizeof(int));
+        for (j = 0; j < d->numOfMotors; j++)
+        {
+            mix(&hash, &d->motors[j].fuelMass, sizeof(double));
+            mix(&hash, &d->motors[j].isp, sizeof(double));
+            mix(&hash, &d->motors[j].curveLength, sizeof(int));
+            mix(&hash, d->motors[j].thrustCurve, d->motors[j].curveLength * sizeof(vec2));
+        }
+    }
+
+    FreeSimContext(&sim);
+    return hash;
+}
+
+static void mix(uint64_t *hash, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        *hash ^= p[i];
+        *hash *= 0x100000001b3ULL;
+    }
+}
+
+static void put(FILE *f, const char *fileName, const void *data, size_t size)
+{
+    if (fwrite(data, size, 1, f) != 1)
+    {
+        printf("Couldn't write %s\n", fileName);
+        exit(1);
+    }
+}
+
+static void get(FILE *f, const char *fileName, void *data, size_t size)
+{
+    if (fread(data, size, 1, f) != 1)
+    {
+        printf("%s is cut short\n", fileName);
+        exit(1);
+    }
+}
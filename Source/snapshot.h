@@ -0,0 +1,42 @@
+/*!
+ * \file snapshot.h
+ * \brief Saved flights to carry on from
+ *
+ * A snapshot is everything a simulation knows at the moment a stage starts
+ * flying: the clocks, the mode and state of every stage, and how the stages
+ * below it went all the way to the ground. Any number of flights can carry on
+ * from one, each changed however it likes first, without flying the part
+ * they all share again.
+ */
+
+/*!
+ * Flies sim from where it is to the end, and keeps a snapshot of it as stage
+ * starts flying (for stage > 0 that is when the stage below separates).
+ * \param sim A simulation that has not flown, or one from SnapshotStart()
+ * \param stage Which stage to stop at, above sim's current one
+ * \param snap Where to keep it, free it with SnapshotFree()
+ */
+void SnapshotTake(simContext *sim, int stage, snapshot *snap);
+
+/*!
+ * A fresh copy of the simulation in snap for Fly() to carry on with. It has
+ * its own stages, so it can be changed and flown without touching snap, and
+ * is freed with FreeSimContext() as usual. Anything changed about the stage
+ * it starts on is picked up, as Fly() primes that stage again.
+ */
+void SnapshotStart(const snapshot *snap, simContext *sim);
+
+void SnapshotFree(snapshot *snap);
+
+/*!
+ * Writes snap to fileName, in this machine's byte order, along with a
+ * fingerprint of the rocket and launch read from the config file.
+ */
+void SnapshotSave(const char *fileName, const snapshot *snap);
+
+/*!
+ * Reads a snapshot SnapshotSave() wrote for stage of the rocket in the config
+ * file. Returns 0, leaving snap alone, if there is no such file or it was
+ * saved for a different rocket, launch or stage.
+ */
+int SnapshotLoad(const char *fileName, int stage, snapshot *snap);
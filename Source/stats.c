@@ -0,0 +1,286 @@
+/*!
+ * \file stats.c
+ * \brief Statistics that are kept as the numbers come in
+ *
+ * Means and variances are Welford's running sums, merged with Chan's
+ * formula. Quantiles are a merging t-digest: numbers are buffered, and when
+ * the buffer fills they are sorted in with the centroids kept so far and
+ * squashed back down. How much a centroid may hold is set by the scale
+ * function k(q) = compression/(2 pi) asin(2q - 1), which lets the centroids
+ * near the middle be big and keeps the ones near the ends small, so the
+ * tails come out sharpest. A digest never holds more than about compression
+ * centroids, whatever was put in it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "structs.h"
+#include "vecmath.h"
+#include "coord.h"
+#include "physics.h"
+#include "stats.h"
+
+static void compress(tdigest *t);
+static int byMean(const void *a, const void *b);
+static double scale(double q);
+
+void StatsInit(runningStats *s)
+{
+    s->n = 0;
+    s->mean = 0;
+    s->m2 = 0;
+    s->min = INFINITY;
+    s->max = -INFINITY;
+}
+
+void StatsAdd(runningStats *s, double x)
+{
+    double delta = x - s->mean;
+
+    s->n++;
+    s->mean += delta / s->n;
+    s->m2 += delta * (x - s->mean);
+    if (x < s->min)
+        s->min = x;
+    if (x > s->max)
+        s->max = x;
+}
+
+void StatsMerge(runningStats *into, const runningStats *from)
+{
+    double n = into->n + from->n;
+    double delta = from->mean - into->mean;
+
+    if (from->n == 0)
+        return;
+
+    into->mean += delta * from->n / n;
+    into->m2 += from->m2 + delta * delta * into->n * from->n / n;
+    into->n = n;
+    into->min = fmin(into->min, from->min);
+    into->max = fmax(into->max, from->max);
+}
+
+double StatsStdDev(const runningStats *s)
+{
+    if (s->n < 2)
+        return 0;
+    return sqrt(s->m2 / (s->n - 1));
+}
+
+void DigestInit(tdigest *t)
+{
+    t->count = 0;
+    t->buffered = 0;
+    t->min = INFINITY;
+    t->max = -INFINITY;
+}
+
+void DigestAdd(tdigest *t, double x)
+{
+    if (t->buffered == DIGEST_BUFFER)
+        compress(t);
+
+    t->buffer[t->buffered].mean = x;
+    t->buffer[t->buffered].weight = 1;
+    t->buffered++;
+    t->min = fmin(t->min, x);
+    t->max = fmax(t->max, x);
+}
+
+void DigestMerge(tdigest *into, tdigest *from)
+{
+    int i;
+
+    compress(from);
+    for (i = 0; i < from->count; i++)
+    {
+        if (into->buffered == DIGEST_BUFFER)
+            compress(into);
+        into->buffer[into->buffered++] = from->c[i];
+    }
+    into->min = fmin(into->min, from->min);
+    into->max = fmax(into->max, from->max);
+}
+
+double DigestQuantile(tdigest *t, double q)
+{
+    double total = 0;
+    double target, here, next;
+    int i;
+
+    compress(t);
+    if (t->count == 0)
+        return NAN;
+
+    for (i = 0; i < t->count; i++)
+        total += t->c[i].weight;
+    target = q * total;
+
+    // Each centroid's mean sits halfway through its weight, and the smallest
+    // and largest numbers sit at the very ends
+    here = t->c[0].weight / 2;
+    if (target <= here)
+        return t->min + (t->c[0].mean - t->min) * (here > 0 ? target / here : 0);
+    for (i = 0; i < t->count - 1; i++)
+    {
+        next = here + (t->c[i].weight + t->c[i + 1].weight) / 2;
+        if (target <= next)
+            return t->c[i].mean + (t->c[i + 1].mean - t->c[i].mean) * (target - here) / (next - here);
+        here = next;
+    }
+    next = total;
+    if (next <= here)
+        return t->max;
+    return t->c[i].mean + (t->max - t->c[i].mean) * (target - here) / (next - here);
+}
+
+void FootprintInit(footprint *f, double lat, double lon, double halfWidth)
+{
+    memset(f, 0, sizeof(footprint));
+    f->lat = lat;
+    f->lon = lon;
+    f->halfWidth = halfWidth;
+}
+
+void FootprintAdd(footprint *f, double lat, double lon)
+{
+    double dlon = fmod(lon - f->lon + 540.0, 360.0) - 180.0;
+    double east = radians(dlon) * Re * cos(radians(f->lat));
+    double north = radians(lat - f->lat) * Re;
+    double deltaEast = east - f->meanEast;
+    double deltaNorth = north - f->meanNorth;
+    int i, j;
+
+    f->n++;
+    f->meanEast += deltaEast / f->n;
+    f->meanNorth += deltaNorth / f->n;
+    f->m2East += deltaEast * (east - f->meanEast);
+    f->m2North += deltaNorth * (north - f->meanNorth);
+    f->cross += deltaEast * (north - f->meanNorth);
+
+    i = (int) floor((north + f->halfWidth) / (2 * f->halfWidth) * FOOTPRINT_BINS);
+    j = (int) floor((east + f->halfWidth) / (2 * f->halfWidth) * FOOTPRINT_BINS);
+    if (i < 0 || i >= FOOTPRINT_BINS || j < 0 || j >= FOOTPRINT_BINS)
+        f->outside++;
+    else
+        f->counts[i][j]++;
+}
+
+void FootprintMerge(footprint *into, const footprint *from)
+{
+    double n = into->n + from->n;
+    double deltaEast = from->meanEast - into->meanEast;
+    double deltaNorth = from->meanNorth - into->meanNorth;
+    double w;
+    int i, j;
+
+    if (from->n == 0)
+        return;
+
+    w = into->n * from->n / n;
+    into->m2East += from->m2East + deltaEast * deltaEast * w;
+    into->m2North += from->m2North + deltaNorth * deltaNorth * w;
+    into->cross += from->cross + deltaEast * deltaNorth * w;
+    into->meanEast += deltaEast * from->n / n;
+    into->meanNorth += deltaNorth * from->n / n;
+    into->n = n;
+    into->outside += from->outside;
+    for (i = 0; i < FOOTPRINT_BINS; i++)
+        for (j = 0; j < FOOTPRINT_BINS; j++)
+            into->counts[i][j] += from->counts[i][j];
+}
+
+void FootprintEllipse(const footprint *f, double sigmas, double *lat, double *lon,
+                      double *major, double *minor, double *azimuth)
+{
+    double cee = 0, cnn = 0, cen = 0;
+    double middle, spread, theta;
+
+    if (f->n > 1)
+    {
+        cee = f->m2East / (f->n - 1);
+        cnn = f->m2North / (f->n - 1);
+        cen = f->cross / (f->n - 1);
+    }
+
+    FootprintOffset(f, f->meanEast, f->meanNorth, lat, lon);
+
+    // Eigenvalues of the 2x2 covariance, and the major axis' angle from east
+    middle = (cee + cnn) / 2;
+    spread = sqrt((cee - cnn) * (cee - cnn) / 4 + cen * cen);
+    theta = 0.5 * atan2(2 * cen, cee - cnn);
+
+    *major = sigmas * sqrt(middle + spread);
+    *minor = sigmas * sqrt(fmax(middle - spread, 0));
+    *azimuth = fmod(90.0 - theta * 180.0 / PI + 360.0, 180.0);
+}
+
+void FootprintBin(const footprint *f, int i, int j, double *lat, double *lon)
+{
+    double width = 2 * f->halfWidth / FOOTPRINT_BINS;
+
+    FootprintOffset(f, -f->halfWidth + (j + 0.5) * width,
+                       -f->halfWidth + (i + 0.5) * width, lat, lon);
+}
+
+void FootprintOffset(const footprint *f, double east, double north, double *lat, double *lon)
+{
+    *lat = f->lat + north / Re * 180.0 / PI;
+    *lon = f->lon + east / (Re * cos(radians(f->lat))) * 180.0 / PI;
+}
+
+/**
+ * Sorts the buffer in with the centroids and squashes them back down, each
+ * centroid taking neighbours until it would span more than one unit of k
+ */
+static void compress(tdigest *t)
+{
+    centroid all[DIGEST_CENTROIDS + DIGEST_BUFFER];
+    centroid current;
+    double total = 0, before = 0;
+    int n = t->count + t->buffered;
+    int i;
+
+    if (t->buffered == 0)
+        return;
+
+    memcpy(all, t->c, t->count * sizeof(centroid));
+    memcpy(all + t->count, t->buffer, t->buffered * sizeof(centroid));
+    qsort(all, n, sizeof(centroid), byMean);
+    for (i = 0; i < n; i++)
+        total += all[i].weight;
+
+    t->count = 0;
+    current = all[0];
+    for (i = 1; i < n; i++)
+    {
+        if (scale((before + current.weight + all[i].weight) / total) - scale(before / total) <= 1)
+        {
+            current.weight += all[i].weight;
+            current.mean += (all[i].mean - current.mean) * all[i].weight / current.weight;
+        }
+        else
+        {
+            t->c[t->count++] = current;
+            before += current.weight;
+            current = all[i];
+        }
+    }
+    t->c[t->count++] = current;
+    t->buffered = 0;
+}
+
+static int byMean(const void *a, const void *b)
+{
+    double x = ((const centroid *) a)->mean;
+    double y = ((const centroid *) b)->mean;
+
+    return (x > y) - (x < y);
+}
+
+static double scale(double q)
+{
+    return DIGEST_COMPRESSION / (2 * PI) * asin(2 * fmin(q, 1.0) - 1);
+}
@@ -0,0 +1,58 @@
+/*!
+ * \file stats.h
+ * \brief Statistics that are kept as the numbers come in
+ *
+ * Each of these takes a fixed amount of memory however many numbers are put
+ * in it, and two of them can be merged into one, so every thread can keep
+ * its own and they are added together at the end.
+ */
+
+/*!
+ * Mean, variance, min and max (Welford)
+ */
+void StatsInit(runningStats *s);
+void StatsAdd(runningStats *s, double x);
+void StatsMerge(runningStats *into, const runningStats *from);
+double StatsStdDev(const runningStats *s);
+
+/*!
+ * Quantiles, to within a fraction of a percent and better still near the
+ * ends (a merging t-digest, Dunning and Ertl)
+ */
+void DigestInit(tdigest *t);
+void DigestAdd(tdigest *t, double x);
+void DigestMerge(tdigest *into, tdigest *from);
+
+/*!
+ * The value q (0 to 1) of the way through everything added, NAN if nothing
+ * has been
+ */
+double DigestQuantile(tdigest *t, double q);
+
+/*!
+ * Where things landed: a FOOTPRINT_BINS square histogram of latitude and
+ * longitude centred on lat and lon (degrees), reaching halfWidth (m) each
+ * way, and the covariance of the east and north distances from there.
+ */
+void FootprintInit(footprint *f, double lat, double lon, double halfWidth);
+void FootprintAdd(footprint *f, double lat, double lon);
+void FootprintMerge(footprint *into, const footprint *from);
+
+/*!
+ * The sigmas dispersion ellipse of everything in f: the middle of it
+ * (degrees), both semi-axes (m) and which way the major axis points
+ * (degrees clockwise from north).
+ */
+void FootprintEllipse(const footprint *f, double sigmas, double *lat, double *lon,
+                      double *major, double *minor, double *azimuth);
+
+/*!
+ * Where the middle of histogram bin (i, j) is, in degrees. i goes north and
+ * j east.
+ */
+void FootprintBin(const footprint *f, int i, int j, double *lat, double *lon);
+
+/*!
+ * The latitude and longitude east and north metres from f's centre
+ */
+void FootprintOffset(const footprint *f, double east, double north, double *lat, double *lon);
@@ -1,17 +1,90 @@
+#include <stdio.h>
+#include <stdint.h>
+
 #define INIT 0
 #define BURNING 1
 #define COASING 2
 #define SEPARATED 3
 
+#define RK4 0
+#define DOPRI54 1
+
+#define OUTPUT_INTERVAL 0
+#define OUTPUT_EVENTS 1
+#define OUTPUT_THIN 2
+
+#define SUMMARY_NONE 0
+#define SUMMARY_JSON 1
+#define SUMMARY_CSV 2
+
+#define SWEEP_TIMESTEP 0
+#define SWEEP_JULIANDATE 1
+#define SWEEP_LAUNCHANGLE 2
+#define SWEEP_EMPTYMASS 3
+#define SWEEP_IGNITIONDELAY 4
+#define SWEEP_STAGEDELAY 5
+#define SWEEP_FUELMASS 6
+#define SWEEP_TOLERANCE 7
+#define SWEEP_MINSTEP 8
+#define SWEEP_MAXSTEP 9
+#define SWEEP_AZIMUTH 10
+#define SWEEP_PITCH 11
+#define SWEEP_MAX_PARAMETERS 16
+
+#define PITCH_KNOTS 8
+
+#define DIGEST_COMPRESSION 100
+#define DIGEST_CENTROIDS (DIGEST_COMPRESSION + 10)
+#define DIGEST_BUFFER (5 * DIGEST_COMPRESSION)
+#define FOOTPRINT_BINS 64
+
+#define GOAL_MAX 0
+#define GOAL_MIN 1
+#define GOAL_TARGET 2
+
+#define OUT_STATE 0
+#define OUT_BREAK 1
+#define OUT_KML 2
+#define OUT_FORCE 3
+#define OUT_NOTE 4
+#define OUT_RESULT 5
+
+#define TRAJ_COLUMNS 18
+#define TRAJ_NAME_LENGTH 24
+
+#define DOF 3
+#define SCALAR_DOF 1
+#define DOPRI_STAGES 7
+
 typedef struct {double i; double j; double k;} vec;
 typedef struct {double i; double j;} vec2;
 typedef struct {double m[3][3];} matrix3;
+typedef struct {vec east;
+                    vec north;
+                    vec up;
+                    double lat;
+                    double lon;} localFrame;
+typedef struct {double radius;
+                    double invRadius;
+                    double altitude;
+                    double speed;
+                    vec unitPosition;
+                    vec unitVelocity;
+                    double density;
+                    double dynamicPressure;} kinematics;
 
+typedef struct {double t0;
+                    double t1;
+                    double invDt;
+                    int length;
+                    double *thrust;
+                    double *impulse;} motorTable;
 typedef struct {const char *name; 
                     double fuelMass; 
                     double isp; 
                     vec2* thrustCurve; 
-                    int curveLength;} motor;
+                    int curveLength;
+                    motorTable table;} motor;
 typedef struct {double cd; double area; double agl;} chute;
 typedef struct {vec s; vec U; vec a; double fuelMass; double met;} state;
 typedef struct {unsigned int stage;
@@ -29,5 +102,237 @@ typedef struct {stageDesc description;
                     state separationState;
                     state apogeeState;
                     state splashdownState;
+                    state maxQState;
+                    state maxAccelState;
+                    double maxQ;
+                    double maxAccel;
+                    long steps;                 // Taken flying it, for the benchmark
+                    long overTolerance;         // Steps taken at minStep anyway
                     unsigned int mode;} Rocket_Stage;
-
+typedef struct {unsigned int method;
+                    double tolerance;
+                    double minStep;
+                    double maxStep;} integratorDesc;
+typedef struct {int mode;
+                    double interval;
+                    double position;
+                    double velocity;
+                    double chord;} outputPolicy;
+typedef struct {double function_n[DOF];
+                    double firstDeriv_n[DOF];
+                    double function_n1[DOF];
+                    double firstDeriv_n1[DOF];
+                    double firstDeriv[DOF];
+                    double secondDeriv[DOF];
+                    double rk4firstDeriv[4][DOF];
+                    double rk4secondDeriv[4][DOF];
+                    double dopriFirstDeriv[DOPRI_STAGES][DOF];
+                    double dopriSecondDeriv[DOPRI_STAGES][DOF];
+                    double scalar_n[SCALAR_DOF];
+                    double scalar_n1[SCALAR_DOF];
+                    double scalarDeriv[SCALAR_DOF];
+                    double rk4scalarDeriv[4][SCALAR_DOF];
+                    double dopriScalarDeriv[DOPRI_STAGES][SCALAR_DOF];
+                    int dopriFsal;              // Last stage is good for the next step
+                    state dopriEnd;             // Which starts from here
+                    long overTolerance;} integratorWork;
+typedef struct {uint32_t stage;
+                    uint32_t phase;
+                    uint64_t first;
+                    uint64_t count;} trajSegment;
+typedef struct {char magic[8];
+                    uint32_t version;
+                    uint32_t columns;
+                    uint64_t records;
+                    uint64_t dataOffset;
+                    uint64_t indexOffset;
+                    uint32_t segments;
+                    uint32_t reserved;} trajHeader;
+typedef struct {FILE *file;
+                    uint64_t records;
+                    int broken;
+                    trajSegment *index;
+                    int segments;
+                    int capacity;} trajWriter;
+typedef struct {void *map;
+                    size_t size;
+                    const trajHeader *header;
+                    const char *names;
+                    const double *data;
+                    const trajSegment *index;} trajReader;
+typedef struct {double mass;
+                    vec thrust;
+                    double mdot;} derived;
+typedef struct {char magic[8];
+                    uint32_t version;
+                    uint32_t motors;
+                    uint32_t slots;
+                    uint32_t reserved;
+                    uint64_t namesOffset;
+                    uint64_t pointsOffset;} motorLibraryHeader;
+typedef struct {uint64_t hash;
+                    uint32_t name;
+                    uint32_t nameLength;
+                    uint64_t first;
+                    uint32_t points;
+                    uint32_t reserved;} motorLibraryEntry;
+typedef struct {void *map;
+                    size_t size;
+                    const motorLibraryHeader *header;
+                    const motorLibraryEntry *slots;
+                    const char *names;
+                    const vec2 *points;} motorLibrary;
+typedef struct {char magic[8];
+                    uint32_t version;
+                    uint32_t stages;
+                    uint32_t stage;
+                    uint32_t reserved;
+                    uint64_t fingerprint;} snapshotHeader;
+typedef struct {int kind;
+                    int phase;
+                    int stage;
+                    double jd;
+                    state r;
+                    derived d;
+                    const char *note;} outputMessage;
+typedef struct {FILE *outBurn;            // Where WriteOutput() writes
+                    FILE *outCoast;
+                    FILE *outKml;
+                    FILE *outForce;
+                    FILE *outSpent;
+                    trajWriter *outTraj;
+                    Rocket_Stage *stages;} outputFiles;
+typedef struct outputWriter outputWriter;
+typedef struct staging staging;
+typedef struct {int knots;
+                    double time[PITCH_KNOTS];
+                    double angle[PITCH_KNOTS];} pitchProgram;
+typedef struct {outputPolicy policy;
+                    state *samples;
+                    double *jd;
+                    int count;
+                    int capacity;
+                    int good;
+                    int next;
+                    unsigned int mode;
+                    state printed;
+                    int anyPrinted;
+                    double lastTime;} decimator;
+typedef struct {double met;
+                    double jd;
+                    float h;
+                    integratorDesc integrator;
+                    outputPolicy output;
+                    integratorWork work;
+                    Rocket_Stage *stages;
+                    int numberOfStages;
+                    Rocket_Stage *currentStage;
+                    double currentMass;
+                    double cachedMass;
+                    double thrustScale;
+                    double ispScale;
+                    double cdScale;
+                    double launchAngle;
+                    vec2 heading;
+                    pitchProgram pitch;
+                    double ignitionTime;
+                    double ignitionFuelMass;
+                    int verbose;
+                    int concurrent;
+                    staging *staging;
+                    FILE *outBurn;
+                    FILE *outCoast;
+                    FILE *outKml;
+                    FILE *outForce;
+                    FILE *outSpent;
+                    trajWriter *outTraj;
+                    outputWriter *writer;} simContext;
+typedef struct {simContext sim;
+                    int stage;} snapshot;
+typedef struct {int runs;
+                    int threads;
+                    int batch;
+                    unsigned long seed;
+                    double thrustScale;
+                    double isp;
+                    double emptyMass;
+                    double launchAngle;
+                    double cd;
+                    double launchTime;
+                    int table;
+                    double footprint;
+                    double ignitionDelay;
+                    int branch;
+                    const char *snapshot;} dispersionDesc;
+typedef struct {const char *key;
+                    int field;
+                    int stage;
+                    int motor;
+                    int knot;
+                    double from;
+                    double to;
+                    int steps;} sweepParameter;
+typedef struct {int threads;
+                    int numberOfParameters;
+                    sweepParameter *parameters;} sweepDesc;
+typedef struct {int result;
+                    double min;
+                    double max;} optimizeConstraint;
+typedef struct {int threads;
+                    int population;
+                    int generations;
+                    unsigned long seed;
+                    double tolerance;
+                    int objective;
+                    int goal;
+                    double target;
+                    int numberOfVariables;
+                    sweepParameter *variables;
+                    int numberOfConstraints;
+                    optimizeConstraint *constraints;} optimizeDesc;
+typedef struct {double apogee;
+                    double apogeeTime;
+                    double burnoutVelocity;
+                    double burnoutAltitude;
+                    double impactLat;
+                    double impactLon;
+                    double impactTime;
+                    double downrange;
+                    double maxQ;} flightResult;
+typedef struct {double n;
+                    double mean;
+                    double m2;
+                    double min;
+                    double max;} runningStats;
+typedef struct {double mean;
+                    double weight;} centroid;
+typedef struct {int count;
+                    int buffered;
+                    double min;
+                    double max;
+                    centroid c[DIGEST_CENTROIDS];
+                    centroid buffer[DIGEST_BUFFER];} tdigest;
+typedef struct {double lat;
+                    double lon;
+                    double halfWidth;
+                    double n;
+                    double meanEast;
+                    double meanNorth;
+                    double m2East;
+                    double m2North;
+                    double cross;
+                    unsigned long long outside;
+                    unsigned long long counts[FOOTPRINT_BINS][FOOTPRINT_BINS];} footprint;
+typedef struct {double density;
+                    double pressure;
+                    double temperature;
+                    double speedOfSound;} atmosphere;
+typedef struct {double bottom;
+                    double top;
+                    double invStep;
+                    int length;
+                    const double *density;
+                    const double *pressure;
+                    const double *temperature;
+                    const double *speedOfSound;} atmosphereTable;
+typedef double (*eventFunction)(simContext *sim, state r);
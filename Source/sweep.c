@@ -0,0 +1,229 @@
+/*!
+ * \file sweep.c
+ * \brief Parameter sweeps over a grid of designs
+ *
+ * Each parameter takes steps values evenly spaced from from to to, and every
+ * combination of them is one run. Run n is numbered like an odometer, with
+ * the last parameter turning fastest, so a run's values come straight from
+ * its number and nothing has to be listed out ahead of time.
+ *
+ * Runs that crash early take a fraction of the time of the ones that make it
+ * to orbit, so they are flown with PoolRun(), which keeps every thread busy
+ * until the last one is done.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "structs.h"
+#include "vecmath.h"
+#include "coord.h"
+#include "orbit.h"
+#include "pool.h"
+#include "sweep.h"
+
+typedef struct {sweepDesc s;
+                    int runs;
+                    flightResult *results;} sweepJob;
+
+static void flyOne(void *arg, int n);
+static double value(sweepDesc s, int n, int p);
+static flightResult noFlight(void);
+
+void Sweep(sweepDesc s)
+{
+    sweepJob job;
+    struct timespec begin, end;
+    int threads;
+    FILE *out;
+    int i, p;
+
+    job.s = s;
+    job.runs = SweepRuns(s);
+    job.results = malloc(job.runs * sizeof(flightResult));
+    if (job.results == NULL)
+    {
+        printf("Out of memory for %d runs\n", job.runs);
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    threads = PoolRun(job.runs, s.threads, flyOne, &job);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("Flew %d runs on %d threads in %0.2f s\n"
+        ,   job.runs
+        ,   threads
+        ,   (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) * 1e-9);
+
+    /* One line per run */
+    out = fopen("Output/out-sweep.dat", "w");
+    if (out == NULL)
+    {
+        printf("File Handle error. Couldn't open Output/out-sweep.dat\n");
+        exit(1);
+    }
+    fprintf(out, "#Run");
+    for (p = 0; p < s.numberOfParameters; p++)
+        fprintf(out, "\t%s", s.parameters[p].key);
+    fprintf(out, "\tApogee(m)\tApogee Time(s)\tBurnout Vel(m/s)\tBurnout Alt(m)"
+                 "\tImpact Lat(°)\tImpact Lon(°)\tImpact Time(s)\tDownrange(m)\tMax Q(Pa)\n");
+    for (i = 0; i < job.runs; i++)
+    {
+        flightResult r = job.results[i];
+        fprintf(out, "%d", i);
+        for (p = 0; p < s.numberOfParameters; p++)
+            fprintf(out, "\t%0.10g", value(s, i, p));
+        fprintf(out, "\t%0.3f\t%0.3f\t%0.3f\t%0.3f\t%0.8f\t%0.8f\t%0.3f\t%0.3f\t%0.3f\n"
+            ,   r.apogee
+            ,   r.apogeeTime
+            ,   r.burnoutVelocity
+            ,   r.burnoutAltitude
+            ,   r.impactLat
+            ,   r.impactLon
+            ,   r.impactTime
+            ,   r.downrange
+            ,   r.maxQ);
+    }
+    fclose(out);
+    printf("Results in Output/out-sweep.dat\n");
+
+    free(job.results);
+}
+
+long long SweepRuns(sweepDesc s)
+{
+    long long runs = 1;
+    int p;
+
+    for (p = 0; p < s.numberOfParameters && runs <= 1 << 30; p++)
+        runs *= s.parameters[p].steps;
+
+    return runs;
+}
+
+/**
+ * Flies run n of the sweep
+ */
+static void flyOne(void *arg, int n)
+{
+    sweepJob *job = arg;
+    double values[SWEEP_MAX_PARAMETERS];
+    int p;
+
+    for (p = 0; p < job->s.numberOfParameters; p++)
+        values[p] = value(job->s, n, p);
+
+    job->results[n] = FlyWith(job->s.parameters, job->s.numberOfParameters, values);
+}
+
+/**
+ * The value parameter p has in run n
+ */
+static double value(sweepDesc s, int n, int p)
+{
+    sweepParameter *param = &s.parameters[p];
+    int i;
+
+    for (i = s.numberOfParameters - 1; i > p; i--)
+        n /= s.parameters[i].steps;
+    n %= param->steps;
+
+    if (param->steps == 1)
+        return param->from;
+    return param->from + (param->to - param->from) * n / (param->steps - 1);
+}
+
+flightResult FlyWith(sweepParameter *parameters, int n, const double *values)
+{
+    simContext sim;
+    flightResult result;
+    motor *shared;
+    int copyMotors = 0;
+    int i;
+
+    InitSimContext(&sim);
+    sim.verbose = 0;
+    sim.concurrent = 0;
+
+    // The motors are shared by every run unless this one changes them
+    for (i = 0; i < n; i++)
+        if (parameters[i].field == SWEEP_FUELMASS)
+            copyMotors = 1;
+    if (copyMotors)
+    {
+        for (i = 0; i < sim.numberOfStages; i++)
+        {
+            shared = sim.stages[i].description.motors;
+            sim.stages[i].description.motors = malloc(sim.stages[i].description.numOfMotors * sizeof(motor));
+            if (sim.stages[i].description.motors == NULL)
+            {
+                printf("Out of memory for a flight's motors\n");
+                exit(1);
+            }
+            memcpy(sim.stages[i].description.motors, shared,
+                   sim.stages[i].description.numOfMotors * sizeof(motor));
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        SetParameter(&sim, &parameters[i], values[i]);
+
+    // Step limits that cross can't be flown, so it counts as a failed flight
+    if (sim.integrator.maxStep < sim.integrator.minStep)
+        result = noFlight();
+    else
+    {
+        Fly(&sim);
+        result = FlightResult(&sim);
+    }
+
+    if (copyMotors)
+        for (i = 0; i < sim.numberOfStages; i++)
+            free(sim.stages[i].description.motors);
+    FreeSimContext(&sim);
+
+    return result;
+}
+
+void SetParameter(simContext *sim, sweepParameter *p, double x)
+{
+    stageDesc *desc = &sim->stages[p->stage].description;
+
+    switch (p->field)
+    {
+        case SWEEP_TIMESTEP:        sim->h = x; break;
+        case SWEEP_JULIANDATE:      sim->jd = x; break;
+        case SWEEP_LAUNCHANGLE:     sim->launchAngle = radians(x); break;
+        case SWEEP_AZIMUTH:         sim->heading = Heading(radians(x)); break;
+        case SWEEP_PITCH:           sim->pitch.angle[p->knot] = radians(x); break;
+        case SWEEP_EMPTYMASS:       desc->emptyMass = x; break;
+        case SWEEP_IGNITIONDELAY:   desc->ignitionDelay = x; break;
+        case SWEEP_STAGEDELAY:      desc->stageDelay = x; break;
+        case SWEEP_FUELMASS:        desc->motors[p->motor].fuelMass = x; break;
+        case SWEEP_TOLERANCE:       sim->integrator.tolerance = x; break;
+        case SWEEP_MINSTEP:         sim->integrator.minStep = x; break;
+        case SWEEP_MAXSTEP:         sim->integrator.maxStep = x; break;
+    }
+}
+
+/**
+ * The result of a flight that was never flown, NAN all through
+ */
+static flightResult noFlight(void)
+{
+    flightResult r;
+
+    r.apogee = NAN;
+    r.apogeeTime = NAN;
+    r.burnoutVelocity = NAN;
+    r.burnoutAltitude = NAN;
+    r.impactLat = NAN;
+    r.impactLon = NAN;
+    r.impactTime = NAN;
+    r.downrange = NAN;
+    r.maxQ = NAN;
+
+    return r;
+}
@@ -0,0 +1,32 @@
+/*!
+ * \file sweep.h
+ * \brief Parameter sweeps over a grid of designs
+ *
+ * Flies the rocket from the config file once for every combination of the
+ * values in the sweep section, and writes down where each one went.
+ */
+
+/*!
+ * Flies every point of the grid on a pool of threads. One line per run goes
+ * to Output/out-sweep.dat, no trajectory files are written.
+ * \param s Which config values to sweep, and on how many threads
+ */
+void Sweep(sweepDesc s);
+
+/*!
+ * How many runs there are in the whole grid
+ */
+long long SweepRuns(sweepDesc s);
+
+/*!
+ * Flies the rocket from the config file once, quietly and without any files,
+ * with each of the n parameters set to its value. If the values leave the
+ * integrator's maxStep below its minStep nothing is flown and every result
+ * is NAN.
+ */
+flightResult FlyWith(sweepParameter *parameters, int n, const double *values);
+
+/*!
+ * Puts x into sim wherever p's config key ended up (angles in degrees)
+ */
+void SetParameter(simContext *sim, sweepParameter *p, double x);
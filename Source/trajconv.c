@@ -0,0 +1,126 @@
+/*!
+ * \file trajconv.c
+ * \brief Turns a binary trajectory back into the gnuplot text files
+ *
+ * Writes out-burn.dat, out-coast.dat and out-spentStages.dat from a file
+ * written with orbit -b. Every data line comes out exactly as orbit would
+ * have written it, with a blank line after every segment so gnuplot doesn't
+ * join them up. The blank lines can still differ from orbit's own: the
+ * index only keeps each file's own segments, so the extra blank line orbit
+ * writes into every file when a stage ends isn't there.
+ *
+ * Usage: trajconv [-o directory] [-l] file.traj
+ *  -o  Where to write the .dat files (default Output)
+ *  -l  Just list the columns and segments
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "structs.h"
+#include "trajfile.h"
+#include "format.h"
+
+static void list(trajReader *t);
+static void convert(trajReader *t, const char *directory, int phase, const char *name);
+
+int main(int argc, char **argv)
+{
+    const char *directory = "Output";
+    const char *fileName = NULL;
+    int listOnly = 0;
+    trajReader *t;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            directory = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0)
+            listOnly = 1;
+        else if (argv[i][0] == '-')
+        {
+            fprintf(stderr, "Unknown switch %s\n", argv[i]);
+            exit(1);
+        }
+        else
+            fileName = argv[i];
+    }
+    if (fileName == NULL)
+    {
+        printf("Usage: trajconv [-o directory] [-l] file.traj\n");
+        exit(1);
+    }
+
+    t = TrajOpen(fileName);
+
+    if (listOnly)
+        list(t);
+    else
+    {
+        convert(t, directory, TRAJ_BURN, "out-burn.dat");
+        convert(t, directory, TRAJ_COAST, "out-coast.dat");
+        convert(t, directory, TRAJ_SPENT, "out-spentStages.dat");
+    }
+
+    TrajFree(t);
+
+    return 0;
+}
+
+static void list(trajReader *t)
+{
+    const trajSegment *s;
+    const char *phases[] = {"coast", "burn", "spent"};
+    uint32_t i;
+
+    printf("%llu records of %u columns\n",
+           (unsigned long long) t->header->records, t->header->columns);
+    for (i = 0; i < t->header->columns; i++)
+        printf("  %2u  %s\n", i + 1, TrajColumnName(t, i));
+
+    printf("%u segments\n", t->header->segments);
+    for (i = 0; i < t->header->segments; i++)
+    {
+        s = &t->index[i];
+        printf("  stage %u %-5s %8llu records from %.4f s\n",
+               s->stage + 1, s->phase < 3 ? phases[s->phase] : "?",
+               (unsigned long long) s->count, TrajRecord(t, s->first)[0]);
+    }
+}
+
+static void convert(trajReader *t, const char *directory, int phase, const char *name)
+{
+    char path[1024];
+    FILE *out;
+    const trajSegment *s;
+    uint64_t j;
+    uint32_t i;
+
+    if (t->header->columns != TRAJ_COLUMNS)
+    {
+        printf("Expected %d columns, the file has %u\n", TRAJ_COLUMNS, t->header->columns);
+        exit(1);
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    out = fopen(path, "w");
+    if (out == NULL)
+    {
+        printf("File Handle error. Couldn't open %s\n", path);
+        exit(1);
+    }
+    setvbuf(out, NULL, _IOFBF, FORMAT_BUFFER);
+
+    TrajPrintHeader(out);
+    for (i = 0; i < t->header->segments; i++)
+    {
+        s = &t->index[i];
+        if (s->phase != (uint32_t) phase)
+            continue;
+        for (j = 0; j < s->count; j++)
+            TrajPrintRecord(out, TrajRecord(t, s->first + j));
+        fprintf(out, "\n");
+    }
+
+    fclose(out);
+}
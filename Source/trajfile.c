@@ -0,0 +1,355 @@
+/*!
+ * \file trajfile.c
+ * \brief Binary trajectory files
+ *
+ * The same 18 columns as the out-*.dat text files, but written as raw
+ * little-endian doubles instead of being formatted at every step. A file is:
+ *
+ *  - a trajHeader,
+ *  - the column names, TRAJ_NAME_LENGTH bytes each,
+ *  - the records, one fixed-width row of doubles per printed state,
+ *  - the index, one trajSegment for every unbroken run of records from the
+ *    same stage and phase (coasting, burning or spent).
+ *
+ * The header is filled in last, when the number of records and where the
+ * index starts are known. The reader maps the whole file and hands out
+ * pointers straight into it.
+ *
+ * The text format lives here as well, so that the simulation and trajconv
+ * write exactly the same files.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "structs.h"
+#include "trajfile.h"
+#include "format.h"
+
+#define TRAJ_MAGIC "ORBTRAJ"
+#define TRAJ_VERSION 1
+
+static const char columnNames[TRAJ_COLUMNS][TRAJ_NAME_LENGTH] = {
+    "Time(s)", "Julian Date", "X(m)", "Y(m)", "Z(m)",
+    "Vel_x(m/s)", "Vel_y(m/s)", "Vel_z(m/s)",
+    "Accel_x(m/s^2)", "Accel_y(m/s^2)", "Accel_z(m/s^2)",
+    "Mass", "KE(J)", "PE(J)", "Lat(°)", "Lon(°)", "Alt(m MSL)",
+    "Downrange(m)"};
+
+static const char textHeader[] =
+    "#Time(s)\tJulian Date     \tX(m)            \tY(m)            "
+    "\tZ(m)            \tVel_x(m/s)      \tVel_y(m/s)      \tVel_z(m/s)      "
+    "\tAccel_x(m/s^2)  \tAccel_y(m/s^2)  \tAccel_z(m/s^2)  \tMass            "
+    "\tKE(J)           \tPE(J)           \tLat(°)          \tLon(°)          "
+    "\tAlt(m MSL)      \tDownrange(m)\n";
+
+
+static int littleEndian(void);
+static void toLittle(void *value, int size);
+static void writeOrDie(trajWriter *t, const void *data, size_t size);
+
+/*!
+ * Starts a new trajectory file, replacing whatever was there.
+ */
+trajWriter *TrajCreate(const char *fileName)
+{
+    trajWriter *t = malloc(sizeof(trajWriter));
+    trajHeader header;
+
+    if (t == NULL)
+    {
+        printf("Out of memory for %s\n", fileName);
+        exit(1);
+    }
+    t->file = fopen(fileName, "wb");
+    if (t->file == NULL)
+    {
+        printf("File Handle error. Couldn't open %s\n", fileName);
+        exit(1);
+    }
+    t->records = 0;
+    t->broken = 0;
+    t->index = NULL;
+    t->segments = 0;
+    t->capacity = 0;
+
+    // Placeholder until TrajClose() knows what goes in it
+    memset(&header, 0, sizeof(header));
+    writeOrDie(t, &header, sizeof(header));
+    writeOrDie(t, columnNames, sizeof(columnNames));
+
+    return t;
+}
+
+/*!
+ * Adds one record. A new segment is started whenever the stage or phase
+ * changes, or after a TrajBreak().
+ * \param record TRAJ_COLUMNS values, in the same order as the text files
+ */
+void TrajWrite(trajWriter *t, int stage, int phase, const double *record)
+{
+    trajSegment *segment = NULL;
+    double row[TRAJ_COLUMNS];
+    int i;
+
+    if (t->segments > 0)
+        segment = &t->index[t->segments - 1];
+
+    if (segment == NULL || t->broken
+        || segment->stage != (uint32_t) stage || segment->phase != (uint32_t) phase)
+    {
+        if (t->segments == t->capacity)
+        {
+            t->capacity = t->capacity ? 2*t->capacity : 64;
+            t->index = realloc(t->index, t->capacity * sizeof(trajSegment));
+            if (t->index == NULL)
+            {
+                printf("Out of memory for the trajectory index\n");
+                exit(1);
+            }
+        }
+        segment = &t->index[t->segments++];
+        segment->stage = stage;
+        segment->phase = phase;
+        segment->first = t->records;
+        segment->count = 0;
+        t->broken = 0;
+    }
+
+    for (i = 0; i < TRAJ_COLUMNS; i++)
+    {
+        row[i] = record[i];
+        toLittle(&row[i], sizeof(double));
+    }
+    writeOrDie(t, row, sizeof(row));
+
+    segment->count++;
+    t->records++;
+}
+
+/*!
+ * The next record starts a new segment, the binary version of the blank line
+ * gnuplot uses to lift the pen.
+ */
+void TrajBreak(trajWriter *t)
+{
+    t->broken = 1;
+}
+
+/*!
+ * Writes the index and the real header, and closes the file.
+ */
+void TrajClose(trajWriter *t)
+{
+    trajHeader header;
+    trajSegment segment;
+    int i;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRAJ_MAGIC, sizeof(TRAJ_MAGIC));
+    header.version = TRAJ_VERSION;
+    header.columns = TRAJ_COLUMNS;
+    header.records = t->records;
+    header.dataOffset = sizeof(trajHeader) + sizeof(columnNames);
+    header.indexOffset = header.dataOffset + t->records * TRAJ_COLUMNS * sizeof(double);
+    header.segments = t->segments;
+
+    for (i = 0; i < t->segments; i++)
+    {
+        segment = t->index[i];
+        toLittle(&segment.stage, sizeof(segment.stage));
+        toLittle(&segment.phase, sizeof(segment.phase));
+        toLittle(&segment.first, sizeof(segment.first));
+        toLittle(&segment.count, sizeof(segment.count));
+        writeOrDie(t, &segment, sizeof(segment));
+    }
+
+    toLittle(&header.version, sizeof(header.version));
+    toLittle(&header.columns, sizeof(header.columns));
+    toLittle(&header.records, sizeof(header.records));
+    toLittle(&header.dataOffset, sizeof(header.dataOffset));
+    toLittle(&header.indexOffset, sizeof(header.indexOffset));
+    toLittle(&header.segments, sizeof(header.segments));
+    fseek(t->file, 0, SEEK_SET);
+    writeOrDie(t, &header, sizeof(header));
+
+    fclose(t->file);
+    free(t->index);
+    free(t);
+}
+
+/*!
+ * Maps a trajectory file into memory. Nothing is copied: the records and the
+ * index are read straight out of the mapping.
+ */
+trajReader *TrajOpen(const char *fileName)
+{
+    trajReader *t;
+    struct stat info;
+    const trajHeader *header;
+    uint32_t i;
+    int fd;
+
+    if (!littleEndian())
+    {
+        printf("Reading trajectory files needs a little-endian machine\n");
+        exit(1);
+    }
+
+    fd = open(fileName, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        printf("Couldn't open %s\n", fileName);
+        exit(1);
+    }
+    if ((size_t) info.st_size < sizeof(trajHeader))
+    {
+        printf("%s is too short to be a trajectory file\n", fileName);
+        exit(1);
+    }
+
+    t = malloc(sizeof(trajReader));
+    if (t == NULL)
+    {
+        printf("Out of memory for %s\n", fileName);
+        exit(1);
+    }
+    t->size = info.st_size;
+    t->map = mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (t->map == MAP_FAILED)
+    {
+        printf("Couldn't map %s\n", fileName);
+        exit(1);
+    }
+
+    header = t->map;
+    if (memcmp(header->magic, TRAJ_MAGIC, sizeof(TRAJ_MAGIC)) != 0
+        || header->version != TRAJ_VERSION)
+    {
+        printf("%s is not a trajectory file this version can read\n", fileName);
+        exit(1);
+    }
+    if (header->dataOffset < sizeof(trajHeader) + header->columns * TRAJ_NAME_LENGTH
+        || header->indexOffset != header->dataOffset + header->records * header->columns * sizeof(double)
+        || header->indexOffset + header->segments * sizeof(trajSegment) > t->size)
+    {
+        printf("%s is cut short or damaged\n", fileName);
+        exit(1);
+    }
+
+    t->header = header;
+    t->names = (const char *) t->map + sizeof(trajHeader);
+    t->data = (const double *) ((const char *) t->map + header->dataOffset);
+    t->index = (const trajSegment *) ((const char *) t->map + header->indexOffset);
+
+    // Every segment has to be records that are really there
+    for (i = 0; i < header->segments; i++)
+    {
+        if (t->index[i].first > header->records
+            || t->index[i].count > header->records - t->index[i].first)
+        {
+            printf("%s is cut short or damaged\n", fileName);
+            exit(1);
+        }
+    }
+
+    return t;
+}
+
+/*!
+ * Record i, header->columns values long
+ */
+const double *TrajRecord(trajReader *t, uint64_t i)
+{
+    return t->data + i * t->header->columns;
+}
+
+/*!
+ * What is in a column, with its units
+ */
+const char *TrajColumnName(trajReader *t, int column)
+{
+    return t->names + column * TRAJ_NAME_LENGTH;
+}
+
+void TrajFree(trajReader *t)
+{
+    munmap(t->map, t->size);
+    free(t);
+}
+
+void TrajPrintHeader(FILE *out)
+{
+    fputs(textHeader, out);
+}
+
+/*!
+ * One record as a line of the gnuplot text files. The same characters as
+ * printing it with "%0.4f  \t%0.8f  \t", twelve "%0.10e\t",
+ * "%0.12f\t%0.12f\t%0.10e\t%0.10f\t\n", just a lot faster.
+ */
+void TrajPrintRecord(FILE *out, const double *record)
+{
+    char line[TRAJ_COLUMNS * (FORMAT_MAX + 3)];
+    char *p = line;
+    int i;
+
+    p = FormatFixed(p, record[0], 4);
+    p = FormatText(p, "  \t");
+    p = FormatFixed(p, record[1], 8);
+    p = FormatText(p, "  \t");
+    for (i = 2; i < 14; i++)
+    {
+        p = FormatExp(p, record[i], 10);
+        *p++ = '\t';
+    }
+    p = FormatFixed(p, record[14], 12);
+    *p++ = '\t';
+    p = FormatFixed(p, record[15], 12);
+    *p++ = '\t';
+    p = FormatExp(p, record[16], 10);
+    *p++ = '\t';
+    p = FormatFixed(p, record[17], 10);
+    p = FormatText(p, "\t\n");
+
+    fwrite(line, 1, p - line, out);
+}
+
+static int littleEndian(void)
+{
+    uint16_t one = 1;
+
+    return *(unsigned char *) &one == 1;
+}
+
+/**
+ * Puts value into little-endian byte order, in place
+ */
+static void toLittle(void *value, int size)
+{
+    unsigned char *bytes = value;
+    unsigned char swap;
+    int i;
+
+    if (littleEndian())
+        return;
+    for (i = 0; i < size/2; i++)
+    {
+        swap = bytes[i];
+        bytes[i] = bytes[size - 1 - i];
+        bytes[size - 1 - i] = swap;
+    }
+}
+
+static void writeOrDie(trajWriter *t, const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, t->file) != size)
+    {
+        printf("Couldn't write the trajectory file\n");
+        exit(1);
+    }
+}
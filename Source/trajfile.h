@@ -0,0 +1,15 @@
+#define TRAJ_COAST 0
+#define TRAJ_BURN 1
+#define TRAJ_SPENT 2
+#define TRAJ_ALL -1
+
+trajWriter *TrajCreate(const char *fileName);
+void TrajWrite(trajWriter *t, int stage, int phase, const double *record);
+void TrajBreak(trajWriter *t);
+void TrajClose(trajWriter *t);
+trajReader *TrajOpen(const char *fileName);
+const double *TrajRecord(trajReader *t, uint64_t i);
+const char *TrajColumnName(trajReader *t, int column);
+void TrajFree(trajReader *t);
+void TrajPrintHeader(FILE *out);
+void TrajPrintRecord(FILE *out, const double *record);
@@ -0,0 +1,199 @@
+/*!
+ * \file writer.c
+ * \brief Writes the output files on their own thread
+ *
+ * The simulation puts each thing it wants written in a ring buffer as an
+ * outputMessage and carries straight on flying. The writer thread takes them
+ * out in order and does all of the formatting and file I/O with
+ * WriteOutput().
+ *
+ * Every stage flies on its own thread once it has separated, so each stage
+ * gets a ring of its own. Only that stage's thread puts messages in and only
+ * the writer takes them out, so the rings need no locks: the stage is the
+ * only one to move head and the writer the only one to move tail. The files
+ * are written one stage after another, just as if the stages had been flown
+ * one at a time, so while an earlier stage is still falling the writer keeps
+ * the later stages' rings empty by spilling them to a temporary file, and
+ * plays that back when their turn comes. If the writer falls a whole ring
+ * behind, the stage waits for it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "structs.h"
+#include "rout.h"
+#include "writer.h"
+
+#define WRITER_RING 8192        // Messages, has to be a power of two
+#define WRITER_NAP 100000       // How long to sleep when there's nothing to do (ns)
+
+typedef struct {outputMessage ring[WRITER_RING];
+                    atomic_uint head;       // Next slot to fill
+                    atomic_uint tail;       // Next slot to write out
+                    atomic_int closed;      // Nothing more will be pushed
+                    FILE *spill;} writerChannel;
+struct outputWriter {writerChannel *channels;
+                        int count;
+                        outputFiles files;  // Copied, sim moves on while this writes
+                        pthread_t thread;};
+
+static void *writerThread(void *arg);
+static int drain(outputWriter *w, int c, int live);
+static void replay(outputWriter *w, int c);
+
+void WriterStart(simContext *sim)
+{
+    outputWriter *w = malloc(sizeof(outputWriter));
+    int c;
+
+    if (w != NULL)
+        w->channels = malloc(sim->numberOfStages * sizeof(writerChannel));
+    if (w == NULL || w->channels == NULL)
+    {
+        printf("Out of memory for the output writer\n");
+        exit(1);
+    }
+    w->count = sim->numberOfStages;
+    for (c = 0; c < w->count; c++)
+    {
+        atomic_init(&w->channels[c].head, 0);
+        atomic_init(&w->channels[c].tail, 0);
+        atomic_init(&w->channels[c].closed, 0);
+        w->channels[c].spill = NULL;
+    }
+    w->files = OutputFiles(sim);
+
+    if (pthread_create(&w->thread, NULL, writerThread, w) != 0)
+    {
+        printf("Couldn't start the output writer\n");
+        exit(1);
+    }
+    sim->writer = w;
+}
+
+void WriterStop(simContext *sim)
+{
+    outputWriter *w = sim->writer;
+    int c;
+
+    if (w == NULL)
+        return;
+
+    for (c = 0; c < w->count; c++)
+        WriterClose(w, c);
+    pthread_join(w->thread, NULL);
+    free(w->channels);
+    free(w);
+    sim->writer = NULL;
+}
+
+void WriterClose(outputWriter *w, int channel)
+{
+    atomic_store_explicit(&w->channels[channel].closed, 1, memory_order_release);
+}
+
+void WriterPush(outputWriter *w, int channel, const outputMessage *m)
+{
+    writerChannel *ch = &w->channels[channel];
+    unsigned int head = atomic_load_explicit(&ch->head, memory_order_relaxed);
+
+    // Full, let the writer catch up
+    while (head - atomic_load_explicit(&ch->tail, memory_order_acquire) >= WRITER_RING)
+        sched_yield();
+
+    ch->ring[head & (WRITER_RING - 1)] = *m;
+    atomic_store_explicit(&ch->head, head + 1, memory_order_release);
+}
+
+static void *writerThread(void *arg)
+{
+    outputWriter *w = arg;
+    writerChannel *ch;
+    struct timespec nap = {0, WRITER_NAP};
+    int current = 0;
+    int busy, c;
+
+    while (current < w->count)
+    {
+        busy = 0;
+        for (c = current; c < w->count; c++)
+            busy += drain(w, c, c == current);
+
+        // Only finished once everything pushed before it closed has been
+        // written, then the next stage's turn starts with what it has said
+        // so far
+        ch = &w->channels[current];
+        if (atomic_load_explicit(&ch->closed, memory_order_acquire)
+            && atomic_load_explicit(&ch->head, memory_order_acquire)
+               == atomic_load_explicit(&ch->tail, memory_order_relaxed))
+        {
+            current++;
+            if (current < w->count)
+                replay(w, current);
+            continue;
+        }
+
+        if (!busy)
+            nanosleep(&nap, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * Empties channel c's ring, into the files if it is live and into its spill
+ * file if it isn't. Returns how many messages there were.
+ */
+static int drain(outputWriter *w, int c, int live)
+{
+    writerChannel *ch = &w->channels[c];
+    unsigned int tail = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ch->head, memory_order_acquire);
+    int n = head - tail;
+
+    if (n == 0)
+        return 0;
+
+    if (!live && ch->spill == NULL)
+    {
+        ch->spill = tmpfile();
+        if (ch->spill == NULL)
+        {
+            printf("Couldn't open a spill file for stage %d's output\n", c + 1);
+            exit(1);
+        }
+    }
+
+    while (tail != head)
+    {
+        if (live)
+            WriteOutput(&w->files, &ch->ring[tail & (WRITER_RING - 1)]);
+        else
+            fwrite(&ch->ring[tail & (WRITER_RING - 1)], sizeof(outputMessage), 1, ch->spill);
+        tail++;
+        atomic_store_explicit(&ch->tail, tail, memory_order_release);
+    }
+
+    return n;
+}
+
+/**
+ * Writes out everything channel c spilled while it waited its turn
+ */
+static void replay(outputWriter *w, int c)
+{
+    writerChannel *ch = &w->channels[c];
+    outputMessage m;
+
+    if (ch->spill == NULL)
+        return;
+
+    rewind(ch->spill);
+    while (fread(&m, sizeof(outputMessage), 1, ch->spill) == 1)
+        WriteOutput(&w->files, &m);
+    fclose(ch->spill);
+    ch->spill = NULL;
+}
@@ -0,0 +1,31 @@
+/*! 
+ * \file writer.h
+ * \brief Writes the output files on their own thread
+ */
+
+/*!
+ * Starts a thread to do all of sim's file writing from here on. Everything
+ * that goes through PrintTrajectory(), PrintBreak(), PrintKml(),
+ * PrintForces(), PrintNote() and PrintStageResult() is queued for it instead
+ * of written, with one queue per stage.
+ * \param sim A simulation with its output files open
+ */
+void WriterStart(simContext *sim);
+
+/*!
+ * Waits for the writer to finish everything it has been given and stops it.
+ * sim's files are all written up to date, and can be closed.
+ */
+void WriterStop(simContext *sim);
+
+/*!
+ * Queues m for the writer on channel (the stage it came from). Only ever
+ * called from the thread flying that stage. Waits if the queue is full.
+ */
+void WriterPush(outputWriter *w, int channel, const outputMessage *m);
+
+/*!
+ * Says nothing more is coming on channel, so the writer can move on to the
+ * next stage's output once it has written this one's.
+ */
+void WriterClose(outputWriter *w, int channel);
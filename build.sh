@@ -13,9 +13,20 @@ fi
 
 cd Source
 
-gcc orbit.c physics.c vecmath.c coord.c rout.c rk4.c -lm -lconfig -o ../Build/orbit
+# The batch propagator wants to be vectorized
+gcc -c -O3 -ffast-math -fopenmp-simd batch.c -o ../Build/batch.o
+gcc orbit.c physics.c vecmath.c coord.c rout.c rk4.c montecarlo.c atmosphere.c events.c kepler.c trajfile.c writer.c decimate.c format.c motors.c pool.c sweep.c optimize.c stats.c snapshot.c bench.c ../Build/batch.o -lm -lconfig -lpthread -o ../Build/orbit
+# Turns orbit -b's binary trajectory back into the text files
+gcc trajconv.c trajfile.c format.c -lm -o ../Build/trajconv
+# Packs a directory of thrust curves into one file orbit can map
+gcc motorlib.c motors.c -o ../Build/motorlib
 
 echo "Done."
 
 cd ..
 
+# ./build.sh bench [json|csv] times the hot paths flying sample.cfg
+if [ "$1" = "bench" ];
+then
+   Build/orbit -c sample.cfg -B $2
+fi
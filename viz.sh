@@ -2,6 +2,12 @@
 
 echo "Visualizing..."
 
+# Flown with -b, so make the text files gnuplot wants
+if [ -f Output/out.traj ];
+then
+   ./Build/trajconv Output/out.traj
+fi
+
 gnuplot Output/Gnuplot/ascent.plt
 gnuplot Output/Gnuplot/ascent-alt.plt
 gnuplot Output/Gnuplot/ascent-toApogee.plt